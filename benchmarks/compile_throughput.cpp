@@ -0,0 +1,53 @@
+//
+// Created by cycastic on 10/19/26.
+//
+
+// Measures how many functions per second the orchestrator can rebuild, which is what a config change costs
+// Usage: microjit_compile_throughput [function count] [rounds]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <microjit/orchestrator.h>
+
+typedef MicroJITOrchestrator::InstanceWrapper<int, int> Instance;
+
+// A loop with a nested branch, so that every compilation goes through frame, branch and scope bookkeeping
+static void build(Instance& p_instance){
+    auto scope = p_instance->get_function()->get_main_scope();
+    auto parser = scope->primitive_binary_expression_parser();
+    auto counter = scope->create_variable<int>();
+    scope->construct_from_argument(counter, 0);
+    auto loop = scope->while_branch(parser->parse(microjit::AbstractOperation::BINARY_LESSER,
+                                                  counter->value_reference(), microjit::ImmediateValue::create(100)));
+    loop->assign_from_primitive_atomic_expression(counter, parser->parse(microjit::AbstractOperation::BINARY_ADD,
+                                                                         counter->value_reference(),
+                                                                         microjit::ImmediateValue::create(3)));
+    auto past_half = loop->if_branch(parser->parse(microjit::AbstractOperation::BINARY_GREATER,
+                                              counter->value_reference(), microjit::ImmediateValue::create(50)));
+    past_half->assign_from_primitive_atomic_expression(counter, parser->parse(microjit::AbstractOperation::BINARY_ADD,
+                                                                         counter->value_reference(),
+                                                                         microjit::ImmediateValue::create(1)));
+    scope->function_return(counter);
+}
+
+int main(int argc, char** argv){
+    const size_t function_count = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 256;
+    const size_t rounds = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 20;
+    auto orchestrator = microjit::orchestrator();
+    auto instances = orchestrator->create_instances<int, int>(function_count);
+    for (auto& instance : instances) build(instance);
+    // First compilation, not measured
+    for (auto& instance : instances) instance.recompile();
+
+    const auto start = std::chrono::steady_clock::now();
+    for (size_t round = 0; round < rounds; round++){
+        for (auto& instance : instances) instance.recompile();
+    }
+    const auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    const auto compiled = double(function_count * rounds);
+    std::printf("%zu functions x %zu rounds: %.3f s, %.0f functions/s\n",
+                function_count, rounds, elapsed, compiled / elapsed);
+    // Make sure the rebuilt code still runs
+    return instances.empty() || instances[0](0) == 100 ? 0 : 1;
+}
@@ -0,0 +1,47 @@
+//
+// Created by cycastic on 10/19/26.
+//
+
+// Counts the atomic reference count operations it takes to compile and call a function of about 1000 instructions
+// Needs the library built with MICROJIT_COUNT_REFCOUNT_OPS, otherwise every count reads 0
+// Usage: microjit_refcount_ops [instruction count]
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <microjit/orchestrator.h>
+
+typedef MicroJITOrchestrator::InstanceWrapper<int, int> Instance;
+
+// One assignment per instruction, on top of the declaration, the construction and the return
+static void build(Instance& p_instance, size_t p_instruction_count){
+    auto scope = p_instance->get_function()->get_main_scope();
+    auto parser = scope->primitive_binary_expression_parser();
+    auto counter = scope->create_variable<int>();
+    scope->construct_from_argument(counter, 0);
+    for (size_t i = 3; i < p_instruction_count; i++){
+        scope->assign_from_primitive_atomic_expression(counter, parser->parse(microjit::AbstractOperation::BINARY_ADD,
+                                                                              counter->value_reference(),
+                                                                              microjit::ImmediateValue::create(1)));
+    }
+    scope->function_return(counter);
+}
+
+int main(int argc, char** argv){
+    const size_t instruction_count = std::max<size_t>(argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1000, 3);
+    auto orchestrator = microjit::orchestrator();
+    auto instance = orchestrator->create_instance<int, int>();
+    const auto before_build = SafeRefCount::get_op_count();
+    build(instance, instruction_count);
+    const auto before_compile = SafeRefCount::get_op_count();
+    instance.recompile();
+    const auto before_call = SafeRefCount::get_op_count();
+    const auto result = instance(0);
+    const auto after_call = SafeRefCount::get_op_count();
+    std::printf("%zu instructions\n", instruction_count);
+    std::printf("building: %llu atomic refcount ops\n", (unsigned long long)(before_compile - before_build));
+    std::printf("compiling: %llu atomic refcount ops\n", (unsigned long long)(before_call - before_compile));
+    std::printf("calling: %llu atomic refcount ops\n", (unsigned long long)(after_call - before_call));
+    // Make sure the compiled code still runs
+    return result == int(instruction_count - 3) ? 0 : 1;
+}
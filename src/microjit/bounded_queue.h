@@ -0,0 +1,122 @@
+//
+// Created by cycastic on 10/19/26.
+//
+
+#ifndef MICROJIT_BOUNDED_QUEUE_H
+#define MICROJIT_BOUNDED_QUEUE_H
+
+#include <mutex>
+#include <deque>
+#include <atomic>
+#include <cstdint>
+#include <utility>
+#include "def.h"
+
+namespace microjit {
+    // Fixed capacity multi-producer multi-consumer ring (Vyukov), neither side takes a lock
+    // Every cell carries a sequence number telling whether it is ready to be written or read for the current lap
+    template <class T>
+    class BoundedQueue {
+    private:
+        struct Cell {
+            std::atomic<size_t> sequence{};
+            T data{};
+        };
+        const size_t mask;
+        Cell* const cells;
+        alignas(64) std::atomic<size_t> enqueue_position{};
+        alignas(64) std::atomic<size_t> dequeue_position{};
+
+        static size_t round_capacity(size_t p_capacity) {
+            size_t re = 2;
+            while (re < p_capacity) re <<= 1;
+            return re;
+        }
+    public:
+        // p_capacity is rounded up to a power of two
+        explicit BoundedQueue(size_t p_capacity) : mask(round_capacity(p_capacity) - 1), cells(new Cell[mask + 1]) {
+            for (size_t i = 0; i <= mask; i++) cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        BoundedQueue(const BoundedQueue&) = delete;
+        ~BoundedQueue() { delete[] cells; }
+
+        // p_value is only moved from on success, returns false if the queue is full
+        bool try_push(T& p_value) {
+            auto position = enqueue_position.load(std::memory_order_relaxed);
+            Cell* cell;
+            while (true) {
+                cell = &cells[position & mask];
+                const auto sequence = cell->sequence.load(std::memory_order_acquire);
+                const auto diff = (intptr_t)sequence - (intptr_t)position;
+                if (diff == 0) {
+                    if (enqueue_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) break;
+                } else if (diff < 0) return false;
+                else position = enqueue_position.load(std::memory_order_relaxed);
+            }
+            cell->data = std::move(p_value);
+            cell->sequence.store(position + 1, std::memory_order_release);
+            return true;
+        }
+        // Returns false if the queue is empty or if the oldest element is still being written
+        bool try_pop(T& r_value) {
+            auto position = dequeue_position.load(std::memory_order_relaxed);
+            Cell* cell;
+            while (true) {
+                cell = &cells[position & mask];
+                const auto sequence = cell->sequence.load(std::memory_order_acquire);
+                const auto diff = (intptr_t)sequence - (intptr_t)(position + 1);
+                if (diff == 0) {
+                    if (dequeue_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) break;
+                } else if (diff < 0) return false;
+                else position = dequeue_position.load(std::memory_order_relaxed);
+            }
+            r_value = std::move(cell->data);
+            cell->sequence.store(position + mask + 1, std::memory_order_release);
+            return true;
+        }
+        // A hint, may be stale by the time it returns
+        _NO_DISCARD_ bool empty() const {
+            return enqueue_position.load(std::memory_order_seq_cst) == dequeue_position.load(std::memory_order_seq_cst);
+        }
+        _NO_DISCARD_ size_t capacity() const { return mask + 1; }
+
+        BoundedQueue& operator=(const BoundedQueue&) = delete;
+    };
+
+    // Unbounded queue that runs on a BoundedQueue and only falls back to a locked deque while the ring is full
+    // Once something spilled, pushes keep spilling until consumers drained the spill,
+    // so elements pushed by one thread come out in the order they were pushed
+    template <class T>
+    class SpillingQueue {
+    private:
+        BoundedQueue<T> ring;
+        std::mutex spill_lock{};
+        std::deque<T> spill{};
+        std::atomic<size_t> spill_count{};
+    public:
+        explicit SpillingQueue(size_t p_ring_capacity = 1024) : ring(p_ring_capacity) {}
+
+        void push(T&& p_value) {
+            if (likely(!spill_count.load(std::memory_order_acquire)) && ring.try_push(p_value)) return;
+            std::lock_guard<std::mutex> guard(spill_lock);
+            spill.push_back(std::move(p_value));
+            spill_count.fetch_add(1, std::memory_order_release);
+        }
+        bool try_pop(T& r_value) {
+            if (ring.try_pop(r_value)) return true;
+            if (!spill_count.load(std::memory_order_acquire)) return false;
+            std::lock_guard<std::mutex> guard(spill_lock);
+            if (spill.empty()) return false;
+            r_value = std::move(spill.front());
+            spill.pop_front();
+            spill_count.fetch_sub(1, std::memory_order_release);
+            return true;
+        }
+        // A hint, may be stale by the time it returns
+        _NO_DISCARD_ bool empty() const {
+            return ring.empty() && !spill_count.load(std::memory_order_seq_cst);
+        }
+    };
+}
+
+#endif //MICROJIT_BOUNDED_QUEUE_H
@@ -0,0 +1,191 @@
+//
+// Created by cycastic on 10/19/26.
+//
+
+#include "code_heap.h"
+#include "utils.h"
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static constexpr size_t huge_page_size = 2 * 1024 * 1024;
+
+static _ALWAYS_INLINE_ size_t align_up(size_t p_value, size_t p_alignment){
+    return ((p_value + p_alignment - 1) / p_alignment) * p_alignment;
+}
+
+// Memory files are shmem, which ignores MADV_HUGEPAGE unless shmem_enabled selects one of these modes
+static bool shmem_allows_huge_pages(){
+    std::ifstream file("/sys/kernel/mm/transparent_hugepage/shmem_enabled");
+    std::string modes{};
+    if (!std::getline(file, modes)) return false;
+    // The selected mode is the bracketed one, e.g. "always within_size [advise] never deny force"
+    const auto begin = modes.find('[');
+    const auto end = modes.find(']', begin);
+    if (begin == std::string::npos || end == std::string::npos) return false;
+    const auto mode = modes.substr(begin + 1, end - begin - 1);
+    return mode == "advise" || mode == "always" || mode == "within_size" || mode == "force";
+}
+
+microjit::CodeHeap::CodeHeap(const microjit::CodeHeapSettings &p_settings) {
+    if (p_settings.reserved_size == 0) return;
+    if (p_settings.hot_arena_size > p_settings.reserved_size) MJ_RAISE("Hot arena is larger than the code heap");
+#ifdef __linux__
+    const auto alignment = p_settings.use_huge_pages ? huge_page_size : size_t(sysconf(_SC_PAGESIZE));
+    const auto size = align_up(p_settings.reserved_size, alignment);
+    // Over-reserve so the region can be aligned to the huge page boundary
+    auto mapping_size = size + (p_settings.use_huge_pages ? huge_page_size : 0);
+    auto mapping = (uint8_t*)mmap(nullptr, mapping_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mapping == MAP_FAILED) MJ_RAISE("Failed to reserve code heap");
+    auto executable = (uint8_t*)align_up((size_t)mapping, alignment);
+    // Give back the unaligned head and tail
+    if (executable != mapping) munmap(mapping, executable - mapping);
+    auto tail = (mapping + mapping_size) - (executable + size);
+    if (tail > 0) munmap(executable + size, tail);
+    // Both views share a memory file, pages are only backed once they are written to
+    const auto file = memfd_create("microjit-code-heap", MFD_CLOEXEC);
+    void* writable = MAP_FAILED;
+    bool mapped = file >= 0 && ftruncate(file, off_t(size)) == 0 &&
+                  mmap(executable, size, PROT_READ | PROT_EXEC, MAP_SHARED | MAP_FIXED, file, 0) != MAP_FAILED;
+    if (mapped) writable = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+    if (file >= 0) close(file);
+    // Executable file mappings can be denied (SELinux execmem, hardened kernels), AsmJit then places the code
+    if (writable == MAP_FAILED) {
+        munmap(executable, size);
+        return;
+    }
+    region = executable;
+    writable_region = (uint8_t*)writable;
+    region_size = size;
+#if defined(MADV_HUGEPAGE)
+    if (p_settings.use_huge_pages && shmem_allows_huge_pages()) {
+        huge_pages = madvise(region, region_size, MADV_HUGEPAGE) == 0;
+        madvise(writable_region, region_size, MADV_HUGEPAGE);
+    }
+#endif
+    auto hot_size = align_up(p_settings.hot_arena_size, allocation_alignment);
+    arenas[ARENA_HOT].begin = region;
+    arenas[ARENA_HOT].end = region + hot_size;
+    arenas[ARENA_COLD].begin = region + hot_size;
+    arenas[ARENA_COLD].end = region + region_size;
+    for (auto& arena : arenas) arena.top = arena.begin;
+#endif
+}
+
+microjit::CodeHeap::~CodeHeap() {
+    if (region) munmap(region, region_size);
+    if (writable_region) munmap(writable_region, region_size);
+}
+
+bool microjit::CodeHeap::owns(const void *p_ptr) const {
+    return p_ptr >= region && p_ptr < region + region_size;
+}
+
+uint8_t *microjit::CodeHeap::take_from_free_list(microjit::CodeHeap::ArenaState &p_arena, size_t p_size) {
+    for (auto it = p_arena.free_blocks.begin(); it != p_arena.free_blocks.end(); it++){
+        if (it->second < p_size) continue;
+        auto ptr = it->first;
+        auto remaining = it->second - p_size;
+        p_arena.free_blocks.erase(it);
+        if (remaining) p_arena.free_blocks[ptr + p_size] = remaining;
+        return ptr;
+    }
+    return nullptr;
+}
+
+uint8_t *microjit::CodeHeap::take_from_top(microjit::CodeHeap::ArenaState &p_arena, size_t p_size) {
+    if (size_t(p_arena.end - p_arena.top) < p_size) return nullptr;
+    auto ptr = p_arena.top;
+    p_arena.top += p_size;
+    return ptr;
+}
+
+void microjit::CodeHeap::give_back(microjit::CodeHeap::ArenaState &p_arena, uint8_t *p_ptr, size_t p_size) {
+    auto next = p_arena.free_blocks.lower_bound(p_ptr);
+    // Merge with the following block
+    if (next != p_arena.free_blocks.end() && p_ptr + p_size == next->first){
+        p_size += next->second;
+        next = p_arena.free_blocks.erase(next);
+    }
+    // Merge with the preceding block
+    if (next != p_arena.free_blocks.begin()){
+        auto prev = std::prev(next);
+        if (prev->first + prev->second == p_ptr){
+            prev->second += p_size;
+            p_ptr = prev->first;
+            p_size = prev->second;
+            p_arena.free_blocks.erase(prev);
+        }
+    }
+    // Merge with the untouched tail
+    if (p_ptr + p_size == p_arena.top) {
+        p_arena.top = p_ptr;
+        return;
+    }
+    p_arena.free_blocks[p_ptr] = p_size;
+}
+
+void *microjit::CodeHeap::allocate(size_t p_size, microjit::CodeHeap::Arena p_arena, bool p_compact) {
+    if (!region || p_size == 0) return nullptr;
+    p_size = align_up(p_size, allocation_alignment);
+    // Prefer the requested arena, spill into the other one if it is full
+    const Arena order[ARENA_MAX] = { p_arena, p_arena == ARENA_HOT ? ARENA_COLD : ARENA_HOT };
+    for (auto arena_type : order){
+        auto& arena = arenas[arena_type];
+        auto ptr = p_compact ? take_from_free_list(arena, p_size) : take_from_top(arena, p_size);
+        if (!ptr) ptr = p_compact ? take_from_top(arena, p_size) : take_from_free_list(arena, p_size);
+        if (!ptr) continue;
+        arena.used_bytes += p_size;
+        arena.allocation_count++;
+        allocations[(size_t)ptr] = Allocation{ p_size, arena_type };
+        return ptr;
+    }
+    return nullptr;
+}
+
+bool microjit::CodeHeap::release(void *p_ptr) {
+    auto it = allocations.find((size_t)p_ptr);
+    if (it == allocations.end()) return false;
+    auto& arena = arenas[it->second.arena];
+    give_back(arena, (uint8_t*)p_ptr, it->second.size);
+    arena.used_bytes -= it->second.size;
+    arena.allocation_count--;
+    allocations.erase(it);
+    return true;
+}
+
+microjit::CodeHeap::ArenaStatistics microjit::CodeHeap::arena_statistics(const microjit::CodeHeap::ArenaState &p_arena) {
+    ArenaStatistics re{};
+    re.capacity = p_arena.end - p_arena.begin;
+    re.used_bytes = p_arena.used_bytes;
+    re.allocation_count = p_arena.allocation_count;
+    re.largest_free_block = p_arena.end - p_arena.top;
+    re.free_bytes = re.largest_free_block;
+    for (const auto& block : p_arena.free_blocks){
+        re.free_bytes += block.second;
+        if (block.second > re.largest_free_block) re.largest_free_block = block.second;
+    }
+    re.fragmentation = re.free_bytes ? 1.0 - (double(re.largest_free_block) / double(re.free_bytes)) : 0.0;
+    return re;
+}
+
+microjit::CodeHeap::Statistics microjit::CodeHeap::get_statistics() const {
+    Statistics re{};
+    re.reserved_bytes = region_size;
+    re.huge_pages = huge_pages;
+    for (uint8_t i = 0; i < ARENA_MAX; i++){
+        re.arenas[i] = arena_statistics(arenas[i]);
+    }
+    if (!region) return re;
+    const auto page_size = size_t(sysconf(_SC_PAGESIZE));
+    std::vector<unsigned char> residency((region_size + page_size - 1) / page_size);
+    if (mincore(region, region_size, residency.data()) == 0){
+        for (auto page : residency){
+            if (page & 1) re.resident_bytes += page_size;
+        }
+    }
+    return re;
+}
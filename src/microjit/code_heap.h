@@ -0,0 +1,111 @@
+//
+// Created by cycastic on 10/19/26.
+//
+
+#ifndef MICROJIT_CODE_HEAP_H
+#define MICROJIT_CODE_HEAP_H
+
+#include <map>
+#include <unordered_map>
+#include <cstdint>
+#include <cstddef>
+#include "def.h"
+
+namespace microjit {
+    struct CodeHeapSettings {
+        // Size of the reserved region, 0 to let AsmJit place the code instead
+        size_t reserved_size{};
+        // Portion of the reserved region dedicated to hot functions
+        size_t hot_arena_size{};
+        // Back the region with transparent huge pages (Linux only)
+        // The region is a memory file, i.e. shmem, so this needs /sys/kernel/mm/transparent_hugepage/shmem_enabled
+        // to be advise, always, within_size or force. Statistics::huge_pages tells whether it took
+        bool use_huge_pages{};
+        // Pack hot functions at the lowest free address of the hot arena when they are recompiled
+        bool compact_hot_functions{};
+        // Amount of registered heat needed for a function to be considered hot
+        size_t hot_threshold{1024};
+    };
+
+    // A single reserved region, split into a hot and a cold arena, from which executable code is allocated
+    // The region is mapped twice, executable and writable, so that no page is ever both (W^X)
+    // Code is copied in through get_writable_address and run from the executable view
+    // Not thread-safe, MicroJITRuntime guards it with its own mutex
+    class CodeHeap {
+    public:
+        enum Arena : uint8_t {
+            ARENA_HOT,
+            ARENA_COLD,
+            ARENA_MAX,
+        };
+        struct ArenaStatistics {
+            size_t capacity;
+            size_t used_bytes;
+            size_t free_bytes;
+            size_t largest_free_block;
+            size_t allocation_count;
+            // 0 when all free memory is contiguous, close to 1 when it is scattered in small holes
+            double fragmentation;
+        };
+        struct Statistics {
+            size_t reserved_bytes;
+            // Pages of the region that are currently backed by physical memory
+            size_t resident_bytes;
+            // Whether huge pages were asked for and the kernel allows them for shmem
+            bool huge_pages;
+            ArenaStatistics arenas[ARENA_MAX];
+        };
+    private:
+        static constexpr size_t allocation_alignment = 64;
+
+        struct ArenaState {
+            uint8_t* begin;
+            uint8_t* end;
+            // Everything above top has never been handed out
+            uint8_t* top;
+            // Address to size, coalesced on release
+            std::map<uint8_t*, size_t> free_blocks;
+            size_t used_bytes;
+            size_t allocation_count;
+        };
+        struct Allocation {
+            size_t size;
+            Arena arena;
+        };
+
+        // Executable view, which is what allocate hands out
+        uint8_t* region{};
+        // Writable view of the same memory
+        uint8_t* writable_region{};
+        size_t region_size{};
+        bool huge_pages{};
+        ArenaState arenas[ARENA_MAX]{};
+        std::unordered_map<size_t, Allocation> allocations{};
+
+        static uint8_t* take_from_free_list(ArenaState& p_arena, size_t p_size);
+        static uint8_t* take_from_top(ArenaState& p_arena, size_t p_size);
+        static void give_back(ArenaState& p_arena, uint8_t* p_ptr, size_t p_size);
+        static ArenaStatistics arena_statistics(const ArenaState& p_arena);
+    public:
+        explicit CodeHeap(const CodeHeapSettings& p_settings);
+        CodeHeap(const CodeHeap&) = delete;
+        ~CodeHeap();
+
+        // False when the region could not be mapped, code is then left to AsmJit's own allocator
+        _NO_DISCARD_ _ALWAYS_INLINE_ bool is_valid() const { return region != nullptr; }
+        _NO_DISCARD_ bool owns(const void* p_ptr) const;
+        // Returns nullptr when neither arena has room left
+        // p_compact picks the lowest fitting address instead of bumping, which keeps the arena dense
+        void* allocate(size_t p_size, Arena p_arena, bool p_compact = false);
+        bool release(void* p_ptr);
+        // Alias of an address returned by allocate that can be written to, but not executed
+        _NO_DISCARD_ _ALWAYS_INLINE_ void* get_writable_address(void* p_ptr) const {
+            return writable_region + ((uint8_t*)p_ptr - region);
+        }
+        _NO_DISCARD_ Statistics get_statistics() const;
+
+        CodeHeap& operator=(const CodeHeap&) = delete;
+    };
+}
+
+#endif //MICROJIT_CODE_HEAP_H
@@ -5,55 +5,65 @@
 #ifndef MICROJIT_EXPERIMENT_COMMAND_QUEUE_H
 #define MICROJIT_EXPERIMENT_COMMAND_QUEUE_H
 
-#include <queue>
+#include <atomic>
 #include <iostream>
 #include "managed_thread.h"
+#include "inplace_task.h"
+#include "bounded_queue.h"
 
 namespace microjit {
     class CommandQueue {
     private:
-        bool is_terminated;
+        static constexpr size_t ring_capacity = 1024;
+        std::atomic<bool> is_terminated{};
+        std::atomic<bool> is_waiting{};
         std::mutex conditional_mutex{};
         std::condition_variable conditional_lock{};
-        std::queue<std::function<void()>> task_queue{};
+        SpillingQueue<InplaceTask> task_queue{ring_capacity};
         ManagedThread server;
 
-        template<class T>
-        _ALWAYS_INLINE_ auto dispatch_internal(const std::function<T>& p_func){
-            auto task_ptr = std::make_shared<std::packaged_task<T>>(p_func);
-            {
-                std::unique_lock<decltype(conditional_mutex)> lock(conditional_mutex);
-                task_queue.push([task_ptr]() {
-                    (*task_ptr)();
-                });
-            }
+        void push_task(InplaceTask&& p_task){
+            task_queue.push(std::move(p_task));
+            // Pairs with the server, which announces itself before checking for tasks one last time
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (!is_waiting.load(std::memory_order_seq_cst)) return;
+            std::lock_guard<decltype(conditional_mutex)> lock(conditional_mutex);
             conditional_lock.notify_one();
-            return task_ptr->get_future();
+        }
+        template<class T>
+        _ALWAYS_INLINE_ std::future<T> dispatch_internal(std::packaged_task<T()>&& p_task){
+            auto re = p_task.get_future();
+            push_task(InplaceTask(std::move(p_task)));
+            return re;
         }
     public:
-        CommandQueue() : server(), is_terminated(false) {
+        CommandQueue() : server() {
             server.start([this]() {
-                while (true){
-                    std::function<void()> func;
-                    {
+                InplaceTask task{};
+                while (!is_terminated.load(std::memory_order_acquire)){
+                    if (!task_queue.try_pop(task)) {
                         std::unique_lock<decltype(conditional_mutex)> lock(conditional_mutex);
-                        conditional_lock.wait(lock, [this] { return !task_queue.empty() || is_terminated; });
-                        if (is_terminated) return;
-                        if (task_queue.empty()) continue;
-                        func = task_queue.front();
-                        task_queue.pop();
+                        if (is_terminated.load(std::memory_order_relaxed)) return;
+                        is_waiting.store(true, std::memory_order_seq_cst);
+                        if (task_queue.empty()) conditional_lock.wait(lock);
+                        is_waiting.store(false, std::memory_order_relaxed);
+                        continue;
                     }
                     try {
-                        func();
+                        task();
                     } catch (const std::exception& e){
                         std::cerr << "Exception thrown in command queue "
                                   << std::this_thread::get_id() << ": " << e.what() << "\n";
                     }
+                    task = InplaceTask();
                 }
             });
         }
         ~CommandQueue() {
-            is_terminated = true;
+            {
+                std::lock_guard<decltype(conditional_mutex)> lock(conditional_mutex);
+                is_terminated.store(true, std::memory_order_release);
+            }
             conditional_lock.notify_all();
             server.join();
         }
@@ -61,25 +71,31 @@ namespace microjit {
 
         template<typename F, typename...Args>
         auto dispatch(F&& f, Args&&... args) -> std::future<decltype(f(args...))> {
-            std::function<decltype(f(args...))()> func = std::bind(std::forward<F>(f), std::forward<Args>(args)...);
-            return dispatch_internal(func);
+            std::packaged_task<decltype(f(args...))()> task(std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+            return dispatch_internal(std::move(task));
         }
         template<typename T, typename F, typename...Args>
         auto dispatch_method(T* p_instance, F&& f, Args&&... args) -> std::future<decltype((p_instance->*f)(args...))> {
-            std::function<decltype((p_instance->*f)(args...))()> func = std::bind(std::forward<F>(f), p_instance, std::forward<Args>(args)...);
-            return dispatch_internal(func);
+            std::packaged_task<decltype((p_instance->*f)(args...))()> task(std::bind(std::forward<F>(f), p_instance, std::forward<Args>(args)...));
+            return dispatch_internal(std::move(task));
         }
         template<typename T, typename F, typename...Args>
         auto dispatch_method(const T* p_instance, F&& f, Args&&... args) -> std::future<decltype((p_instance->*f)(args...))> {
-            std::function<decltype((p_instance->*f)(args...))()> func = std::bind(std::forward<F>(f), p_instance, std::forward<Args>(args)...);
-            return dispatch_internal(func);
+            std::packaged_task<decltype((p_instance->*f)(args...))()> task(std::bind(std::forward<F>(f), p_instance, std::forward<Args>(args)...));
+            return dispatch_internal(std::move(task));
+        }
+        // Fire and forget, nothing is allocated as long as p_func fits inside an InplaceTask
+        // Exceptions thrown by p_func are reported by the server and swallowed
+        template<typename F>
+        _ALWAYS_INLINE_ void post(F&& p_func){
+            push_task(InplaceTask(std::forward<F>(p_func)));
         }
         template<typename F, typename...Args>
         auto sync(F&& f, Args&&... args) -> decltype(f(args...)) {
             if (ManagedThread::this_thread_id() == server.get_id())
                 MJ_RAISE("Cannot sync a task from inside CommandQueue server");
-            std::function<decltype(f(args...))()> func = std::bind(std::forward<F>(f), std::forward<Args>(args)...);
-            auto promise = dispatch_internal(func);
+            std::packaged_task<decltype(f(args...))()> task(std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+            auto promise = dispatch_internal(std::move(task));
             promise.wait();
             return promise.get();
         }
@@ -87,16 +103,16 @@ namespace microjit {
         auto sync_method(T* p_instance, F&& f, Args&&... args) -> decltype((p_instance->*f)(args...)) {
             if (ManagedThread::this_thread_id() == server.get_id())
                 MJ_RAISE("Cannot sync a task from inside CommandQueue server");
-            std::function<decltype((p_instance->*f)(args...))()> func = std::bind(std::forward<F>(f), p_instance, std::forward<Args>(args)...);
-            auto promise = dispatch_internal(func);
+            std::packaged_task<decltype((p_instance->*f)(args...))()> task(std::bind(std::forward<F>(f), p_instance, std::forward<Args>(args)...));
+            auto promise = dispatch_internal(std::move(task));
             return promise.get();
         }
         template<typename T, typename F, typename...Args>
         auto sync_method(const T* p_instance, F&& f, Args&&... args) -> decltype((p_instance->*f)(args...)) {
             if (ManagedThread::this_thread_id() == server.get_id())
                 MJ_RAISE("Cannot sync a task from inside CommandQueue server");
-            std::function<decltype((p_instance->*f)(args...))()> func = std::bind(std::forward<F>(f), p_instance, std::forward<Args>(args)...);
-            auto promise = dispatch_internal(func);
+            std::packaged_task<decltype((p_instance->*f)(args...))()> task(std::bind(std::forward<F>(f), p_instance, std::forward<Args>(args)...));
+            auto promise = dispatch_internal(std::move(task));
             return promise.get();
         }
     };
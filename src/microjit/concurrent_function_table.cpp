@@ -0,0 +1,155 @@
+//
+// Created by cycastic on 10/19/26.
+//
+
+#include "concurrent_function_table.h"
+
+bool microjit::ConcurrentFunctionTable::Entry::try_claim() {
+    uint8_t expected = STATE_EMPTY;
+    return state.compare_exchange_strong(expected, STATE_COMPILING, std::memory_order_acq_rel);
+}
+
+microjit::ConcurrentFunctionTable::VirtualStackFunction
+microjit::ConcurrentFunctionTable::Entry::publish(VirtualStackFunction p_callback) {
+    VirtualStackFunction re;
+    {
+        // Waiters check the state under this lock, so none of them can miss the notification
+        std::lock_guard<std::mutex> guard(wait_lock);
+        re = callback.exchange(p_callback, std::memory_order_acq_rel);
+        state.store(p_callback ? STATE_READY : STATE_EMPTY, std::memory_order_release);
+    }
+    wait_condition.notify_all();
+    return re;
+}
+
+microjit::ConcurrentFunctionTable::VirtualStackFunction
+microjit::ConcurrentFunctionTable::Entry::exchange(VirtualStackFunction p_callback) {
+    std::lock_guard<std::mutex> guard(wait_lock);
+    return callback.exchange(p_callback, std::memory_order_acq_rel);
+}
+
+microjit::ConcurrentFunctionTable::VirtualStackFunction microjit::ConcurrentFunctionTable::Entry::wait() {
+    std::unique_lock<std::mutex> guard(wait_lock);
+    wait_condition.wait(guard, [this]() -> bool {
+        return state.load(std::memory_order_acquire) != STATE_COMPILING;
+    });
+    return callback.load(std::memory_order_acquire);
+}
+
+microjit::ConcurrentFunctionTable::VirtualStackFunction microjit::ConcurrentFunctionTable::Entry::reset() {
+    VirtualStackFunction re;
+    {
+        std::lock_guard<std::mutex> guard(wait_lock);
+        re = callback.exchange(nullptr, std::memory_order_acq_rel);
+        // An in-flight compilation keeps its claim, it will publish over the reset
+        if (state.load(std::memory_order_acquire) == STATE_READY)
+            state.store(STATE_EMPTY, std::memory_order_release);
+    }
+    wait_condition.notify_all();
+    return re;
+}
+
+microjit::ConcurrentFunctionTable::Table *microjit::ConcurrentFunctionTable::allocate_table(size_t p_capacity) {
+    auto table = new Table{ new Slot[p_capacity], p_capacity, 64 };
+    while ((size_t(1) << (64 - table->shift)) < p_capacity) table->shift--;
+    for (size_t i = 0; i < p_capacity; i++){
+        table->slots[i].key.store(0, std::memory_order_relaxed);
+        table->slots[i].entry.store(nullptr, std::memory_order_relaxed);
+    }
+    return table;
+}
+
+void microjit::ConcurrentFunctionTable::free_table(Table *p_table) {
+    delete[] p_table->slots;
+    delete p_table;
+}
+
+microjit::ConcurrentFunctionTable::Entry *microjit::ConcurrentFunctionTable::probe(const Table *p_table, size_t p_key) {
+    const auto mask = p_table->capacity - 1;
+    for (auto i = hash(p_table, p_key);; i = (i + 1) & mask){
+        const auto key = p_table->slots[i].key.load(std::memory_order_acquire);
+        // The entry is stored before the key, so a matching key always has its entry visible
+        // Tombstones are probed past, as the key may have been placed after them
+        if (key == p_key) return p_table->slots[i].entry.load(std::memory_order_acquire);
+        if (key == 0) return nullptr;
+    }
+}
+
+void microjit::ConcurrentFunctionTable::place(Table *p_table, size_t p_key, Entry *p_entry) {
+    const auto mask = p_table->capacity - 1;
+    for (auto i = hash(p_table, p_key);; i = (i + 1) & mask){
+        if (p_table->slots[i].key.load(std::memory_order_relaxed) != 0) continue;
+        p_table->slots[i].entry.store(p_entry, std::memory_order_relaxed);
+        p_table->slots[i].key.store(p_key, std::memory_order_release);
+        return;
+    }
+}
+
+void microjit::ConcurrentFunctionTable::rehash() {
+    auto old_table = current.load(std::memory_order_relaxed);
+    size_t capacity = initial_capacity;
+    // Leave room for as many inserts as there are live entries before the next rehash
+    while (capacity < (live_count + 1) * 4) capacity *= 2;
+    auto new_table = allocate_table(capacity);
+    for (size_t i = 0; i < old_table->capacity; i++){
+        const auto key = old_table->slots[i].key.load(std::memory_order_relaxed);
+        if (key && key != tombstone) place(new_table, key, old_table->slots[i].entry.load(std::memory_order_relaxed));
+    }
+    used_slots = live_count;
+    // Readers still probing the old table see the same entries
+    current.store(new_table, std::memory_order_release);
+    EpochManager::get_singleton().retire([old_table]() -> void { free_table(old_table); });
+}
+
+microjit::ConcurrentFunctionTable::Entry *microjit::ConcurrentFunctionTable::acquire(size_t p_key) {
+    auto entry = find(p_key);
+    if (entry) return entry;
+    std::lock_guard<std::mutex> guard(insert_lock);
+    // Someone may have inserted it while we were waiting for the lock
+    entry = find(p_key);
+    if (entry) return entry;
+    // Keep the load factor, tombstones included, under one half
+    if ((used_slots + 1) * 2 > current.load(std::memory_order_relaxed)->capacity) rehash();
+    entry = new Entry();
+    place(current.load(std::memory_order_relaxed), p_key, entry);
+    live_count++;
+    used_slots++;
+    return entry;
+}
+
+bool microjit::ConcurrentFunctionTable::erase(size_t p_key, VirtualStackFunction* r_callback) {
+    {
+        std::lock_guard<std::mutex> guard(insert_lock);
+        auto table = current.load(std::memory_order_relaxed);
+        const auto mask = table->capacity - 1;
+        Entry* entry{};
+        for (auto i = hash(table, p_key);; i = (i + 1) & mask){
+            const auto key = table->slots[i].key.load(std::memory_order_relaxed);
+            if (key == 0) return false;
+            if (key != p_key) continue;
+            entry = table->slots[i].entry.load(std::memory_order_relaxed);
+            table->slots[i].key.store(tombstone, std::memory_order_release);
+            break;
+        }
+        live_count--;
+        // Anyone still holding the entry either waits on it or publishes into it, both stay valid until reclaimed
+        *r_callback = entry->reset();
+        EpochManager::get_singleton().retire([entry]() -> void { delete entry; });
+    }
+    EpochManager::get_singleton().reclaim();
+    return true;
+}
+
+microjit::ConcurrentFunctionTable::ConcurrentFunctionTable() {
+    current.store(allocate_table(initial_capacity), std::memory_order_release);
+}
+
+microjit::ConcurrentFunctionTable::~ConcurrentFunctionTable() {
+    // Retired tables and entries are left to the epoch manager, they do not refer back to this table
+    auto table = current.load(std::memory_order_acquire);
+    for (size_t i = 0; i < table->capacity; i++){
+        const auto key = table->slots[i].key.load(std::memory_order_relaxed);
+        if (key && key != tombstone) delete table->slots[i].entry.load(std::memory_order_relaxed);
+    }
+    free_table(table);
+}
@@ -0,0 +1,105 @@
+//
+// Created by cycastic on 10/19/26.
+//
+
+#ifndef MICROJIT_CONCURRENT_FUNCTION_TABLE_H
+#define MICROJIT_CONCURRENT_FUNCTION_TABLE_H
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <condition_variable>
+#include <cstdint>
+#include "def.h"
+#include "epoch.h"
+
+namespace microjit {
+    // Host-keyed table of compiled functions
+    // Lookups take no locks, only inserting and erasing hosts serialize on a mutex
+    // Erased entries and outgrown tables are retired through EpochManager, so an Entry* returned by find or acquire
+    // must only be used inside an EpochManager::Guard
+    class ConcurrentFunctionTable {
+    public:
+        typedef void(*VirtualStackFunction)(uint8_t*);
+        class Entry {
+        public:
+            enum State : uint8_t {
+                STATE_EMPTY,
+                STATE_COMPILING,
+                STATE_READY,
+            };
+        private:
+            std::atomic<VirtualStackFunction> callback{};
+            std::atomic<uint8_t> state{STATE_EMPTY};
+            std::mutex wait_lock{};
+            std::condition_variable wait_condition{};
+        public:
+            _NO_DISCARD_ _ALWAYS_INLINE_ VirtualStackFunction get() const { return callback.load(std::memory_order_acquire); }
+            _NO_DISCARD_ _ALWAYS_INLINE_ State get_state() const { return (State)state.load(std::memory_order_acquire); }
+            // Only one thread can claim an empty entry, it must publish afterwards
+            bool try_claim();
+            // Store the compiled function and wake up every waiter, nullptr gives up the claim
+            // Returns the function it replaced, which must be retired rather than released
+            VirtualStackFunction publish(VirtualStackFunction p_callback);
+            // Replace the function of a ready entry, returns the previous one
+            VirtualStackFunction exchange(VirtualStackFunction p_callback);
+            // Block while another thread is compiling this entry
+            // Returns nullptr if that compilation failed or the entry has been reset meanwhile
+            VirtualStackFunction wait();
+            // Empty the entry, returns the previous function
+            VirtualStackFunction reset();
+        };
+    private:
+        static constexpr size_t initial_capacity = 64;
+        // Key of an erased slot, hosts are aligned so no host lives at this address
+        static constexpr size_t tombstone = 1;
+        struct Slot {
+            std::atomic<size_t> key;
+            std::atomic<Entry*> entry;
+        };
+        struct Table {
+            Slot* slots;
+            size_t capacity;
+            uint8_t shift;
+        };
+
+        std::atomic<Table*> current{};
+        // Guarded by insert_lock
+        size_t live_count{};
+        // Live entries plus tombstones, only a rehash clears the latter
+        size_t used_slots{};
+        std::mutex insert_lock{};
+
+        static Table* allocate_table(size_t p_capacity);
+        static void free_table(Table* p_table);
+        static _ALWAYS_INLINE_ size_t hash(const Table* p_table, size_t p_key) {
+            // Fibonacci hashing, host addresses are aligned so their low bits carry no information
+            return (p_key * 11400714819323198485ull) >> p_table->shift;
+        }
+        static Entry* probe(const Table* p_table, size_t p_key);
+        static void place(Table* p_table, size_t p_key, Entry* p_entry);
+        // Move the live entries into a table sized after them, growing or shrinking it
+        void rehash();
+    public:
+        ConcurrentFunctionTable();
+        ConcurrentFunctionTable(const ConcurrentFunctionTable&) = delete;
+        ~ConcurrentFunctionTable();
+
+        // Returns nullptr if p_key has never been inserted
+        _NO_DISCARD_ _ALWAYS_INLINE_ Entry* find(size_t p_key) const { return probe(current.load(std::memory_order_acquire), p_key); }
+        // Find or insert
+        Entry* acquire(size_t p_key);
+        // Remove p_key, its entry is retired. Returns false if p_key was not there
+        // r_callback receives the function it held, nullptr while evicted or compiling, which must be retired as well
+        bool erase(size_t p_key, VirtualStackFunction* r_callback);
+        _NO_DISCARD_ _ALWAYS_INLINE_ VirtualStackFunction get(size_t p_key) const {
+            EpochManager::Guard guard{};
+            auto entry = find(p_key);
+            return entry ? entry->get() : nullptr;
+        }
+
+        ConcurrentFunctionTable& operator=(const ConcurrentFunctionTable&) = delete;
+    };
+}
+
+#endif //MICROJIT_CONCURRENT_FUNCTION_TABLE_H
@@ -0,0 +1,102 @@
+//
+// Created by cycastic on 10/19/26.
+//
+
+#include "cpu_topology.h"
+#include <thread>
+#include <fstream>
+#include <algorithm>
+#ifdef __linux__
+#include <sched.h>
+#include <dirent.h>
+#endif
+
+static bool read_first_line(const std::string& p_path, std::string* r_line){
+    std::ifstream file(p_path);
+    if (!file.is_open()) return false;
+    return bool(std::getline(file, *r_line));
+}
+
+microjit::CpuSet::CpuSet(std::initializer_list<uint16_t> p_cpus) {
+    for (auto cpu : p_cpus) add(cpu);
+}
+
+microjit::CpuSet microjit::CpuSet::parse(const std::string &p_list) {
+    CpuSet re{};
+    size_t position = 0;
+    while (position < p_list.size()){
+        auto comma = p_list.find(',', position);
+        if (comma == std::string::npos) comma = p_list.size();
+        const auto entry = p_list.substr(position, comma - position);
+        position = comma + 1;
+        try {
+            const auto dash = entry.find('-');
+            const auto first = std::stoul(entry.substr(0, dash));
+            const auto last = dash == std::string::npos ? first : std::stoul(entry.substr(dash + 1));
+            for (auto cpu = first; cpu <= last && cpu <= UINT16_MAX; cpu++) re.add((uint16_t)cpu);
+        } catch (const std::exception&) {}
+    }
+    return re;
+}
+
+void microjit::CpuSet::add(uint16_t p_cpu) {
+    auto it = std::lower_bound(cpus.begin(), cpus.end(), p_cpu);
+    if (it != cpus.end() && *it == p_cpu) return;
+    cpus.insert(it, p_cpu);
+}
+
+bool microjit::CpuSet::contains(uint16_t p_cpu) const {
+    return std::binary_search(cpus.begin(), cpus.end(), p_cpu);
+}
+
+microjit::CpuTopology::CpuTopology() {
+    std::string line{};
+    if (read_first_line("/sys/devices/system/cpu/online", &line)) all_cpus = CpuSet::parse(line);
+    if (all_cpus.empty()) {
+        const auto hardware = std::max(1u, std::thread::hardware_concurrency());
+        for (unsigned int i = 0; i < hardware; i++) all_cpus.add((uint16_t)i);
+    }
+#ifdef __linux__
+    if (auto directory = opendir("/sys/devices/system/node")) {
+        std::vector<std::pair<size_t, CpuSet>> found{};
+        while (auto entry = readdir(directory)){
+            const std::string name(entry->d_name);
+            if (name.rfind("node", 0) != 0 || name.size() == 4 ||
+                !std::all_of(name.begin() + 4, name.end(), [](char c) -> bool { return c >= '0' && c <= '9'; })) continue;
+            if (!read_first_line("/sys/devices/system/node/" + name + "/cpulist", &line)) continue;
+            auto cpus = CpuSet::parse(line);
+            // Memory-only nodes have no CPU to place a worker on
+            if (cpus.empty()) continue;
+            found.emplace_back(std::stoul(name.substr(4)), std::move(cpus));
+        }
+        closedir(directory);
+        std::sort(found.begin(), found.end(), [](const auto& p_lhs, const auto& p_rhs) -> bool { return p_lhs.first < p_rhs.first; });
+        for (auto& node : found) nodes.push_back(std::move(node.second));
+    }
+#endif
+    if (nodes.empty()) nodes.push_back(all_cpus);
+    for (size_t node = 0; node < nodes.size(); node++){
+        for (auto cpu : nodes[node]){
+            if (cpu >= cpu_nodes.size()) cpu_nodes.resize(size_t(cpu) + 1);
+            cpu_nodes[cpu] = (uint16_t)node;
+        }
+    }
+}
+
+const microjit::CpuTopology &microjit::CpuTopology::get_singleton() {
+    static const CpuTopology singleton{};
+    return singleton;
+}
+
+size_t microjit::CpuTopology::get_node_of_cpu(size_t p_cpu) const {
+    return p_cpu < cpu_nodes.size() ? cpu_nodes[p_cpu] : 0;
+}
+
+size_t microjit::CpuTopology::get_current_node() const {
+    if (nodes.size() == 1) return 0;
+#ifdef __linux__
+    const auto cpu = sched_getcpu();
+    if (cpu >= 0) return get_node_of_cpu(cpu);
+#endif
+    return 0;
+}
@@ -0,0 +1,55 @@
+//
+// Created by cycastic on 10/19/26.
+//
+
+#ifndef MICROJIT_CPU_TOPOLOGY_H
+#define MICROJIT_CPU_TOPOLOGY_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "def.h"
+
+namespace microjit {
+    // Sorted set of logical CPU indices
+    class CpuSet {
+    private:
+        std::vector<uint16_t> cpus{};
+    public:
+        CpuSet() = default;
+        CpuSet(std::initializer_list<uint16_t> p_cpus);
+        // Parses the kernel's list format, such as "0-3,8,10-11", malformed entries are skipped
+        static CpuSet parse(const std::string& p_list);
+
+        void add(uint16_t p_cpu);
+        _NO_DISCARD_ bool contains(uint16_t p_cpu) const;
+        _NO_DISCARD_ size_t size() const { return cpus.size(); }
+        _NO_DISCARD_ bool empty() const { return cpus.empty(); }
+        _NO_DISCARD_ uint16_t operator[](size_t p_idx) const { return cpus[p_idx]; }
+        _NO_DISCARD_ std::vector<uint16_t>::const_iterator begin() const { return cpus.begin(); }
+        _NO_DISCARD_ std::vector<uint16_t>::const_iterator end() const { return cpus.end(); }
+    };
+
+    // NUMA layout of the host, read once from /sys/devices/system/node without linking libnuma
+    // Hosts without that directory are seen as a single node holding every online CPU
+    class CpuTopology {
+    private:
+        std::vector<CpuSet> nodes{};
+        // Node of every CPU, indexed by CPU
+        std::vector<uint16_t> cpu_nodes{};
+        CpuSet all_cpus{};
+
+        CpuTopology();
+    public:
+        static const CpuTopology& get_singleton();
+
+        _NO_DISCARD_ size_t get_node_count() const { return nodes.size(); }
+        _NO_DISCARD_ const CpuSet& get_node_cpus(size_t p_node) const { return nodes[p_node % nodes.size()]; }
+        _NO_DISCARD_ const CpuSet& get_all_cpus() const { return all_cpus; }
+        _NO_DISCARD_ size_t get_node_of_cpu(size_t p_cpu) const;
+        // Node of the CPU the calling thread is running on at this instant, 0 when it cannot be told
+        _NO_DISCARD_ size_t get_current_node() const;
+    };
+}
+
+#endif //MICROJIT_CPU_TOPOLOGY_H
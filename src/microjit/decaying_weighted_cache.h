@@ -0,0 +1,115 @@
+//
+// Created by cycastic on 10/19/26.
+//
+
+#ifndef MICROJIT_DECAYING_WEIGHTED_CACHE_H
+#define MICROJIT_DECAYING_WEIGHTED_CACHE_H
+
+#include <unordered_map>
+#include <vector>
+#include <mutex>
+#include <algorithm>
+#include "def.h"
+
+namespace microjit {
+    // Cache bounded by the sum of its entries' weight
+    // Every entry carries a heat score that is raised on use and decays over time,
+    // when the cache is over capacity the coldest entries are evicted first
+    // Not thread-safe, except for Entry::heat which has its own lock
+    template <typename K, typename V, class Hasher = std::hash<K>>
+    class DecayingWeightedCache {
+    public:
+        struct Entry {
+            V value;
+            size_t weight;
+            double heat;
+            std::mutex lock{};
+            Entry(const V& p_value, size_t p_weight, double p_heat) : value(p_value), weight(p_weight), heat(p_heat) {}
+            void add_heat(double p_amount) {
+                std::lock_guard<std::mutex> guard(lock);
+                heat += p_amount;
+            }
+        };
+    private:
+        std::unordered_map<K, Entry*, Hasher> entries{};
+        size_t capacity;
+        size_t total_weight{};
+        double decay_rate;
+    public:
+        // A capacity of 0 means the cache is unbounded
+        DecayingWeightedCache(size_t p_capacity, double p_decay_rate)
+            : capacity(p_capacity), decay_rate(p_decay_rate) {}
+        DecayingWeightedCache(const DecayingWeightedCache&) = delete;
+        ~DecayingWeightedCache() { clear(); }
+
+        _NO_DISCARD_ _ALWAYS_INLINE_ size_t size() const { return entries.size(); }
+        _NO_DISCARD_ _ALWAYS_INLINE_ size_t get_capacity() const { return capacity; }
+        _NO_DISCARD_ _ALWAYS_INLINE_ size_t get_total_weight() const { return total_weight; }
+        _NO_DISCARD_ _ALWAYS_INLINE_ bool is_over_capacity() const { return capacity && total_weight > capacity; }
+        void set_capacity(size_t p_capacity) { capacity = p_capacity; }
+        void set_decay_rate(double p_decay_rate) { decay_rate = p_decay_rate; }
+
+        _NO_DISCARD_ bool has(const K& p_key) const { return entries.find(p_key) != entries.end(); }
+        // Returns nullptr if the key is not cached
+        _NO_DISCARD_ Entry* at(const K& p_key) const {
+            auto it = entries.find(p_key);
+            return it == entries.end() ? nullptr : it->second;
+        }
+        // Replacing an existing entry keeps its heat
+        void push(const K& p_key, const V& p_value, size_t p_weight, double p_initial_heat){
+            auto it = entries.find(p_key);
+            if (it != entries.end()){
+                auto entry = it->second;
+                total_weight = total_weight - entry->weight + p_weight;
+                entry->value = p_value;
+                entry->weight = p_weight;
+                return;
+            }
+            entries[p_key] = new Entry(p_value, p_weight, p_initial_heat);
+            total_weight += p_weight;
+        }
+        bool erase(const K& p_key){
+            auto it = entries.find(p_key);
+            if (it == entries.end()) return false;
+            total_weight -= it->second->weight;
+            delete it->second;
+            entries.erase(it);
+            return true;
+        }
+        void clear(){
+            for (const auto& entry : entries) delete entry.second;
+            entries.clear();
+            total_weight = 0;
+        }
+        void decay(){
+            const auto factor = 1.0 - decay_rate;
+            for (const auto& entry : entries){
+                std::lock_guard<std::mutex> guard(entry.second->lock);
+                entry.second->heat *= factor;
+            }
+        }
+        // Evict the coldest entries until the cache fits its capacity
+        // The evicted key-value pairs are appended to p_evicted
+        void cleanup(std::vector<std::pair<K, V>>* p_evicted){
+            if (!is_over_capacity()) return;
+            std::vector<std::pair<double, K>> by_heat{};
+            by_heat.reserve(entries.size());
+            for (const auto& entry : entries){
+                std::lock_guard<std::mutex> guard(entry.second->lock);
+                by_heat.emplace_back(entry.second->heat, entry.first);
+            }
+            std::sort(by_heat.begin(), by_heat.end(), [](const auto& p_lhs, const auto& p_rhs) -> bool {
+                return p_lhs.first < p_rhs.first;
+            });
+            for (const auto& candidate : by_heat){
+                if (!is_over_capacity()) break;
+                p_evicted->emplace_back(candidate.second, entries.at(candidate.second)->value);
+                erase(candidate.second);
+            }
+        }
+
+        DecayingWeightedCache& operator=(const DecayingWeightedCache&) = delete;
+    };
+}
+
+#endif //MICROJIT_DECAYING_WEIGHTED_CACHE_H
@@ -5,6 +5,12 @@
 #ifndef MICROJIT_DEF_H
 #define MICROJIT_DEF_H
 
+#include <new>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <type_traits>
+
 #if defined(__clang__) || defined(_MSC_VER)
 #define USE_TYPE_CONSTEXPR
 #define TYPE_CONSTEXPR constexpr
@@ -61,4 +67,27 @@ static constexpr size_t calculate_args_space() {
     else return simple_16_bit_align(ret_size);
 }
 
+// Values on the virtual stack are packed back to back, so their slots are not necessarily aligned for their type
+// Trivially copyable values are copied in and out bytewise, everything else is constructed in place, which is
+// only defined for types that can live at any address
+template <typename T>
+static constexpr bool is_stack_storable_v = std::is_trivially_copyable_v<T> || alignof(T) == 1;
+
+template <typename T>
+static _ALWAYS_INLINE_ void store_stack_value(uint8_t* p_addr, const T& p_value){
+    static_assert(is_stack_storable_v<T>, "Non-trivially copyable types on the virtual stack must have an alignment of 1");
+    if constexpr (std::is_trivially_copyable_v<T>) std::memcpy(p_addr, &p_value, sizeof(T));
+    else new (p_addr) T(p_value);
+}
+
+template <typename T>
+static _ALWAYS_INLINE_ T load_stack_value(const uint8_t* p_addr){
+    static_assert(is_stack_storable_v<T>, "Non-trivially copyable types on the virtual stack must have an alignment of 1");
+    if constexpr (std::is_trivially_copyable_v<T> && std::is_default_constructible_v<T>) {
+        T re;
+        std::memcpy(&re, p_addr, sizeof(T));
+        return re;
+    } else return *std::launder((const T*)p_addr);
+}
+
 #endif //MICROJIT_DEF_H
@@ -0,0 +1,100 @@
+//
+// Created by cycastic on 10/19/26.
+//
+
+#include "epoch.h"
+#include <algorithm>
+
+namespace {
+    // Hands the record back when its thread exits
+    template<class T>
+    struct LocalRecord {
+        T* record{};
+        ~LocalRecord() {
+            if (!record) return;
+            record->in_use.store(false, std::memory_order_release);
+        }
+    };
+}
+
+microjit::EpochManager &microjit::EpochManager::get_singleton() {
+    // Never destroyed, threads may still leave their critical sections after static destructors ran
+    static auto singleton = new EpochManager();
+    return *singleton;
+}
+
+microjit::EpochManager::ThreadRecord *microjit::EpochManager::acquire_record() {
+    for (auto record = records.load(std::memory_order_acquire); record; record = record->next){
+        bool expected = false;
+        if (!record->in_use.load(std::memory_order_relaxed) &&
+            record->in_use.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+            record->depth = 0;
+            return record;
+        }
+    }
+    auto record = new ThreadRecord();
+    auto head = records.load(std::memory_order_relaxed);
+    do {
+        record->next = head;
+    } while (!records.compare_exchange_weak(head, record, std::memory_order_release, std::memory_order_relaxed));
+    return record;
+}
+
+microjit::EpochManager::ThreadRecord *microjit::EpochManager::get_local_record() {
+    static thread_local LocalRecord<ThreadRecord> local{};
+    if (unlikely(!local.record)) local.record = acquire_record();
+    return local.record;
+}
+
+uint64_t microjit::EpochManager::get_oldest_epoch() const {
+    auto oldest = quiescent;
+    for (auto record = records.load(std::memory_order_acquire); record; record = record->next){
+        oldest = std::min(oldest, record->epoch.load(std::memory_order_acquire));
+    }
+    return oldest;
+}
+
+void microjit::EpochManager::enter() {
+    auto record = get_local_record();
+    if (record->depth++) return;
+    record->epoch.store(global_epoch.load(std::memory_order_acquire), std::memory_order_relaxed);
+    // Publish the pinned epoch before reading anything it protects
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+void microjit::EpochManager::exit() {
+    auto record = get_local_record();
+    if (--record->depth) return;
+    record->epoch.store(quiescent, std::memory_order_release);
+}
+
+void microjit::EpochManager::retire(const std::function<void()> &p_release) {
+    // Threads that pinned this epoch or an older one may still see the object, later ones cannot
+    const auto epoch = global_epoch.fetch_add(1, std::memory_order_seq_cst);
+    std::lock_guard<std::mutex> guard(retire_lock);
+    retired.push_back(RetiredObject{ epoch, p_release });
+}
+
+size_t microjit::EpochManager::reclaim() {
+    std::vector<std::function<void()>> releasable{};
+    {
+        std::lock_guard<std::mutex> guard(retire_lock);
+        if (retired.empty()) return 0;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        const auto oldest = get_oldest_epoch();
+        std::vector<RetiredObject> remaining{};
+        for (auto& object : retired){
+            if (object.epoch < oldest) releasable.push_back(std::move(object.release));
+            else remaining.push_back(std::move(object));
+        }
+        retired.swap(remaining);
+    }
+    // Outside of the lock, releasing may retire more objects
+    for (const auto& release : releasable) release();
+    return releasable.size();
+}
+
+size_t microjit::EpochManager::get_pending_count() {
+    std::lock_guard<std::mutex> guard(retire_lock);
+    return retired.size();
+}
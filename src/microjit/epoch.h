@@ -0,0 +1,67 @@
+//
+// Created by cycastic on 10/19/26.
+//
+
+#ifndef MICROJIT_EPOCH_H
+#define MICROJIT_EPOCH_H
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <functional>
+#include <cstdint>
+#include "def.h"
+
+namespace microjit {
+    // Epoch-based reclamation for memory that is read without locks, such as compiled code
+    // Readers pin the current epoch for the length of a critical section. A retired object is only released
+    // once every thread that was inside a critical section when it got retired has left it
+    // Process-wide, so that a thread calling into several orchestrators only registers once
+    class EpochManager {
+    private:
+        static constexpr uint64_t quiescent = UINT64_MAX;
+        struct ThreadRecord {
+            std::atomic<uint64_t> epoch{quiescent};
+            // Records of finished threads are handed to new ones
+            std::atomic<bool> in_use{true};
+            ThreadRecord* next{};
+            // Only touched by the owning thread
+            uint32_t depth{};
+        };
+        struct RetiredObject {
+            uint64_t epoch;
+            std::function<void()> release;
+        };
+        std::atomic<uint64_t> global_epoch{};
+        // Never shrinks, records are reused instead
+        std::atomic<ThreadRecord*> records{};
+        std::mutex retire_lock{};
+        std::vector<RetiredObject> retired{};
+
+        EpochManager() = default;
+        ThreadRecord* acquire_record();
+        ThreadRecord* get_local_record();
+        _NO_DISCARD_ uint64_t get_oldest_epoch() const;
+    public:
+        class Guard {
+        public:
+            Guard() { get_singleton().enter(); }
+            ~Guard() { get_singleton().exit(); }
+            Guard(const Guard&) = delete;
+            Guard& operator=(const Guard&) = delete;
+        };
+
+        static EpochManager& get_singleton();
+        // Critical sections nest, only the outermost one pins an epoch
+        void enter();
+        void exit();
+        // Call p_release once no thread can still be using the object
+        // The object must already be unreachable for threads entering a critical section from now on
+        void retire(const std::function<void()>& p_release);
+        // Release every retired object that is safe to release, returns how many were released
+        size_t reclaim();
+        _NO_DISCARD_ size_t get_pending_count();
+    };
+}
+
+#endif //MICROJIT_EPOCH_H
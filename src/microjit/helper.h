@@ -5,6 +5,8 @@
 #ifndef MICROJIT_HELPER_H
 #define MICROJIT_HELPER_H
 
+#include <utility>
+#include <type_traits>
 #include "def.h"
 #include "safe_refcount.h"
 
@@ -30,8 +32,11 @@ namespace microjit {
         virtual ~ThreadSafeObject() = default;
     };
     template <class T>
+    class RefView;
+    template <class T>
     class Ref {
         T* reference{};
+        template <class> friend class Ref;
 
         void ref(const Ref& p_from) {
             if (p_from.reference == reference) return;
@@ -98,6 +103,17 @@ namespace microjit {
         Ref(const Ref &p_from) {
             ref(p_from);
         }
+        // Takes over p_from's reference, the count is not touched
+        Ref(Ref &&p_from) noexcept : reference(p_from.reference) {
+            p_from.reference = nullptr;
+        }
+        Ref& operator=(Ref &&p_from) noexcept {
+            if (this == &p_from) return *this;
+            unref();
+            reference = p_from.reference;
+            p_from.reference = nullptr;
+            return *this;
+        }
         _NO_DISCARD_ _ALWAYS_INLINE_ bool is_valid() const { return reference != nullptr; }
         _NO_DISCARD_ _ALWAYS_INLINE_ bool is_null() const { return reference == nullptr; }
 
@@ -131,7 +147,7 @@ namespace microjit {
         }
         template<class... Args >
         static _ALWAYS_INLINE_ Ref<T> make_ref(Args&&... args){
-            return from_uninitialized_object(new T(args...));
+            return from_uninitialized_object(new T(std::forward<Args>(args)...));
         }
         static _ALWAYS_INLINE_ constexpr Ref<T> null() { return Ref<T>(); }
 
@@ -141,12 +157,59 @@ namespace microjit {
             return casted;
         }
         template <class To>
-        _ALWAYS_INLINE_ Ref<To> c_style_cast() const {
-            // Ref<T> only hold a single property, a reference to an object
-            // So assuming that the programmer know what they are doing, this should not cause any problem
-            return *((Ref<To>*)this);
+        _ALWAYS_INLINE_ Ref<To> c_style_cast() const & {
+            // Takes a new reference rather than reinterpreting this Ref as a Ref<To>, which breaks strict aliasing
+            return Ref<To>::from_initialized_object(static_cast<To*>(reference));
         }
+        // Casting a temporary hands its reference over instead of taking another one
+        template <class To>
+        _ALWAYS_INLINE_ Ref<To> c_style_cast() && {
+            Ref<To> re{};
+            re.reference = static_cast<To*>(reference);
+            reference = nullptr;
+            return re;
+        }
+        // Same as c_style_cast, without taking a reference, see RefView
+        template <class To>
+        _ALWAYS_INLINE_ RefView<To> view_as() const;
     };
+    // Non-owning borrow of a Ref, for parameters and locals that do not outlive the Ref it was taken from
+    // Unlike passing a Ref by value or casting one, taking and casting a view never touches the reference count
+    // Gives the same access as a const Ref&
+    template <class T>
+    class RefView {
+        const T* reference{};
+        template <class> friend class RefView;
+    public:
+        constexpr RefView() = default;
+        constexpr RefView(std::nullptr_t) {}
+        template <class U, class = std::enable_if_t<std::is_convertible_v<U*, T*>>>
+        RefView(const Ref<U>& p_ref) : reference(p_ref.ptr()) {}
+        template <class U, class = std::enable_if_t<std::is_convertible_v<U*, T*>>>
+        RefView(const RefView<U>& p_view) : reference(p_view.ptr()) {}
+
+        _ALWAYS_INLINE_ const T *operator->() const { return reference; }
+        _ALWAYS_INLINE_ const T *operator*() const { return reference; }
+        _ALWAYS_INLINE_ const T *ptr() const { return reference; }
+        _NO_DISCARD_ _ALWAYS_INLINE_ bool is_valid() const { return reference != nullptr; }
+        _NO_DISCARD_ _ALWAYS_INLINE_ bool is_null() const { return reference == nullptr; }
+        _ALWAYS_INLINE_ bool operator==(const RefView& p_other) const { return reference == p_other.reference; }
+        _ALWAYS_INLINE_ bool operator!=(const RefView& p_other) const { return reference != p_other.reference; }
+
+        template <class To>
+        _ALWAYS_INLINE_ RefView<To> view_as() const {
+            RefView<To> re{};
+            re.reference = static_cast<const To*>(reference);
+            return re;
+        }
+        // Take a reference, for when the object has to outlive the borrowed Ref
+        _NO_DISCARD_ Ref<T> to_ref() const { return Ref<T>::from_initialized_object(const_cast<T*>(reference)); }
+    };
+    template <class T>
+    template <class To>
+    _ALWAYS_INLINE_ RefView<To> Ref<T>::view_as() const {
+        return RefView<T>(*this).template view_as<To>();
+    }
     template <typename T, class RefCounter = ThreadUnsafeObject>
     class Box {
     private:
@@ -154,7 +217,7 @@ namespace microjit {
             T data;
         public:
             template<class... Args >
-            explicit InnerPointer(Args&& ...args) : data(args...) {}
+            explicit InnerPointer(Args&& ...args) : data(std::forward<Args>(args)...) {}
 
             friend class Box<T, RefCounter>;
         };
@@ -198,21 +261,47 @@ namespace microjit {
             inner_ptr = p_other.inner_ptr;
             return *this;
         }
+        _ALWAYS_INLINE_ Box& operator=(Box&& p_other) noexcept {
+            inner_ptr = std::move(p_other.inner_ptr);
+            return *this;
+        }
         Box() : inner_ptr() {}
         Box(const T& p_data) {
             inner_ptr = Ref<Box<T, RefCounter>::InnerPointer>::make_ref(p_data);
         }
+        Box(T&& p_data) {
+            inner_ptr = Ref<Box<T, RefCounter>::InnerPointer>::make_ref(std::move(p_data));
+        }
         Box(const Box& p_other) {
             inner_ptr = p_other.inner_ptr;
         }
+        Box(Box&& p_other) noexcept : inner_ptr(std::move(p_other.inner_ptr)) {}
         template<class... Args >
         static Box<T, RefCounter> make_box(Args&&... args){
             Box<T, RefCounter> re{};
-            re.inner_ptr = Ref<Box<T, RefCounter>::InnerPointer>::make_ref(args...);
+            re.inner_ptr = Ref<Box<T, RefCounter>::InnerPointer>::make_ref(std::forward<Args>(args)...);
             return re;
         }
         ~Box() = default;
     };
+    // Non-owning view over a contiguous array, std::span is C++20
+    template <class T>
+    class Span {
+        T* elements{};
+        size_t length{};
+    public:
+        constexpr Span() = default;
+        constexpr Span(T* p_elements, size_t p_length) : elements(p_elements), length(p_length) {}
+        // From std::vector, std::array and the like
+        template <class Container, class = decltype(std::declval<Container&>().data())>
+        Span(Container& p_container) : elements(p_container.data()), length(p_container.size()) {}
+
+        _NO_DISCARD_ _ALWAYS_INLINE_ T* data() const { return elements; }
+        _NO_DISCARD_ _ALWAYS_INLINE_ size_t size() const { return length; }
+        _NO_DISCARD_ _ALWAYS_INLINE_ bool empty() const { return length == 0; }
+        // void for Span<void>, which only carries a length
+        _ALWAYS_INLINE_ std::add_lvalue_reference_t<T> operator[](size_t p_idx) const { return elements[p_idx]; }
+    };
 }
 
 #endif //MICROJIT_HELPER_H
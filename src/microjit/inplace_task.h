@@ -0,0 +1,94 @@
+//
+// Created by cycastic on 10/19/26.
+//
+
+#ifndef MICROJIT_INPLACE_TASK_H
+#define MICROJIT_INPLACE_TASK_H
+
+#include <new>
+#include <utility>
+#include <cstddef>
+#include <type_traits>
+#include "def.h"
+
+namespace microjit {
+    // Move-only void() callable. Callables that fit in inline_capacity bytes are stored inside the task itself,
+    // so queueing a small lambda does not touch the heap, larger ones are boxed
+    class InplaceTask {
+    public:
+        static constexpr size_t inline_capacity = 48;
+    private:
+        struct VTable {
+            void (*invoke)(void*);
+            // Move constructs into the first storage from the second, then destroys the second
+            void (*relocate)(void*, void*);
+            void (*destroy)(void*);
+        };
+        template <class F>
+        struct InlineOps {
+            static void invoke(void* p_storage) { (*(F*)p_storage)(); }
+            static void relocate(void* p_to, void* p_from) {
+                new (p_to) F(std::move(*(F*)p_from));
+                ((F*)p_from)->~F();
+            }
+            static void destroy(void* p_storage) { ((F*)p_storage)->~F(); }
+            static constexpr VTable vtable{ invoke, relocate, destroy };
+        };
+        template <class F>
+        struct BoxedOps {
+            static void invoke(void* p_storage) { (**(F**)p_storage)(); }
+            static void relocate(void* p_to, void* p_from) { *(F**)p_to = *(F**)p_from; }
+            static void destroy(void* p_storage) { delete *(F**)p_storage; }
+            static constexpr VTable vtable{ invoke, relocate, destroy };
+        };
+        template <class F>
+        static constexpr bool fits_inline = sizeof(F) <= inline_capacity &&
+                alignof(std::max_align_t) % alignof(F) == 0 && std::is_nothrow_move_constructible_v<F>;
+
+        alignas(std::max_align_t) unsigned char storage[inline_capacity]{};
+        const VTable* vtable{};
+
+        _ALWAYS_INLINE_ void reset() {
+            if (!vtable) return;
+            vtable->destroy(storage);
+            vtable = nullptr;
+        }
+    public:
+        InplaceTask() = default;
+        template <class F, class = std::enable_if_t<!std::is_same_v<std::decay_t<F>, InplaceTask>>>
+        InplaceTask(F&& p_callable) {
+            typedef std::decay_t<F> Callable;
+            if constexpr (fits_inline<Callable>) {
+                new (storage) Callable(std::forward<F>(p_callable));
+                vtable = &InlineOps<Callable>::vtable;
+            } else {
+                *(Callable**)storage = new Callable(std::forward<F>(p_callable));
+                vtable = &BoxedOps<Callable>::vtable;
+            }
+        }
+        InplaceTask(InplaceTask&& p_other) noexcept : vtable(p_other.vtable) {
+            if (!vtable) return;
+            vtable->relocate(storage, p_other.storage);
+            p_other.vtable = nullptr;
+        }
+        InplaceTask(const InplaceTask&) = delete;
+        ~InplaceTask() { reset(); }
+
+        _NO_DISCARD_ _ALWAYS_INLINE_ explicit operator bool() const { return vtable != nullptr; }
+        _ALWAYS_INLINE_ void operator()() { vtable->invoke(storage); }
+
+        InplaceTask& operator=(InplaceTask&& p_other) noexcept {
+            if (this == &p_other) return *this;
+            reset();
+            vtable = p_other.vtable;
+            if (vtable) {
+                vtable->relocate(storage, p_other.storage);
+                p_other.vtable = nullptr;
+            }
+            return *this;
+        }
+        InplaceTask& operator=(const InplaceTask&) = delete;
+    };
+}
+
+#endif //MICROJIT_INPLACE_TASK_H
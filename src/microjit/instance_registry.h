@@ -0,0 +1,175 @@
+//
+// Created by cycastic on 10/19/26.
+//
+
+#ifndef MICROJIT_INSTANCE_REGISTRY_H
+#define MICROJIT_INSTANCE_REGISTRY_H
+
+#include <memory>
+#include <vector>
+#include <utility>
+#include "def.h"
+#include "lock.h"
+
+namespace microjit {
+    // Records keyed by function host, split into shards that each carry their own lock
+    // so that threads registering or detaching different functions rarely contend
+    // Looking records up only takes a shard for reading, so eviction and tier-up listeners running on several
+    // compiler threads at once share it. Reader-biased shards keep those readers off each other's cache lines,
+    // at the cost of registering and detaching instances
+    template <class T>
+    class InstanceRegistry {
+    private:
+        static constexpr uint8_t shard_bits = 4;
+        static constexpr size_t shard_count = size_t(1) << shard_bits;
+
+        static _ALWAYS_INLINE_ size_t fibonacci_hash(size_t p_host) {
+            // Hosts are heap addresses so their low bits carry no information
+            return p_host * 11400714819323198485ull;
+        }
+        static _ALWAYS_INLINE_ size_t shard_index(size_t p_host) {
+            return fibonacci_hash(p_host) >> (64 - shard_bits);
+        }
+        // Open addressing with linear probing, erasing shifts the following records back so no tombstones pile up
+        // Keys and records sit in separate arrays so that probing only walks the keys
+        class FlatRecords {
+            // Hosts are never null
+            static constexpr size_t empty_key = 0;
+            static constexpr size_t initial_capacity = 16;
+            std::vector<size_t> keys{};
+            std::vector<T> values{};
+            size_t count{};
+            uint8_t shift{64};
+
+            _NO_DISCARD_ _ALWAYS_INLINE_ size_t home(size_t p_key) const {
+                // The top bits picked the shard, every key of this shard shares them
+                return (fibonacci_hash(p_key) << shard_bits) >> shift;
+            }
+            _NO_DISCARD_ _ALWAYS_INLINE_ size_t mask() const { return keys.size() - 1; }
+            _NO_DISCARD_ size_t locate(size_t p_key) const {
+                for (auto i = home(p_key);; i = (i + 1) & mask()){
+                    if (keys[i] == p_key || keys[i] == empty_key) return i;
+                }
+            }
+            void rehash(size_t p_capacity){
+                std::vector<size_t> old_keys(p_capacity, empty_key);
+                std::vector<T> old_values(p_capacity);
+                old_keys.swap(keys);
+                old_values.swap(values);
+                shift = uint8_t(64 - __builtin_ctzll(p_capacity));
+                for (size_t i = 0, s = old_keys.size(); i < s; i++){
+                    if (old_keys[i] == empty_key) continue;
+                    const auto slot = locate(old_keys[i]);
+                    keys[slot] = old_keys[i];
+                    values[slot] = std::move(old_values[i]);
+                }
+            }
+        public:
+            // Grow once to hold p_count records below 3/4 load
+            void reserve(size_t p_count){
+                auto capacity = keys.empty() ? initial_capacity : keys.size();
+                while (p_count * 4 > capacity * 3) capacity *= 2;
+                if (capacity != keys.size()) rehash(capacity);
+            }
+            void assign(size_t p_key, const T& p_value){
+                reserve(count + 1);
+                const auto slot = locate(p_key);
+                if (keys[slot] == empty_key) {
+                    keys[slot] = p_key;
+                    count++;
+                }
+                values[slot] = p_value;
+            }
+            _NO_DISCARD_ T* find(size_t p_key){
+                if (keys.empty()) return nullptr;
+                const auto slot = locate(p_key);
+                return keys[slot] == empty_key ? nullptr : &values[slot];
+            }
+            // p_record must have come from find on this map
+            void erase(T* p_record){
+                auto hole = size_t(p_record - values.data());
+                for (auto i = (hole + 1) & mask(); keys[i] != empty_key; i = (i + 1) & mask()){
+                    // Records whose home lies cyclically in (hole, i] stay where they are
+                    const auto ideal = home(keys[i]);
+                    if (hole <= i ? (hole < ideal && ideal <= i) : (hole < ideal || ideal <= i)) continue;
+                    keys[hole] = keys[i];
+                    values[hole] = std::move(values[i]);
+                    hole = i;
+                }
+                keys[hole] = empty_key;
+                values[hole] = T();
+                count--;
+            }
+            template <class F>
+            void for_each(F&& p_action){
+                for (size_t i = 0, s = keys.size(); i < s; i++){
+                    if (keys[i] != empty_key) p_action(values[i]);
+                }
+            }
+            _NO_DISCARD_ size_t size() const { return count; }
+        };
+        struct alignas(64) Shard {
+            std::unique_ptr<BaseRWLock> lock{};
+            FlatRecords records{};
+        };
+        Shard shards[shard_count]{};
+    public:
+        explicit InstanceRegistry(bool p_reader_biased = false) {
+            for (auto& shard : shards){
+                if (p_reader_biased) shard.lock = std::make_unique<ReaderBiasedRWLock>();
+                else shard.lock = std::make_unique<RWLock>();
+            }
+        }
+        void insert(size_t p_host, const T& p_record) {
+            auto& shard = shards[shard_index(p_host)];
+            WriteLockGuard guard(*shard.lock);
+            shard.records.assign(p_host, p_record);
+        }
+        // Every shard is locked once and grown once, however many records land in it
+        void insert_bulk(const std::vector<std::pair<size_t, T>>& p_records) {
+            std::vector<size_t> buckets[shard_count]{};
+            for (size_t i = 0, s = p_records.size(); i < s; i++){
+                buckets[shard_index(p_records[i].first)].push_back(i);
+            }
+            for (size_t i = 0; i < shard_count; i++){
+                if (buckets[i].empty()) continue;
+                auto& shard = shards[i];
+                WriteLockGuard guard(*shard.lock);
+                shard.records.reserve(shard.records.size() + buckets[i].size());
+                for (auto idx : buckets[i]) shard.records.assign(p_records[idx].first, p_records[idx].second);
+            }
+        }
+        // Call p_action on the record of p_host under its shard's read lock, returns false if there is none
+        // p_action receives the record as const, only what it points to may change
+        template <class F>
+        bool visit(size_t p_host, F&& p_action) {
+            auto& shard = shards[shard_index(p_host)];
+            ReadLockGuard guard(*shard.lock);
+            const auto record = shard.records.find(p_host);
+            if (!record) return false;
+            p_action(std::as_const(*record));
+            return true;
+        }
+        // Same as visit, then erase the record before releasing the lock
+        template <class F>
+        bool remove(size_t p_host, F&& p_action) {
+            auto& shard = shards[shard_index(p_host)];
+            WriteLockGuard guard(*shard.lock);
+            auto record = shard.records.find(p_host);
+            if (!record) return false;
+            p_action(*record);
+            shard.records.erase(record);
+            return true;
+        }
+        // Shards are locked one at a time, records registered meanwhile may or may not be visited
+        template <class F>
+        void for_each(F&& p_action) {
+            for (auto& shard : shards){
+                ReadLockGuard guard(*shard.lock);
+                shard.records.for_each([&p_action](const T& p_record) -> void { p_action(p_record); });
+            }
+        }
+    };
+}
+
+#endif //MICROJIT_INSTANCE_REGISTRY_H
@@ -39,7 +39,7 @@ microjit::VariableValue::create(const microjit::Ref<microjit::VariableInstructio
 
 void microjit::RectifiedScope::push_instruction(Ref<Instruction> p_ins){
     p_ins->scope_offset = current_scope_offset++;
-    instructions.push_back(p_ins);
+    instructions.push_back(std::move(p_ins));
 }
 
 microjit::Ref<microjit::InvocationInstruction>
@@ -0,0 +1,211 @@
+//
+// Created by cycastic on 10/19/26.
+//
+
+#include <alloca.h>
+#include "interpreter.h"
+#include "primitive_operation.h"
+
+microjit::MicroJITInterpreter::MicroJITInterpreter(const microjit::Ref<microjit::RectifiedFunction> &p_func)
+    : function(p_func), frame_report(MicroJITCompiler::create_frame_report(p_func)) {}
+
+const void *microjit::MicroJITInterpreter::value_address(const Frame &p_frame, microjit::RefView<microjit::Value> p_value) const {
+    switch (p_value->get_value_type()) {
+        case Value::VAL_IMMEDIATE:
+            return p_value.view_as<ImmediateValue>()->data;
+        case Value::VAL_ARGUMENT:
+            return p_frame.args_space + frame_report->args_map.at(p_value.view_as<ArgumentValue>()->argument_index);
+        case Value::VAL_VARIABLE:
+            return variable_address(p_frame, p_value.view_as<VariableValue>()->variable);
+        case Value::VAL_EXPRESSION:
+        default:
+            MJ_RAISE("Expressions do not have an address");
+    }
+}
+
+microjit::Type microjit::MicroJITInterpreter::value_type(microjit::RefView<microjit::Value> p_value) const {
+    switch (p_value->get_value_type()) {
+        case Value::VAL_IMMEDIATE:
+            return p_value.view_as<ImmediateValue>()->imm_type;
+        case Value::VAL_ARGUMENT:
+            return function->arguments->argument_types()[p_value.view_as<ArgumentValue>()->argument_index];
+        case Value::VAL_VARIABLE:
+            return p_value.view_as<VariableValue>()->variable->type;
+        case Value::VAL_EXPRESSION:
+        default:
+            MJ_RAISE("Unsupported");
+    }
+}
+
+void microjit::MicroJITInterpreter::copy_value(void *p_dst, const void *p_src, const microjit::Type &p_type,
+                                               const void *p_copy_constructor) {
+    if (p_type.is_primitive) memcpy(p_dst, p_src, p_type.size);
+    else ((void (*)(void*, const void*))p_copy_constructor)(p_dst, p_src);
+}
+
+void microjit::MicroJITInterpreter::destruct_scope(const Frame &p_frame, const microjit::RectifiedScope *p_scope,
+                                                   uint32_t p_reached) const {
+    for (const auto& var : p_scope->get_variables()){
+        if (var->type.is_primitive) continue;
+        // If variable is yet to be constructed
+        if (var->get_scope_offset() >= p_reached) break;
+        ((void (*)(void*))var->type.destructor)(variable_address(p_frame, var));
+    }
+}
+
+bool microjit::MicroJITInterpreter::evaluate(const Frame &p_frame, microjit::RefView<microjit::AbstractOperation> p_expression,
+                                             void *p_result) const {
+    if (!AbstractOperation::is_binary(p_expression->operation_type))
+        MJ_RAISE("Unary operations currently unsupported");
+    auto as_binary = p_expression.view_as<BinaryOperation>();
+    if (!as_binary->is_primitive) MJ_RAISE("Only primitive operations are supported");
+    const auto op = as_binary->operation_type;
+    const auto left = value_address(p_frame, as_binary->left_operand);
+    const auto right = value_address(p_frame, as_binary->right_operand);
+    bool condition{};
+    const auto supported = PrimitiveOperation::dispatch(value_type(as_binary->left_operand), [&](auto* p_tag) -> void {
+        typedef std::remove_pointer_t<decltype(p_tag)> T;
+        T value{};
+        // Compiled code would trap here
+        if (PrimitiveOperation::traps(op, *(const T*)left, *(const T*)right)) MJ_RAISE("Integer division overflow or by zero");
+        if (!PrimitiveOperation::evaluate(op, *(const T*)left, *(const T*)right, &value, &condition))
+            MJ_RAISE("Unsupported operation");
+        if (AbstractOperation::operation_return_bool(op)) {
+            *(bool*)p_result = condition;
+        } else {
+            *(T*)p_result = value;
+            condition = PrimitiveOperation::to_condition(value);
+        }
+    });
+    if (!supported) MJ_RAISE("Unsupported operand type");
+    return condition;
+}
+
+void microjit::MicroJITInterpreter::assign(const Frame &p_frame, const microjit::Ref<microjit::VariableInstruction> &p_target,
+                                           microjit::RefView<microjit::Value> p_value, const void *p_copy_constructor) const {
+    auto target = variable_address(p_frame, p_target);
+    if (p_value->get_value_type() == Value::VAL_EXPRESSION) {
+        evaluate(p_frame, p_value.view_as<AbstractOperation>(), target);
+        return;
+    }
+    copy_value(target, value_address(p_frame, p_value), p_target->type, p_copy_constructor);
+}
+
+void microjit::MicroJITInterpreter::invoke(const Frame &p_frame, microjit::RefView<microjit::InvocationInstruction> p_instruction) const {
+    const auto& return_type = p_instruction->target_return_type;
+    const auto& arguments = p_instruction->passed_arguments->values;
+    const auto space_size = simple_16_bit_align(return_type.size + p_instruction->arguments_total_size);
+    auto space = (uint8_t*)alloca(space_size);
+    // Arguments are placed top-down, the return value sits at the bottom
+    auto top = space + space_size;
+    for (const auto& arg : arguments){
+        const auto type = value_type(arg);
+        top -= type.size;
+        copy_value(top, value_address(p_frame, arg), type, type.copy_constructor);
+    }
+    const auto& trampoline = p_instruction->target_trampoline;
+    trampoline->get_caller()(trampoline.ptr(), space);
+    top = space + space_size;
+    for (const auto& arg : arguments){
+        const auto type = value_type(arg);
+        top -= type.size;
+        if (!type.is_primitive) ((void (*)(void*))type.destructor)(top);
+    }
+    if (return_type.size == 0) return;
+    const auto& return_var = p_instruction->return_variable;
+    if (return_var.is_valid())
+        copy_value(variable_address(p_frame, return_var), space, return_var->type, return_var->type.copy_constructor);
+    if (!return_type.is_primitive) ((void (*)(void*))return_type.destructor)(space);
+}
+
+microjit::MicroJITInterpreter::Signal
+microjit::MicroJITInterpreter::run_scope(Frame &p_frame, const microjit::RectifiedScope *p_scope) const {
+    const auto& instructions = p_scope->get_instructions();
+    auto signal = SIGNAL_NONE;
+    // Whether the last if of this scope was taken, for the else that follows it
+    bool if_taken = false;
+    uint32_t reached = 0;
+    for (const auto s = uint32_t(instructions.size()); reached < s && signal == SIGNAL_NONE; reached++){
+        const auto& current_instruction = instructions[reached];
+        switch (current_instruction->get_instruction_type()) {
+            case Instruction::IT_CONSTRUCT: {
+                auto as_ctor = current_instruction.view_as<ConstructInstruction>();
+                ((void (*)(void*))as_ctor->ctor)(variable_address(p_frame, as_ctor->target_variable));
+                break;
+            }
+            case Instruction::IT_COPY_CONSTRUCT: {
+                auto as_cc = current_instruction.view_as<CopyConstructInstruction>();
+                assign(p_frame, as_cc->target_variable, as_cc->value_reference, as_cc->ctor);
+                break;
+            }
+            case Instruction::IT_ASSIGN: {
+                auto as_assign = current_instruction.view_as<AssignInstruction>();
+                assign(p_frame, as_assign->target_variable, as_assign->value_reference, as_assign->ctor);
+                break;
+            }
+            case Instruction::IT_RETURN: {
+                auto as_return = current_instruction.view_as<ReturnInstruction>();
+                if (function->return_type.size > 0) {
+                    const auto& type = as_return->return_var->type;
+                    copy_value(p_frame.args_space, variable_address(p_frame, as_return->return_var), type, type.copy_constructor);
+                }
+                signal = SIGNAL_RETURN;
+                break;
+            }
+            case Instruction::IT_SCOPE_CREATE:
+                signal = run_scope(p_frame, current_instruction.view_as<ScopeCreateInstruction>()->scope.ptr());
+                break;
+            case Instruction::IT_CONVERT: {
+                auto as_convert = current_instruction.view_as<ConvertInstruction>();
+                ((void (*)(const void*, void*))as_convert->converter)(variable_address(p_frame, as_convert->from_var),
+                                                                      variable_address(p_frame, as_convert->to_var));
+                break;
+            }
+            case Instruction::IT_PRIMITIVE_CONVERT:
+                MJ_RAISE("Primitive conversion is currently unsupported");
+            case Instruction::IT_INVOKE:
+                invoke(p_frame, current_instruction.view_as<InvocationInstruction>());
+                break;
+            case Instruction::IT_BRANCH: {
+                auto as_branch = current_instruction.view_as<BranchInstruction>();
+                uint64_t condition_buffer[2]{};
+                switch (as_branch->branch_type) {
+                    case BranchInstruction::BRANCH_IF:
+                        if_taken = evaluate(p_frame, as_branch.view_as<IfInstruction>()->condition, condition_buffer);
+                        if (if_taken) signal = run_scope(p_frame, as_branch->sub_scope.ptr());
+                        break;
+                    case BranchInstruction::BRANCH_ELSE:
+                        if (!if_taken) signal = run_scope(p_frame, as_branch->sub_scope.ptr());
+                        break;
+                    case BranchInstruction::BRANCH_WHILE: {
+                        const auto& condition = as_branch.view_as<WhileInstruction>()->condition;
+                        p_frame.loop_depth++;
+                        while (signal == SIGNAL_NONE && evaluate(p_frame, condition, condition_buffer))
+                            signal = run_scope(p_frame, as_branch->sub_scope.ptr());
+                        p_frame.loop_depth--;
+                        if (signal == SIGNAL_BREAK) signal = SIGNAL_NONE;
+                        break;
+                    }
+                }
+                break;
+            }
+            case Instruction::IT_BREAK:
+                // If there's no loop, just do nothing
+                if (p_frame.loop_depth) signal = SIGNAL_BREAK;
+                break;
+            case Instruction::IT_NONE:
+            case Instruction::IT_DECLARE_VARIABLE:
+                break;
+        }
+    }
+    destruct_scope(p_frame, p_scope, reached);
+    return signal;
+}
+
+void microjit::MicroJITInterpreter::run(uint8_t *p_args_space) const {
+    // Same layout as a compiled frame, variables sit below a 16-byte aligned base
+    const auto frame_size = frame_report->max_frame_size;
+    auto frame_space = (uint8_t*)alloca(frame_size + 16);
+    Frame frame{ p_args_space, (uint8_t*)simple_16_bit_align(size_t(frame_space) + frame_size), 0 };
+    run_scope(frame, function->main_scope.ptr());
+}
@@ -0,0 +1,50 @@
+//
+// Created by cycastic on 10/19/26.
+//
+
+#ifndef MICROJIT_INTERPRETER_H
+#define MICROJIT_INTERPRETER_H
+
+#include "jit.h"
+
+namespace microjit {
+    // Executes a function straight from its IR, for functions that are not worth compiling yet
+    // Follows the calling convention of compiled code: it receives the same args space,
+    // lays its variables out the same way and calls other functions through their trampolines
+    // Immutable once constructed, so a single instance can be run by several threads at once
+    class MicroJITInterpreter : public ThreadUnsafeObject {
+    private:
+        enum Signal : uint8_t {
+            SIGNAL_NONE,
+            SIGNAL_BREAK,
+            SIGNAL_RETURN,
+        };
+        struct Frame {
+            uint8_t* args_space;
+            // Variables are addressed relative to this, like rbp in compiled code
+            uint8_t* base;
+            uint32_t loop_depth;
+        };
+        const Ref<RectifiedFunction> function;
+        const Ref<MicroJITCompiler::StackFrameInfo> frame_report;
+
+        _NO_DISCARD_ _ALWAYS_INLINE_ uint8_t* variable_address(const Frame& p_frame, const Ref<VariableInstruction>& p_var) const {
+            return p_frame.base + frame_report->variable_map.at(p_var);
+        }
+        _NO_DISCARD_ const void* value_address(const Frame& p_frame, RefView<Value> p_value) const;
+        _NO_DISCARD_ Type value_type(RefView<Value> p_value) const;
+        static void copy_value(void* p_dst, const void* p_src, const Type& p_type, const void* p_copy_constructor);
+        // Destruct the variables of p_scope declared before its instruction p_reached
+        void destruct_scope(const Frame& p_frame, const RectifiedScope* p_scope, uint32_t p_reached) const;
+        // Stores the result in p_result and returns it the way a branch would test it
+        bool evaluate(const Frame& p_frame, RefView<AbstractOperation> p_expression, void* p_result) const;
+        void assign(const Frame& p_frame, const Ref<VariableInstruction>& p_target, RefView<Value> p_value, const void* p_copy_constructor) const;
+        void invoke(const Frame& p_frame, RefView<InvocationInstruction> p_instruction) const;
+        Signal run_scope(Frame& p_frame, const RectifiedScope* p_scope) const;
+    public:
+        explicit MicroJITInterpreter(const Ref<RectifiedFunction>& p_func);
+        void run(uint8_t* p_args_space) const;
+    };
+}
+
+#endif //MICROJIT_INTERPRETER_H
@@ -4,12 +4,25 @@
 
 #include "jit.h"
 #include <stack>
+#include <unordered_set>
 
 #define MAX(m_a, m_b) ((m_a) > (m_b) ? (m_a) : (m_b))
 
 microjit::Ref<microjit::MicroJITCompiler::StackFrameInfo>
-microjit::MicroJITCompiler::create_frame_report(microjit::Ref<microjit::RectifiedFunction>p_func) {
+microjit::MicroJITCompiler::create_frame_report(const microjit::Ref<microjit::RectifiedFunction> &p_func) {
     auto report = new StackFrameInfo();
+    fill_frame_report(p_func, report);
+    return microjit::Ref<microjit::MicroJITCompiler::StackFrameInfo>::from_uninitialized_object(report);
+}
+
+void microjit::MicroJITCompiler::fill_frame_report(const microjit::Ref<microjit::RectifiedFunction> &p_func,
+                                                   StackFrameInfo *r_report) {
+    auto report = r_report;
+    // Clearing keeps the buckets of the previous function around
+    report->max_frame_size = 0;
+    report->max_object_allocation = 0;
+    report->variable_map.clear();
+    report->args_map.clear();
     struct ScopeReport {
         Ref<RectifiedScope> scope;
         size_t current_size;
@@ -32,7 +45,7 @@ microjit::MicroJITCompiler::create_frame_report(microjit::Ref<microjit::Rectifie
     std::stack<ScopeReport> stack{};
     stack.push(ScopeReport{p_func->main_scope, stack_reserve, 0, 0});
     while (!stack.empty()){
-        auto current = stack.top();
+        auto current = std::move(stack.top());
         stack.pop();
         const auto& instructions = current.scope->get_instructions();
         bool break_loop = false;
@@ -55,7 +68,7 @@ microjit::MicroJITCompiler::create_frame_report(microjit::Ref<microjit::Rectifie
                 case Instruction::IT_SCOPE_CREATE:
                     current.iterating++;
                     stack.push(current);
-                    stack.push(ScopeReport{ins.c_style_cast<ScopeCreateInstruction>()->scope,
+                    stack.push(ScopeReport{ins.view_as<ScopeCreateInstruction>()->scope,
                                               current.current_size,
                                               current.current_object_count,
                                               0});
@@ -64,7 +77,7 @@ microjit::MicroJITCompiler::create_frame_report(microjit::Ref<microjit::Rectifie
                 case Instruction::IT_BRANCH:
                     current.iterating++;
                     stack.push(current);
-                    stack.push(ScopeReport{ins.c_style_cast<BranchInstruction>()->sub_scope,
+                    stack.push(ScopeReport{ins.view_as<BranchInstruction>()->sub_scope,
                                            current.current_size,
                                            current.current_object_count,
                                            0});
@@ -77,5 +90,190 @@ microjit::MicroJITCompiler::create_frame_report(microjit::Ref<microjit::Rectifie
         }
     }
     report->max_frame_size = simple_16_bit_align(report->max_frame_size);
-    return microjit::Ref<microjit::MicroJITCompiler::StackFrameInfo>::from_uninitialized_object(report);
+}
+
+static std::atomic<size_t> next_shard_index{};
+static constexpr size_t unassigned_shard = SIZE_MAX;
+static thread_local size_t thread_shard_index = unassigned_shard;
+
+microjit::MicroJITRuntime::MicroJITRuntime(const CodeHeapSettings &p_heap_settings, size_t p_shard_count, size_t p_node_count)
+        : node_count(p_node_count ? p_node_count : 1), heap_settings(p_heap_settings) {
+    if (p_shard_count == 0) p_shard_count = 1;
+    p_shard_count = ((p_shard_count + node_count - 1) / node_count) * node_count;
+    auto shard_settings = p_heap_settings;
+    shard_settings.reserved_size /= p_shard_count;
+    shard_settings.hot_arena_size /= p_shard_count;
+    shards.reserve(p_shard_count);
+    for (size_t i = 0; i < p_shard_count; i++){
+        shards.push_back(new Shard(shard_settings));
+    }
+}
+
+void microjit::MicroJITRuntime::set_thread_shard(size_t p_index) {
+    thread_shard_index = p_index;
+}
+
+microjit::MicroJITRuntime::Shard &microjit::MicroJITRuntime::get_local_shard() {
+    if (unlikely(thread_shard_index == unassigned_shard))
+        thread_shard_index = next_shard_index.fetch_add(1, std::memory_order_relaxed);
+    const auto shard_index = thread_shard_index;
+    if (node_count == 1) return *shards[shard_index % shards.size()];
+    const auto per_node = shards.size() / node_count;
+    const auto node = CpuTopology::get_singleton().get_current_node() % node_count;
+    return *shards[node * per_node + shard_index % per_node];
+}
+
+void microjit::MicroJITRuntime::register_block_internal(Shard& p_shard, void *p_base, void *const *p_entries, size_t p_count) {
+    auto block = new CodeBlock{p_base, &p_shard, {p_count}};
+    for (size_t i = 0; i < p_count; i++){
+        auto& bucket = block_buckets[bucket_index(p_entries[i])];
+        std::lock_guard<std::mutex> guard(bucket.mutex);
+        bucket.blocks[(size_t)p_entries[i]] = block;
+    }
+}
+
+asmjit::Error microjit::MicroJITRuntime::commit_internal(Shard& p_shard, void **p_base, asmjit::CodeHolder *p_code,
+                                                         const void *const *p_hosts, size_t p_host_count) {
+    if (!p_shard.heap.is_valid()) return p_shard.runtime.add(p_base, p_code);
+    // A block is hot when most of its functions are
+    size_t hot_count = 0;
+    bool recompiled = false;
+    for (size_t i = 0; i < p_host_count; i++){
+        auto& bucket = heat_buckets[bucket_index(p_hosts[i])];
+        std::lock_guard<std::mutex> guard(bucket.mutex);
+        auto& record = bucket.records[(size_t)p_hosts[i]];
+        if (record.heat >= heap_settings.hot_threshold) hot_count++;
+        recompiled |= record.placed;
+        record.placed = true;
+    }
+    const auto is_hot_block = p_host_count && hot_count * 2 >= p_host_count;
+    const auto arena = is_hot_block ? CodeHeap::ARENA_HOT : CodeHeap::ARENA_COLD;
+    const auto compact = is_hot_block && recompiled && heap_settings.compact_hot_functions;
+
+    auto err_code = p_code->flatten();
+    if (err_code) return err_code;
+    err_code = p_code->resolveUnresolvedLinks();
+    if (err_code) return err_code;
+    const auto code_size = p_code->codeSize();
+    auto base = p_shard.heap.allocate(code_size, arena, compact);
+    // The heap is full, AsmJit's allocator still has room
+    if (!base) return p_shard.runtime.add(p_base, p_code);
+    err_code = p_code->relocateToBase((uint64_t)base);
+    if (!err_code) err_code = p_code->copyFlattenedData(p_shard.heap.get_writable_address(base), code_size);
+    if (err_code) {
+        p_shard.heap.release(base);
+        return err_code;
+    }
+    *p_base = base;
+    return err_code;
+}
+
+asmjit::Error microjit::MicroJITRuntime::add(void **p_callback, asmjit::CodeHolder *p_code, const void* p_host) {
+    auto& shard = get_local_shard();
+    std::lock_guard<std::mutex> guard(shard.mutex);
+    auto err_code = commit_internal(shard, p_callback, p_code, &p_host, p_host ? 1 : 0);
+    if (err_code) return err_code;
+    register_block_internal(shard, *p_callback, p_callback, 1);
+    return err_code;
+}
+
+asmjit::Error microjit::MicroJITRuntime::add_batch(asmjit::CodeHolder *p_code,
+                                                   const std::vector<asmjit::Label> &p_entry_labels,
+                                                   std::vector<void *> *p_entries,
+                                                   const std::vector<const void*>& p_hosts) {
+    void* base{};
+    auto& shard = get_local_shard();
+    std::lock_guard<std::mutex> guard(shard.mutex);
+    auto err_code = commit_internal(shard, &base, p_code, p_hosts.data(), p_hosts.size());
+    if (err_code) return err_code;
+    p_entries->clear();
+    p_entries->reserve(p_entry_labels.size());
+    for (const auto& label : p_entry_labels){
+        p_entries->push_back((void*)((size_t)base + size_t(p_code->labelOffsetFromBase(label))));
+    }
+    register_block_internal(shard, base, p_entries->data(), p_entries->size());
+    return err_code;
+}
+
+bool microjit::MicroJITRuntime::release(void *p_callback) {
+    CodeBlock* block;
+    {
+        auto& bucket = block_buckets[bucket_index(p_callback)];
+        std::lock_guard<std::mutex> guard(bucket.mutex);
+        auto it = bucket.blocks.find((size_t)p_callback);
+        if (it == bucket.blocks.end()) return false;
+        block = it->second;
+        bucket.blocks.erase(it);
+    }
+    if (block->live_entries.fetch_sub(1, std::memory_order_acq_rel) != 1) return true;
+    auto& shard = *block->shard;
+    {
+        std::lock_guard<std::mutex> guard(shard.mutex);
+        if (shard.heap.owns(block->base)) shard.heap.release(block->base);
+        else shard.runtime.release(block->base);
+    }
+    delete block;
+    return true;
+}
+
+void microjit::MicroJITRuntime::register_heat(const void *p_host, size_t p_amount) {
+    auto& bucket = heat_buckets[bucket_index(p_host)];
+    std::lock_guard<std::mutex> guard(bucket.mutex);
+    bucket.records[(size_t)p_host].heat += p_amount;
+}
+
+void microjit::MicroJITRuntime::clear_heat(const void *p_host) {
+    auto& bucket = heat_buckets[bucket_index(p_host)];
+    std::lock_guard<std::mutex> guard(bucket.mutex);
+    bucket.records.erase((size_t)p_host);
+}
+
+bool microjit::MicroJITRuntime::is_hot(const void *p_host) const {
+    auto& bucket = heat_buckets[bucket_index(p_host)];
+    std::lock_guard<std::mutex> guard(bucket.mutex);
+    auto it = bucket.records.find((size_t)p_host);
+    return it != bucket.records.end() && it->second.heat >= heap_settings.hot_threshold;
+}
+
+microjit::CodeHeap::Statistics microjit::MicroJITRuntime::get_code_heap_statistics() {
+    CodeHeap::Statistics re{};
+    for (auto shard : shards){
+        CodeHeap::Statistics shard_statistics;
+        {
+            std::lock_guard<std::mutex> guard(shard->mutex);
+            shard_statistics = shard->heap.get_statistics();
+        }
+        re.reserved_bytes += shard_statistics.reserved_bytes;
+        re.resident_bytes += shard_statistics.resident_bytes;
+        re.huge_pages |= shard_statistics.huge_pages;
+        for (uint8_t i = 0; i < CodeHeap::ARENA_MAX; i++){
+            auto& total = re.arenas[i];
+            const auto& arena = shard_statistics.arenas[i];
+            total.capacity += arena.capacity;
+            total.used_bytes += arena.used_bytes;
+            total.free_bytes += arena.free_bytes;
+            total.allocation_count += arena.allocation_count;
+            if (arena.largest_free_block > total.largest_free_block) total.largest_free_block = arena.largest_free_block;
+        }
+    }
+    for (auto& arena : re.arenas){
+        arena.fragmentation = arena.free_bytes ? 1.0 - (double(arena.largest_free_block) / double(arena.free_bytes)) : 0.0;
+    }
+    return re;
+}
+
+microjit::MicroJITRuntime::~MicroJITRuntime() {
+    // Blocks shared by several functions appear multiple times in the buckets
+    std::unordered_set<CodeBlock*> unique_blocks{};
+    for (const auto& bucket : block_buckets){
+        for (const auto& entry : bucket.blocks){
+            unique_blocks.insert(entry.second);
+        }
+    }
+    for (auto block : unique_blocks){
+        delete block;
+    }
+    for (auto shard : shards){
+        delete shard;
+    }
 }
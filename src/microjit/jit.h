@@ -7,33 +7,134 @@
 
 #include <asmjit/asmjit.h>
 #include <mutex>
+#include <atomic>
+#include <vector>
 #include <csignal>
 #include "instructions.h"
+#include "code_heap.h"
+#include "cpu_topology.h"
 
 namespace microjit {
-    class MicroJITRuntime : public ThreadUnsafeObject {
+    // Code is committed into one of several shards, each with its own allocator, code heap and lock,
+    // so that compiler threads do not serialize on each other
+    // Referenced from compiler threads and from retired code released on whichever thread reclaims it,
+    // so the reference count has to be atomic
+    class MicroJITRuntime : public ThreadSafeObject {
     private:
-        asmjit::JitRuntime runtime{};
-        std::mutex binary_mutex{};
+        struct Shard;
+        // A single executable allocation, which may host several functions when they are linked as a batch
+        struct CodeBlock {
+            void* base;
+            // Where base was allocated
+            Shard* shard;
+            // Entries may sit in different buckets, so they are released under different locks
+            std::atomic<size_t> live_entries;
+        };
+        struct HeatRecord {
+            size_t heat;
+            // Whether code has already been placed for this host, anything after that is a recompilation
+            bool placed;
+        };
+        struct Shard {
+            asmjit::JitRuntime runtime{};
+            std::mutex mutex{};
+            CodeHeap heap;
+            explicit Shard(const CodeHeapSettings& p_settings) : heap(p_settings) {}
+        };
+        // Entry addresses to their block, split by address so that a release only locks its entry's bucket
+        // and finds the owning shard in the block instead of searching every shard for it
+        struct alignas(64) BlockBucket {
+            std::mutex mutex{};
+            std::unordered_map<size_t, CodeBlock*> blocks{};
+        };
+        // Heat split by host the same way, so that committing code and registering heat only lock the hosts' buckets
+        struct alignas(64) HeatBucket {
+            std::mutex mutex{};
+            std::unordered_map<size_t, HeatRecord> records{};
+        };
+        static constexpr uint8_t bucket_bits = 4;
+        std::vector<Shard*> shards{};
+        BlockBucket block_buckets[size_t(1) << bucket_bits]{};
+        mutable HeatBucket heat_buckets[size_t(1) << bucket_bits]{};
+        // Shards are split evenly between this many NUMA nodes
+        size_t node_count{1};
+        const CodeHeapSettings heap_settings;
+
+        // Threads use the shard set_thread_shard gave them, others are spread across shards in the order they
+        // first commit code. With several nodes a thread only uses the shards of the node it is running on
+        _NO_DISCARD_ Shard& get_local_shard();
+        static _ALWAYS_INLINE_ size_t bucket_index(const void* p_address) {
+            // Fibonacci hashing, hosts and code addresses are aligned so their low bits carry no information
+            return ((size_t)p_address * 11400714819323198485ull) >> (64 - bucket_bits);
+        }
+        void register_block_internal(Shard& p_shard, void* p_base, void* const* p_entries, size_t p_count);
+        asmjit::Error commit_internal(Shard& p_shard, void** p_base, asmjit::CodeHolder* p_code,
+                                      const void* const* p_hosts, size_t p_host_count);
     public:
-        asmjit::JitRuntime& get_asmjit_runtime() { return runtime; }
-        std::mutex& get_mutex() { return binary_mutex; }
+        // The code heap is split evenly between the shards
+        // With p_node_count above 1, the shard count is rounded up to a multiple of it and every node gets its own shards.
+        // Pages are placed on first touch, so code written by threads pinned to a node lives on that node
+        explicit MicroJITRuntime(const CodeHeapSettings& p_heap_settings = CodeHeapSettings(), size_t p_shard_count = 1,
+                                 size_t p_node_count = 1);
+        // Immutable, no lock needed
+        _NO_DISCARD_ const asmjit::Environment& get_environment() const { return shards[0]->runtime.environment(); }
+        _NO_DISCARD_ size_t get_shard_count() const { return shards.size(); }
+        // Make the calling thread commit into shard p_index (modulo the shards of a node), for compiler threads
+        // to call from their prologue with their worker index
+        static void set_thread_shard(size_t p_index);
+
+        // p_host is used to place the function in the hot or cold arena of the code heap
+        asmjit::Error add(void** p_callback, asmjit::CodeHolder* p_code, const void* p_host = nullptr);
+        asmjit::Error add_batch(asmjit::CodeHolder* p_code, const std::vector<asmjit::Label>& p_entry_labels,
+                                std::vector<void*>* p_entries, const std::vector<const void*>& p_hosts = {});
+        // Release a function previously returned by add() or add_batch(), from any thread
+        // The underlying memory is only freed once every function sharing it has been released
+        bool release(void* p_callback);
+
+        void register_heat(const void* p_host, size_t p_amount = 1);
+        void clear_heat(const void* p_host);
+        _NO_DISCARD_ bool is_hot(const void* p_host) const;
+        _NO_DISCARD_ bool uses_code_heap() const { return shards[0]->heap.is_valid(); }
+        // Sum of every shard's code heap
+        _NO_DISCARD_ CodeHeap::Statistics get_code_heap_statistics();
+        ~MicroJITRuntime() override;
     };
     class MicroJITCompiler : public ThreadUnsafeObject {
     public:
+        enum CompilationTier : uint8_t {
+            // Fast, naive codegen, used for the first compilation
+            TIER_BASELINE,
+            // Folds constant expressions and calls compiled JIT functions without going through their trampolines
+            TIER_OPTIMIZED,
+        };
         struct Assembly : public ThreadUnsafeObject {
             asmjit::CodeHolder code{};
             Box<asmjit::x86::Assembler> assembler{};
             void* callback{};
-            explicit Assembly(const asmjit::JitRuntime& p_runtime){
-                code.init(p_runtime.environment());
+            explicit Assembly(const asmjit::Environment& p_environment){
+                code.init(p_environment);
                 assembler = Box<asmjit::x86::Assembler>::make_box(&code);
             }
+            // Start over for another function, keeping the memory the CodeHolder and the assembler already own
+            void reset(const asmjit::Environment& p_environment){
+                code.reset();
+                code.init(p_environment);
+                code.attach(assembler.ptr());
+                callback = nullptr;
+            }
         };
         struct CompilationResult {
             uint32_t error{};
             Ref<Assembly> assembly{};
         };
+        struct BatchCompilationResult {
+            uint32_t error{};
+            Ref<Assembly> assembly{};
+            // Same order as the input functions
+            std::vector<void*> callbacks{};
+            // Bytes each function spans in the shared buffer, from its entry to the next one, same order as well
+            std::vector<size_t> code_sizes{};
+        };
         template<class T>
         struct InstructionHasher {
             size_t operator()(const Ref<T>& p_ins) const{
@@ -52,9 +153,13 @@ namespace microjit {
         static constexpr int64_t stack_reserve = sizeof(void*) * 1;
 
         mutable Ref<MicroJITRuntime> runtime;
-        virtual CompilationResult compile_internal(const Ref<RectifiedFunction>& p_func) const { return {}; }
-        static Ref<StackFrameInfo> create_frame_report(Ref<RectifiedFunction> p_func);
+        virtual CompilationResult compile_internal(const Ref<RectifiedFunction>& p_func, CompilationTier p_tier) const { return {}; }
+        virtual BatchCompilationResult compile_batch_internal(const std::vector<Ref<RectifiedFunction>>& p_funcs) const { return {}; }
     public:
+        // Also used by the interpreter, so that interpreted frames are laid out like compiled ones
+        static Ref<StackFrameInfo> create_frame_report(const Ref<RectifiedFunction>& p_func);
+        // Same as create_frame_report, into a report that may be left over from another function
+        static void fill_frame_report(const Ref<RectifiedFunction>& p_func, StackFrameInfo* r_report);
         static void raise_stack_overflown(){
             static constexpr char message[36] = "MicroJIT instance: Stack overflown\n";
             fprintf(stderr, message);
@@ -62,8 +167,14 @@ namespace microjit {
         }
 
         explicit MicroJITCompiler(const Ref<MicroJITRuntime>& p_runtime) : runtime(p_runtime) {}
-        CompilationResult compile(Ref<RectifiedFunction> p_func) {
-            return compile_internal(p_func);
+        CompilationResult compile(const Ref<RectifiedFunction>& p_func, CompilationTier p_tier = TIER_BASELINE) {
+            return compile_internal(p_func, p_tier);
+        }
+        // Emit every function into a single CodeHolder and commit them with one allocation
+        // JIT calls between functions of the same batch go through the callee's slot, or are direct relative calls
+        // when the callee has no call budget
+        BatchCompilationResult compile_batch(const std::vector<Ref<RectifiedFunction>>& p_funcs) {
+            return compile_batch_internal(p_funcs);
         }
     };
 }
@@ -3,8 +3,9 @@
 //
 #if defined(__x86_64__) || defined(_M_X64)
 
-#include <queue>
+#include <algorithm>
 #include "jit_x86_64.h"
+#include "primitive_operation.h"
 
 
 static constexpr auto rbp = asmjit::x86::rbp;
@@ -51,43 +52,109 @@ static constexpr auto ptrs = int64_t(sizeof(void*));
         }                                                                                           \
     }
 
-microjit::Ref<microjit::MicroJITCompiler_x86_64::BranchesReport>
-microjit::MicroJITCompiler_x86_64::create_branches_report(microjit::Box<asmjit::x86::Assembler> &assembler,
-                                                          const microjit::Ref<microjit::RectifiedFunction> &p_func) {
-    auto report = new BranchesReport();
-    std::queue<Ref<BranchInstruction>> scope_stack{};
+void microjit::MicroJITCompiler_x86_64::fill_branches_report(microjit::Box<asmjit::x86::Assembler> &assembler,
+                                                            const microjit::Ref<microjit::RectifiedFunction> &p_func,
+                                                            BranchesReport* r_report) {
+    auto& branches = r_report->branches;
+    auto& pending = r_report->pending;
+    branches.clear();
+    pending.clear();
     for (const auto& branch : p_func->main_scope->get_branches()) {
-        scope_stack.push(branch);
+        pending.push_back(&branch);
     }
-    Ref<BranchInfo> last_branch_info{};
-    while (!scope_stack.empty()) {
-        auto current_branch = scope_stack.front();
-        scope_stack.pop();
-        auto new_info = Ref<BranchInfo>::make_ref(assembler);
-        if (current_branch->branch_type == BranchInstruction::BRANCH_ELSE) {
-            last_branch_info->else_branch = current_branch;
-            last_branch_info = nullptr;
-        }
-        report->branch_map[current_branch] = new_info;
-        last_branch_info = new_info;
+    for (size_t i = 0; i < pending.size(); i++) {
+        const auto& current_branch = *pending[i];
+        // An else branch always directly follows the branch it belongs to
+        if (current_branch->branch_type == BranchInstruction::BRANCH_ELSE && !branches.empty())
+            branches.back().else_branch = current_branch;
+        branches.emplace_back(assembler, current_branch.ptr());
         for (const auto& branch : current_branch->sub_scope->get_branches()) {
-            scope_stack.push(branch);
+            pending.push_back(&branch);
         }
     }
-    return Ref<BranchesReport>::from_uninitialized_object(report);
+    std::sort(branches.begin(), branches.end(), [](const BranchInfo& p_lhs, const BranchInfo& p_rhs) -> bool {
+        return p_lhs.branch < p_rhs.branch;
+    });
+}
+
+const microjit::MicroJITCompiler_x86_64::BranchInfo *
+microjit::MicroJITCompiler_x86_64::BranchesReport::at(const microjit::BranchInstruction *p_branch) const {
+    auto it = std::lower_bound(branches.begin(), branches.end(), p_branch, [](const BranchInfo& p_info, const BranchInstruction* p_target) -> bool {
+        return p_info.branch < p_target;
+    });
+    if (it == branches.end() || it->branch != p_branch) MJ_RAISE("Branch is not part of this function");
+    return &*it;
 }
 
+microjit::MicroJITCompiler_x86_64::CompilationScratch &microjit::MicroJITCompiler_x86_64::get_scratch() {
+    static thread_local CompilationScratch scratch{};
+    return scratch;
+}
+
+microjit::Ref<microjit::MicroJITCompiler::Assembly> microjit::MicroJITCompiler_x86_64::acquire_assembly() const {
+    auto& cached = get_scratch().assembly;
+    // Still referenced by the result of an earlier compilation, which may still be reading it
+    if (cached.is_null() || cached->get_reference_count() != 1) {
+        cached = Ref<Assembly>::make_ref(runtime->get_environment());
+    } else cached->reset(runtime->get_environment());
+    return cached;
+}
 
 microjit::MicroJITCompiler::CompilationResult
-microjit::MicroJITCompiler_x86_64::compile_internal(const microjit::Ref<microjit::RectifiedFunction> &p_func) const {
-    Ref<Assembly> assembly{};
-    {
-        std::lock_guard<std::mutex> guard(runtime->get_mutex());
-        assembly = Ref<Assembly>::make_ref(runtime->get_asmjit_runtime());
-    }
+microjit::MicroJITCompiler_x86_64::compile_internal(const microjit::Ref<microjit::RectifiedFunction> &p_func,
+                                                    CompilationTier p_tier) const {
+    auto assembly = acquire_assembly();
+    emit_function(assembly->assembler, p_func, nullptr, p_tier);
+    auto err_code = runtime->add(&assembly->callback, &assembly->code, p_func->host);
+    return { err_code, assembly };
+}
+
+microjit::MicroJITCompiler::BatchCompilationResult
+microjit::MicroJITCompiler_x86_64::compile_batch_internal(const std::vector<Ref<RectifiedFunction>> &p_funcs) const {
+    auto assembly = acquire_assembly();
     auto& assembler = assembly->assembler;
+    // Create every entry label up front so that calls can be resolved regardless of emission order
+    std::vector<asmjit::Label> entry_labels{};
+    std::vector<const void*> hosts{};
+    DirectCallMap direct_calls{};
+    entry_labels.reserve(p_funcs.size());
+    hosts.reserve(p_funcs.size());
+    for (const auto& func : p_funcs){
+        auto label = assembler->newLabel();
+        entry_labels.push_back(label);
+        hosts.push_back(func->host);
+        if (func->trampoline.is_valid())
+            direct_calls[func->trampoline.ptr()] = label;
+    }
+    for (size_t i = 0, s = p_funcs.size(); i < s; i++){
+        AINL("Batch entry " << i);
+        AIN(assembler->bind(entry_labels[i]));
+        emit_function(assembler, p_funcs[i], &direct_calls, TIER_BASELINE);
+    }
+    BatchCompilationResult result{};
+    result.assembly = assembly;
+    result.error = runtime->add_batch(&assembly->code, entry_labels, &result.callbacks, hosts);
+    if (result.error || result.callbacks.empty()) return result;
+    assembly->callback = result.callbacks[0];
+    // Functions are emitted in order, the last one also carries whatever follows it
+    result.code_sizes.reserve(entry_labels.size());
+    for (size_t i = 0, s = entry_labels.size(); i < s; i++){
+        const auto begin = assembly->code.labelOffsetFromBase(entry_labels[i]);
+        const auto end = i + 1 < s ? assembly->code.labelOffsetFromBase(entry_labels[i + 1]) : assembly->code.codeSize();
+        result.code_sizes.push_back(size_t(end - begin));
+    }
+    return result;
+}
 
-    auto frame_report = create_frame_report(p_func);
+void microjit::MicroJITCompiler_x86_64::emit_function(microjit::Box<asmjit::x86::Assembler> &assembler,
+                                                      const microjit::Ref<microjit::RectifiedFunction> &p_func,
+                                                      const DirectCallMap* p_direct_calls,
+                                                      CompilationTier p_tier) {
+    auto& scratch = get_scratch();
+    if (scratch.frame_report.is_null()) scratch.frame_report = Ref<StackFrameInfo>::make_ref();
+    auto& frame_report = scratch.frame_report;
+    fill_frame_report(p_func, frame_report.ptr());
+    const bool optimize = p_tier >= TIER_OPTIMIZED;
 
     AINL("Prologue");
     AIN(assembler->push(rbp));
@@ -97,23 +164,26 @@ microjit::MicroJITCompiler_x86_64::compile_internal(const microjit::Ref<microjit
     AIN(assembler->mov(LOAD_ARGS_SPACE, rdi));
 
     const auto& function_arguments = p_func->arguments;
-    auto branches_report = create_branches_report(assembler, p_func);
+    auto& branches_report = scratch.branches_report;
+    fill_branches_report(assembler, p_func, &branches_report);
     const auto& offset_map = frame_report->variable_map;
 
     auto exit_label = assembler->newLabel();
-    std::stack<ScopeInfo> scope_stack{};
-    std::stack<Ref<BranchInfo>> loop_stack{};
-    scope_stack.push(ScopeInfo{p_func->main_scope, -1, nullptr, nullptr, false });
+    auto& scope_stack = scratch.scope_stack;
+    auto& loop_stack = scratch.loop_stack;
+    scope_stack.clear();
+    loop_stack.clear();
+    scope_stack.push_back(ScopeInfo{p_func->main_scope, -1, nullptr, nullptr, false });
     while (!scope_stack.empty()){
-        auto current = scope_stack.top();
+        auto current = std::move(scope_stack.back());
         AINL("Entering scope " << std::to_string((size_t)current.scope.ptr()));
         current.iterating++;
-        scope_stack.pop();
+        scope_stack.pop_back();
 
         const auto& instructions = current.scope->get_instructions();
         for (auto s = int64_t(instructions.size()); current.iterating < s; current.iterating++){
             const auto& current_instruction = instructions[current.iterating];
-            if (current.branch_info.is_valid() && !current.registered_begin) {
+            if (current.branch_info && !current.registered_begin) {
                 AIN(assembler->bind(current.branch_info->begin_of_scope));
                 current.registered_begin = true;
             }
@@ -121,14 +191,14 @@ microjit::MicroJITCompiler_x86_64::compile_internal(const microjit::Ref<microjit
             switch (current_instruction->get_instruction_type()) {
                 case Instruction::IT_CONSTRUCT: {
                     AINL("Constructing variable " << (size_t)current_instruction.ptr());
-                    auto as_ctor = current_instruction.c_style_cast<ConstructInstruction>();
+                    auto as_ctor = current_instruction.view_as<ConstructInstruction>();
                     auto stack_offset = offset_map.at(as_ctor->target_variable);
                     AIN(assembler->lea(rdi, asmjit::x86::qword_ptr(rbp, stack_offset)));
                     AIN(assembler->call(as_ctor->ctor));
                     break;
                 }
                 case Instruction::IT_COPY_CONSTRUCT: {
-                    auto as_cc = current_instruction.c_style_cast<CopyConstructInstruction>();
+                    auto as_cc = current_instruction.view_as<CopyConstructInstruction>();
                     auto type = as_cc->target_variable->type;
                     AINL("Copy constructing variable " << (size_t)as_cc->target_variable.ptr());
                     auto stack_offset = offset_map.at(as_cc->target_variable);
@@ -141,7 +211,7 @@ microjit::MicroJITCompiler_x86_64::compile_internal(const microjit::Ref<microjit
                             break;
                         }
                         case Value::VAL_ARGUMENT: {
-                            auto as_arg = as_cc->value_reference.c_style_cast<ArgumentValue>();
+                            auto as_arg = as_cc->value_reference.view_as<ArgumentValue>();
                             auto arg_offset = frame_report->args_map[as_arg->argument_index];
                             copy_construct_variable_internal(assembler, type, as_cc->ctor,
                                                              { RelativeObject::STACK_BASE_PTR, stack_offset },
@@ -149,7 +219,7 @@ microjit::MicroJITCompiler_x86_64::compile_internal(const microjit::Ref<microjit
                             break;
                         }
                         case Value::VAL_VARIABLE: {
-                            auto as_var_val = as_cc->value_reference.c_style_cast<VariableValue>();
+                            auto as_var_val = as_cc->value_reference.view_as<VariableValue>();
                             auto copy_target_offset = offset_map.at(as_var_val->variable);
                             copy_construct_variable_internal(assembler, type, as_cc->ctor,
                                                              { RelativeObject::STACK_BASE_PTR, stack_offset },
@@ -157,13 +227,15 @@ microjit::MicroJITCompiler_x86_64::compile_internal(const microjit::Ref<microjit
                             break;
                         }
                         case Value::VAL_EXPRESSION: {
+                            if (optimize && fold_atomic_expression(assembler, frame_report, as_cc->target_variable,
+                                                                   as_cc->value_reference)) break;
                             copy_construct_atomic_expression(assembler, frame_report, as_cc);
                         }
                     }
                     break;
                 }
                 case Instruction::IT_ASSIGN: {
-                    auto as_assign = current_instruction.c_style_cast<AssignInstruction>();
+                    auto as_assign = current_instruction.view_as<AssignInstruction>();
                     AINL("Assigning variable " << (size_t)as_assign->target_variable.ptr());
                     auto stack_offset = offset_map.at(as_assign->target_variable);
                     auto type = as_assign->target_variable->type;
@@ -176,7 +248,7 @@ microjit::MicroJITCompiler_x86_64::compile_internal(const microjit::Ref<microjit
                             break;
                         }
                         case Value::VAL_ARGUMENT: {
-                            auto as_arg = as_assign->value_reference.c_style_cast<ArgumentValue>();
+                            auto as_arg = as_assign->value_reference.view_as<ArgumentValue>();
                             auto arg_offset = frame_report->args_map[as_arg->argument_index];
                             copy_construct_variable_internal(assembler, type, as_assign->ctor,
                                                              { RelativeObject::STACK_BASE_PTR, stack_offset },
@@ -184,7 +256,7 @@ microjit::MicroJITCompiler_x86_64::compile_internal(const microjit::Ref<microjit
                             break;
                         }
                         case Value::VAL_VARIABLE: {
-                            auto as_var_val = as_assign->value_reference.c_style_cast<VariableValue>();
+                            auto as_var_val = as_assign->value_reference.view_as<VariableValue>();
                             auto copy_target_offset = offset_map.at(as_var_val->variable);
                             copy_construct_variable_internal(assembler, type, as_assign->ctor,
                                                              { RelativeObject::STACK_BASE_PTR, stack_offset },
@@ -192,6 +264,8 @@ microjit::MicroJITCompiler_x86_64::compile_internal(const microjit::Ref<microjit
                             break;
                         }
                         case Value::VAL_EXPRESSION: {
+                            if (optimize && fold_atomic_expression(assembler, frame_report, as_assign->target_variable,
+                                                                   as_assign->value_reference)) break;
                             assign_atomic_expression(assembler, frame_report, as_assign);
                             break;
                         }
@@ -199,7 +273,7 @@ microjit::MicroJITCompiler_x86_64::compile_internal(const microjit::Ref<microjit
                     break;
                 }
                 case Instruction::IT_RETURN: {
-                    auto as_return = current_instruction.c_style_cast<ReturnInstruction>();
+                    auto as_return = current_instruction.view_as<ReturnInstruction>();
                     AINL("Returning variable " << (size_t)as_return->return_var.ptr());
                     // is void
                     if (p_func->return_type.size > 0) {
@@ -213,32 +287,32 @@ microjit::MicroJITCompiler_x86_64::compile_internal(const microjit::Ref<microjit
 
                     AINL("Destructing all stack items");
                     // Push the current frame so it can be destroyed
-                    scope_stack.push(current);
+                    scope_stack.push_back(current);
                     iterative_destructor_call(assembler, frame_report, scope_stack);
-                    scope_stack.pop();
+                    scope_stack.pop_back();
                     AIN(assembler->jmp(exit_label));
                     // Skips every instructions left in this scope
                     loop_break = true;
                     current.iterating = -1;
                     // Bind the end of the scope
-                    if (current.branch_info.is_valid())
+                    if (current.branch_info)
                         AIN(assembler->bind(current.branch_info->end_of_scope));
                     // If this is a loop, remove it from the loop stack
-                    if (!loop_stack.empty() && (loop_stack.top() == current.branch_info))
-                        loop_stack.pop();
+                    if (!loop_stack.empty() && (loop_stack.back() == current.branch_info))
+                        loop_stack.pop_back();
                     break;
                 }
                 case Instruction::IT_SCOPE_CREATE: {
                     AINL("Creating new scope");
-                    scope_stack.push(current);
-                    scope_stack.push(
-                            ScopeInfo{ current_instruction.c_style_cast<ScopeCreateInstruction>()->scope,
+                    scope_stack.push_back(current);
+                    scope_stack.push_back(
+                            ScopeInfo{ current_instruction.view_as<ScopeCreateInstruction>()->scope,
                                        -1, nullptr, nullptr, false });
                     loop_break = true;
                     break;
                 }
                 case Instruction::IT_CONVERT: {
-                    auto as_convert = current_instruction.c_style_cast<ConvertInstruction>();
+                    auto as_convert = current_instruction.view_as<ConvertInstruction>();
                     AINL("Converting variable " << std::to_string((size_t)as_convert->from_var.ptr()) << " to variable " << std::to_string((size_t)as_convert->to_var.ptr()));
                     auto from_offset = offset_map.at(as_convert->from_var);
                     auto to_offset = offset_map.at(as_convert->to_var);
@@ -251,57 +325,58 @@ microjit::MicroJITCompiler_x86_64::compile_internal(const microjit::Ref<microjit
                     MJ_RAISE("Primitive conversion is currently unsupported");
                 }
                 case Instruction::IT_INVOKE: {
-                    auto as_invocation = current_instruction.c_style_cast<InvocationInstruction>();
+                    auto as_invocation = current_instruction.view_as<InvocationInstruction>();
                     AINL("Invoking function");
-                    invoke_function(assembler, frame_report, p_func, as_invocation);
+                    invoke_function(assembler, frame_report, p_func, as_invocation, p_direct_calls, p_tier);
                     break;
                 }
                 case Instruction::IT_BRANCH: {
                     auto as_branch = current_instruction.c_style_cast<BranchInstruction>();
-                    auto branch_info = branches_report->branch_map.at(as_branch);
+                    const auto branch_info = branches_report.at(as_branch.ptr());
                     switch (as_branch->branch_type) {
                         case BranchInstruction::BRANCH_IF: {
                             // Heh, as if
-                            auto as_if = as_branch.c_style_cast<IfInstruction>();
+                            auto as_if = as_branch.view_as<IfInstruction>();
                             if (!AbstractOperation::is_binary(as_if->condition->operation_type))
                                 MJ_RAISE("Unary operations currently unsupported");
-                            branch_eval_binary_atomic_expression(assembler, frame_report,
-                                                                 branches_report, as_branch,
-                                                                 branch_info,
-                                                                 as_if->condition.c_style_cast<BinaryOperation>());
-                            auto else_branch = branch_info->else_branch;
+                            if (!optimize || !fold_branch_condition(assembler, as_if->condition))
+                                branch_eval_binary_atomic_expression(assembler, frame_report,
+                                                                     branches_report, as_branch,
+                                                                     branch_info,
+                                                                     as_if->condition.view_as<BinaryOperation>());
+                            const auto& else_branch = branch_info->else_branch;
                             AIN(assembler->cmp(asmjit::x86::al, 0));
                             if (else_branch.is_valid()){
-                                auto else_branch_report = branches_report->branch_map.at(else_branch);
+                                const auto else_branch_report = branches_report.at(else_branch.ptr());
                                 AIN(assembler->je(else_branch_report->begin_of_scope));
                             } else {
                                 AIN(assembler->je(branch_info->end_of_scope));
                             }
-                            scope_stack.push(current);
-                            scope_stack.push(
+                            scope_stack.push_back(current);
+                            scope_stack.push_back(
                                     ScopeInfo{ as_if->sub_scope,
                                                -1, as_branch, branch_info, false });
                             loop_break = true;
                             break;
                         }
                         case BranchInstruction::BRANCH_ELSE: {
-                            auto as_else = as_branch.c_style_cast<ElseInstruction>();
-                            scope_stack.push(current);
-                            scope_stack.push(
+                            auto as_else = as_branch.view_as<ElseInstruction>();
+                            scope_stack.push_back(current);
+                            scope_stack.push_back(
                                     ScopeInfo{ as_else->sub_scope,
                                                -1, as_branch, branch_info, false });
                             loop_break = true;
                             break;
                         }
                         case BranchInstruction::BRANCH_WHILE: {
-                            auto as_while = as_branch.c_style_cast<WhileInstruction>();
+                            auto as_while = as_branch.view_as<WhileInstruction>();
                             // Jump to the end to check conditions
                             AIN(assembler->jmp(branch_info->end_of_scope));
-                            scope_stack.push(current);
-                            scope_stack.push(
+                            scope_stack.push_back(current);
+                            scope_stack.push_back(
                                     ScopeInfo{ as_while->sub_scope,
                                                -1, as_branch, branch_info, false });
-                            loop_stack.push(branch_info);
+                            loop_stack.push_back(branch_info);
                             loop_break = true;
                             break;
                         }
@@ -312,7 +387,7 @@ microjit::MicroJITCompiler_x86_64::compile_internal(const microjit::Ref<microjit
                     // If there's no loop, just do nothing
                     if (loop_stack.empty()) break;
                     single_scope_destructor_call(assembler, frame_report, current);
-                    auto top_most_loop = loop_stack.top();
+                    auto top_most_loop = loop_stack.back();
                     AIN(assembler->jmp(top_most_loop->loop_end_of_scope));
                     break;
                 }
@@ -327,33 +402,34 @@ microjit::MicroJITCompiler_x86_64::compile_internal(const microjit::Ref<microjit
             // Currently at the last instruction,
             // call destructors
             single_scope_destructor_call(assembler, frame_report, current);
-            if (current.branch_info.is_valid()) {
+            if (current.branch_info) {
                 AIN(assembler->bind(current.branch_info->end_of_scope));
-                auto curr_branch_instruction = current.branch_instruction;
+                const auto& curr_branch_instruction = current.branch_instruction;
                 switch (curr_branch_instruction->branch_type) {
                     case BranchInstruction::BRANCH_IF: {
-                        auto else_scope = current.branch_info->else_branch;
+                        const auto& else_scope = current.branch_info->else_branch;
                         if (else_scope.is_valid()) {
-                            auto else_branch_info = branches_report->branch_map.at(else_scope);
+                            const auto else_branch_info = branches_report.at(else_scope.ptr());
                             // If condition have an else branch, jump to the end of it after exit normally
                             AIN(assembler->jmp(else_branch_info->end_of_scope));
                         }
                         break;
                     }
                     case BranchInstruction::BRANCH_WHILE: {
-                        auto as_while = curr_branch_instruction.c_style_cast<WhileInstruction>();
+                        auto as_while = curr_branch_instruction.view_as<WhileInstruction>();
                         if (!AbstractOperation::is_binary(as_while->condition->operation_type))
                             MJ_RAISE("Unary operations currently unsupported");
-                        branch_eval_binary_atomic_expression(assembler, frame_report,
-                                                             branches_report,
-                                                             curr_branch_instruction,
-                                                             current.branch_info,
-                                                             as_while->condition.c_style_cast<BinaryOperation>());
+                        if (!optimize || !fold_branch_condition(assembler, as_while->condition))
+                            branch_eval_binary_atomic_expression(assembler, frame_report,
+                                                                 branches_report,
+                                                                 curr_branch_instruction,
+                                                                 current.branch_info,
+                                                                 as_while->condition.view_as<BinaryOperation>());
                         // If satisfied, jump to the start of the scope
                         AIN(assembler->cmp(asmjit::x86::al, 0));
                         AIN(assembler->jne(current.branch_info->begin_of_scope));
                         AIN(assembler->bind(current.branch_info->loop_end_of_scope));
-                        loop_stack.pop();
+                        loop_stack.pop_back();
                         break;
                     }
                     default:
@@ -367,13 +443,6 @@ microjit::MicroJITCompiler_x86_64::compile_internal(const microjit::Ref<microjit
     AIN(assembler->bind(exit_label));
     AIN(assembler->leave());
     AIN(assembler->ret());
-
-    unsigned int err_code;
-    {
-        std::lock_guard<std::mutex> guard(runtime->get_mutex());
-        err_code = runtime->get_asmjit_runtime().add(&assembly->callback, &assembly->code);
-    }
-    return { err_code, assembly };
 }
 void microjit::MicroJITCompiler_x86_64::copy_construct_variable_internal(microjit::Box<asmjit::x86::Assembler> &assembler,
                                                                          const Type& p_type,
@@ -408,11 +477,10 @@ void microjit::MicroJITCompiler_x86_64::copy_construct_variable_internal(microji
 
 void microjit::MicroJITCompiler_x86_64::iterative_destructor_call(microjit::Box<asmjit::x86::Assembler> &assembler,
                                                                   const microjit::Ref<microjit::MicroJITCompiler::StackFrameInfo> &p_frame_info,
-                                                                  const std::stack<ScopeInfo> &p_scope_stack) {
-    auto scope_stack = p_scope_stack;
-    while (!scope_stack.empty()){
-        auto current = scope_stack.top();
-        scope_stack.pop();
+                                                                  const ScopeStack &p_scope_stack) {
+    // Innermost scope first
+    for (auto it = p_scope_stack.rbegin(); it != p_scope_stack.rend(); it++){
+        const auto& current = *it;
         for (const auto& var : current.scope->get_variables()){
             if (var->type.is_primitive) continue;
             // If variable is yet to be constructed
@@ -439,7 +507,7 @@ void microjit::MicroJITCompiler_x86_64::single_scope_destructor_call(microjit::B
 }
 
 void microjit::MicroJITCompiler_x86_64::copy_immediate_primitive_internal(microjit::Box<asmjit::x86::Assembler> &assembler,
-                              const microjit::Ref<microjit::ImmediateValue>& p_value){
+                              RefView<ImmediateValue> p_value){
     auto as_byte_array = p_value->data;
     const auto size = p_value->imm_type.size;
     switch (size) {
@@ -465,7 +533,7 @@ void microjit::MicroJITCompiler_x86_64::copy_immediate_primitive_internal(microj
 }
 
 void microjit::MicroJITCompiler_x86_64::copy_immediate_internal(microjit::Box<asmjit::x86::Assembler> &assembler,
-                                                                const microjit::Ref<microjit::ImmediateValue> &p_value,
+                                                                RefView<ImmediateValue> p_value,
                                                                 const void* p_ctor) {
     const auto type_data = p_value->imm_type;
     // The value to be copied, as byte array
@@ -510,10 +578,10 @@ void microjit::MicroJITCompiler_x86_64::copy_immediate_internal(microjit::Box<as
 
 void microjit::MicroJITCompiler_x86_64::assign_atomic_expression(Box<asmjit::x86::Assembler> &assembler,
                                                                  const Ref<StackFrameInfo>& p_frame_report,
-                                                                 const Ref<AssignInstruction> &p_instruction) {
-    auto as_expr = p_instruction->value_reference.c_style_cast<AbstractOperation>();
+                                                                 RefView<AssignInstruction> p_instruction) {
+    auto as_expr = p_instruction->value_reference.view_as<AbstractOperation>();
     if (AbstractOperation::is_binary(as_expr->operation_type)){
-        auto as_binary_op = as_expr.c_style_cast<BinaryOperation>();
+        auto as_binary_op = as_expr.view_as<BinaryOperation>();
         assign_binary_atomic_expression(assembler, p_frame_report, p_instruction->target_variable, as_binary_op);
     } else {
         MJ_RAISE("Unary operations are yet to be support this");
@@ -523,10 +591,10 @@ void microjit::MicroJITCompiler_x86_64::assign_atomic_expression(Box<asmjit::x86
 void
 microjit::MicroJITCompiler_x86_64::copy_construct_atomic_expression(microjit::Box<asmjit::x86::Assembler> &assembler,
                                                                     const microjit::Ref<microjit::MicroJITCompiler::StackFrameInfo> &p_frame_report,
-                                                                    const microjit::Ref<microjit::CopyConstructInstruction> &p_instruction) {
-    auto as_expr = p_instruction->value_reference.c_style_cast<AbstractOperation>();
+                                                                    RefView<CopyConstructInstruction> p_instruction) {
+    auto as_expr = p_instruction->value_reference.view_as<AbstractOperation>();
     if (AbstractOperation::is_binary(as_expr->operation_type)){
-        auto as_binary_op = as_expr.c_style_cast<BinaryOperation>();
+        auto as_binary_op = as_expr.view_as<BinaryOperation>();
         assign_binary_atomic_expression(assembler, p_frame_report, p_instruction->target_variable, as_binary_op);
     } else {
         MJ_RAISE("Unary operations are yet to be support this");
@@ -537,9 +605,9 @@ void
 microjit::MicroJITCompiler_x86_64::assign_binary_atomic_expression(Box<asmjit::x86::Assembler> &assembler,
                                                                    const Ref<StackFrameInfo>& p_frame_report,
                                                                    const Ref<VariableInstruction> &p_target_var,
-                                                                   const microjit::Ref<microjit::BinaryOperation> &p_binary) {
+                                                                   RefView<BinaryOperation> p_binary) {
     if (p_binary->is_primitive){
-        auto as_primitive_binary_op = p_binary.c_style_cast<PrimitiveBinaryOperation>();
+        auto as_primitive_binary_op = p_binary.view_as<PrimitiveBinaryOperation>();
         assign_primitive_binary_atomic_expression(assembler, p_frame_report, p_target_var, as_primitive_binary_op);
     } else {
         MJ_RAISE("Non-primitive binary operations are yet to be support this");
@@ -566,7 +634,7 @@ microjit::MicroJITCompiler_x86_64::assign_binary_atomic_expression(Box<asmjit::x
         const auto is_fp32 = (m_target_type == float_type);                                             \
         switch (m_operand->get_value_type()) {                                                          \
             case Value::VAL_IMMEDIATE: {                                                                \
-                auto as_imm = m_operand.c_style_cast<ImmediateValue>();                                 \
+                auto as_imm = m_operand.view_as<ImmediateValue>();                                      \
                 if (is_fp32){                                                                           \
                     auto as_integer = *(uint32_t*)as_imm->data;                                         \
                     AIN(assembler->push(as_integer));                                                   \
@@ -583,8 +651,8 @@ microjit::MicroJITCompiler_x86_64::assign_binary_atomic_expression(Box<asmjit::x
             break;                                                                                      \
             }                                                                                           \
             case Value::VAL_VARIABLE: {                                                                 \
-                auto as_var = m_operand.c_style_cast<VariableValue>();                                  \
-                auto curr_var = as_var->variable;                                                       \
+                auto as_var = m_operand.view_as<VariableValue>();                                       \
+                const auto& curr_var = as_var->variable;                                                \
                 auto curr_stack_offset = p_frame_report->variable_map.at(curr_var);                     \
                 AIN(assembler->lea(asmjit::x86::r10, asmjit::x86::qword_ptr(rbp, curr_stack_offset)));  \
                 if (is_fp32){                                                                           \
@@ -603,7 +671,7 @@ microjit::MicroJITCompiler_x86_64::assign_binary_atomic_expression(Box<asmjit::x
     } else {                                                                                            \
         switch (m_operand->get_value_type()) {                                                          \
             case Value::VAL_IMMEDIATE: {                                                                \
-                auto as_imm = m_operand.c_style_cast<ImmediateValue>();                                 \
+                auto as_imm = m_operand.view_as<ImmediateValue>();                                      \
                 const auto* data = as_imm->data;                                                        \
                 switch (m_target_type.size) {                                                           \
                     case 1:                                                                             \
@@ -624,8 +692,8 @@ microjit::MicroJITCompiler_x86_64::assign_binary_atomic_expression(Box<asmjit::x
                 break;                                                                                  \
             }                                                                                           \
         case Value::VAL_VARIABLE: {                                                                     \
-            auto as_var = m_operand.c_style_cast<VariableValue>();                                      \
-            auto curr_var = as_var->variable;                                                           \
+            auto as_var = m_operand.view_as<VariableValue>();                                           \
+            const auto& curr_var = as_var->variable;                                                    \
             auto curr_stack_offset = p_frame_report->variable_map.at(curr_var);                         \
                 AIN(assembler->lea(asmjit::x86::r10, asmjit::x86::qword_ptr(rbp, curr_stack_offset)));  \
             switch (m_target_type.size) {                                                               \
@@ -987,22 +1055,22 @@ void microjit::MicroJITCompiler_x86_64::assign_primitive_binary_atomic_expressio
         Box<asmjit::x86::Assembler> &assembler,
         const Ref<StackFrameInfo>& p_frame_report,
         const Ref<VariableInstruction> &p_target_var,
-        const microjit::Ref<microjit::PrimitiveBinaryOperation> &p_primitive_binary) {
+        RefView<PrimitiveBinaryOperation> p_primitive_binary) {
 
-    auto left_operand = p_primitive_binary->left_operand;
-    auto right_operand = p_primitive_binary->right_operand;
+    const auto& left_operand = p_primitive_binary->left_operand;
+    const auto& right_operand = p_primitive_binary->right_operand;
     Box<Type> operand_type_boxed{};
     bool is_operand_floating_point{};
     switch (left_operand->get_value_type()) {
         case Value::VAL_IMMEDIATE: {
-            auto as_imm = left_operand.c_style_cast<ImmediateValue>();
+            auto as_imm = left_operand.view_as<ImmediateValue>();
             auto type = as_imm->imm_type;
             is_operand_floating_point = Type::is_floating_point(type);
             operand_type_boxed = Box<Type>::make_box(type);
             break;
         }
         case Value::VAL_VARIABLE: {
-            auto as_var = left_operand.c_style_cast<VariableValue>();
+            auto as_var = left_operand.view_as<VariableValue>();
             auto type = as_var->variable->type;
             is_operand_floating_point = Type::is_floating_point(type);
             operand_type_boxed = Box<Type>::make_box(type);
@@ -1051,13 +1119,13 @@ void microjit::MicroJITCompiler_x86_64::assign_primitive_binary_atomic_expressio
 void microjit::MicroJITCompiler_x86_64::branch_eval_binary_atomic_expression(
         microjit::Box<asmjit::x86::Assembler> &assembler,
         const microjit::Ref<microjit::MicroJITCompiler::StackFrameInfo> &p_frame_report,
-        const microjit::Ref<microjit::MicroJITCompiler_x86_64::BranchesReport>& p_branches_report,
+        const microjit::MicroJITCompiler_x86_64::BranchesReport& p_branches_report,
         const microjit::Ref<microjit::BranchInstruction> &p_target_var,
-        const microjit::Ref<microjit::MicroJITCompiler_x86_64::BranchInfo> &p_branch_info,
-        const microjit::Ref<microjit::BinaryOperation> &p_binary) {
+        const microjit::MicroJITCompiler_x86_64::BranchInfo* p_branch_info,
+        RefView<BinaryOperation> p_binary) {
     if (p_binary->is_primitive)
         branch_eval_primitive_binary_atomic_expression(assembler, p_frame_report, p_branches_report, p_target_var,
-                                                       p_branch_info, p_binary.c_style_cast<PrimitiveBinaryOperation>());
+                                                       p_branch_info, p_binary.view_as<PrimitiveBinaryOperation>());
     else
         MJ_RAISE("Branch evaluation only support primitive operations");
 }
@@ -1067,26 +1135,26 @@ void microjit::MicroJITCompiler_x86_64::branch_eval_binary_atomic_expression(
 void microjit::MicroJITCompiler_x86_64::branch_eval_primitive_binary_atomic_expression(
         microjit::Box<asmjit::x86::Assembler> &assembler,
         const microjit::Ref<microjit::MicroJITCompiler::StackFrameInfo> &p_frame_report,
-        const microjit::Ref<microjit::MicroJITCompiler_x86_64::BranchesReport>& p_branches_report,
+        const microjit::MicroJITCompiler_x86_64::BranchesReport& p_branches_report,
         const microjit::Ref<microjit::BranchInstruction> &p_instruction,
-        const microjit::Ref<microjit::MicroJITCompiler_x86_64::BranchInfo> &p_branch_info,
-        const microjit::Ref<microjit::PrimitiveBinaryOperation> &p_primitive_binary) {
-    auto left_operand = p_primitive_binary->left_operand;
-    auto right_operand = p_primitive_binary->right_operand;
+        const microjit::MicroJITCompiler_x86_64::BranchInfo* p_branch_info,
+        RefView<PrimitiveBinaryOperation> p_primitive_binary) {
+    const auto& left_operand = p_primitive_binary->left_operand;
+    const auto& right_operand = p_primitive_binary->right_operand;
     Box<Type> operand_type_boxed{};
     bool is_operand_floating_point{};
     TYPE_CONSTEXPR auto fp32 = Type::create<float>();
     TYPE_CONSTEXPR auto fp64 = Type::create<double>();
     switch (left_operand->get_value_type()) {
         case Value::VAL_IMMEDIATE: {
-            auto as_imm = left_operand.c_style_cast<ImmediateValue>();
+            auto as_imm = left_operand.view_as<ImmediateValue>();
 //            auto type = as_imm->imm_type;
             is_operand_floating_point = as_imm->imm_type == fp32 || as_imm->imm_type == fp64;
             operand_type_boxed = Box<Type>::make_box(as_imm->imm_type);
             break;
         }
         case Value::VAL_VARIABLE: {
-            auto as_var = left_operand.c_style_cast<VariableValue>();
+            auto as_var = left_operand.view_as<VariableValue>();
 //            auto type = as_var->variable->type;
             is_operand_floating_point = as_var->variable->type == fp32 || as_var->variable->type == fp64;
             operand_type_boxed = Box<Type>::make_box(as_var->variable->type);
@@ -1126,10 +1194,134 @@ void microjit::MicroJITCompiler_x86_64::branch_eval_primitive_binary_atomic_expr
         MJ_RAISE("Unsupported operation");
 }
 
+template<typename T>
+static bool fold_typed(microjit::AbstractOperation::OperationType p_op, const void* p_left, const void* p_right,
+                       uint64_t* p_result, size_t* p_result_size){
+    using namespace microjit;
+    const auto left = *(const T*)p_left;
+    const auto right = *(const T*)p_right;
+    // Leave the trap to the runtime
+    if (PrimitiveOperation::traps(p_op, left, right)) return false;
+    T value{};
+    bool condition{};
+    if (!PrimitiveOperation::evaluate(p_op, left, right, &value, &condition)) return false;
+    *p_result = 0;
+    if (AbstractOperation::operation_return_bool(p_op)) {
+        *(bool*)p_result = condition;
+        *p_result_size = sizeof(bool);
+    } else {
+        *(T*)p_result = value;
+        *p_result_size = sizeof(T);
+    }
+    return true;
+}
+
+// Evaluate a primitive binary operation whose operands are both immediates
+// p_condition receives the result as a branch would test it
+static bool fold_primitive_binary(microjit::RefView<microjit::Value> p_expression,
+                                  uint64_t* p_result, size_t* p_result_size, bool* p_condition = nullptr){
+    using namespace microjit;
+    if (p_expression->get_value_type() != Value::VAL_EXPRESSION) return false;
+    auto as_expr = p_expression.view_as<AbstractOperation>();
+    if (!AbstractOperation::is_binary(as_expr->operation_type)) return false;
+    auto as_binary = as_expr.view_as<BinaryOperation>();
+    if (!as_binary->is_primitive) return false;
+    if (as_binary->left_operand->get_value_type() != Value::VAL_IMMEDIATE ||
+        as_binary->right_operand->get_value_type() != Value::VAL_IMMEDIATE) return false;
+    auto left = as_binary->left_operand.view_as<ImmediateValue>();
+    auto right = as_binary->right_operand.view_as<ImmediateValue>();
+    const auto type = left->imm_type;
+    if (type != right->imm_type) return false;
+    const auto op = as_binary->operation_type;
+    bool folded = false;
+    PrimitiveOperation::dispatch(type, [&](auto* p_tag) -> void {
+        typedef std::remove_pointer_t<decltype(p_tag)> T;
+        folded = fold_typed<T>(op, left->data, right->data, p_result, p_result_size);
+        if (folded && p_condition) {
+            *p_condition = AbstractOperation::operation_return_bool(op) ? *(const bool*)p_result
+                                                                        : PrimitiveOperation::to_condition(*(const T*)p_result);
+        }
+    });
+    return folded;
+}
+
+bool microjit::MicroJITCompiler_x86_64::fold_atomic_expression(microjit::Box<asmjit::x86::Assembler> &assembler,
+                                                               const Ref<StackFrameInfo>& p_frame_report,
+                                                               const Ref<VariableInstruction> &p_target_var,
+                                                               RefView<Value> p_expression) {
+    uint64_t result{};
+    size_t result_size{};
+    if (!fold_primitive_binary(p_expression, &result, &result_size)) return false;
+    if (result_size != p_target_var->type.size) return false;
+    auto stack_offset = p_frame_report->variable_map.at(p_target_var);
+    AINL("Folded expression into " << result);
+    switch (result_size) {
+        case 1:
+            AIN(assembler->mov(asmjit::x86::byte_ptr(rbp, stack_offset), uint8_t(result)));
+            break;
+        case 2:
+            AIN(assembler->mov(asmjit::x86::word_ptr(rbp, stack_offset), uint16_t(result)));
+            break;
+        case 4:
+            AIN(assembler->mov(asmjit::x86::dword_ptr(rbp, stack_offset), uint32_t(result)));
+            break;
+        case 8:
+            AIN(assembler->mov(rax, result));
+            AIN(assembler->mov(asmjit::x86::qword_ptr(rbp, stack_offset), rax));
+            break;
+        default:
+            return false;
+    }
+    return true;
+}
+
+bool microjit::MicroJITCompiler_x86_64::fold_branch_condition(microjit::Box<asmjit::x86::Assembler> &assembler,
+                                                              RefView<AbstractOperation> p_condition) {
+    uint64_t result{};
+    size_t result_size{};
+    bool condition{};
+    if (!fold_primitive_binary(p_condition.view_as<Value>(), &result, &result_size, &condition)) return false;
+    AIN(assembler->mov(asmjit::x86::al, uint8_t(condition)));
+    return true;
+}
+
+void microjit::MicroJITCompiler_x86_64::call_through_slot(microjit::Box<asmjit::x86::Assembler> &assembler,
+                                                          const microjit::JitFunctionTrampoline *p_callee) {
+    // Takes one call from the callee's budget the same way call_final does, so heat and tier-ups
+    // are still reported through the trampoline once it runs out. The args space is already at rsp
+    auto take_slot = assembler->newLabel();
+    auto slow_path = assembler->newLabel();
+    auto call_end = assembler->newLabel();
+    // Fall back to the trampoline when the callee has not been compiled yet (or has been evicted)
+    AIN(assembler->mov(rax, (size_t)(p_callee->get_actual_trampoline())));
+    AIN(assembler->mov(rax, asmjit::x86::qword_ptr(rax)));
+    AIN(assembler->test(rax, rax));
+    AIN(assembler->jz(slow_path));
+    AIN(assembler->mov(rcx, (size_t)(&p_callee->get_call_budget()->remaining)));
+    AIN(assembler->mov(asmjit::x86::edx, asmjit::x86::dword_ptr(rcx)));
+    AIN(assembler->test(asmjit::x86::edx, asmjit::x86::edx));
+    AIN(assembler->jz(slow_path));
+    // A negative budget is unbounded
+    AIN(assembler->js(take_slot));
+    AIN(assembler->dec(asmjit::x86::edx));
+    AIN(assembler->mov(asmjit::x86::dword_ptr(rcx), asmjit::x86::edx));
+    AIN(assembler->bind(take_slot));
+    AIN(assembler->mov(rdi, rsp));
+    AIN(assembler->call(rax));
+    AIN(assembler->jmp(call_end));
+    AIN(assembler->bind(slow_path));
+    AIN(assembler->mov(rdi, (size_t)(p_callee)));
+    AIN(assembler->mov(rsi, rsp));
+    AIN(assembler->call(p_callee->get_caller()));
+    AIN(assembler->bind(call_end));
+}
+
 void microjit::MicroJITCompiler_x86_64::invoke_function(microjit::Box<asmjit::x86::Assembler> &assembler,
                                                         const microjit::Ref<microjit::MicroJITCompiler::StackFrameInfo> &p_frame_report,
                                                         const Ref<RectifiedFunction>& p_func,
-                                                        const microjit::Ref<microjit::InvocationInstruction> &p_instruction) {
+                                                        RefView<InvocationInstruction> p_instruction,
+                                                        const DirectCallMap* p_direct_calls,
+                                                        CompilationTier p_tier) {
     const auto target_trampoline = p_instruction->target_trampoline;
     const auto target_return_type = p_instruction->target_return_type;
     auto function_arguments = p_func->arguments;
@@ -1141,7 +1333,7 @@ void microjit::MicroJITCompiler_x86_64::invoke_function(microjit::Box<asmjit::x8
     for (const auto& arg : p_instruction->passed_arguments->values){
         switch (arg->get_value_type()) {
             case Value::VAL_IMMEDIATE: {
-                auto as_imm = arg.c_style_cast<ImmediateValue>();
+                auto as_imm = arg.view_as<ImmediateValue>();
                 AIN(assembler->sub(asmjit::x86::r10, as_imm->imm_type.size));
                 AIN(assembler->mov(rdi, asmjit::x86::r10));
                 if (as_imm->imm_type.is_primitive)
@@ -1150,7 +1342,7 @@ void microjit::MicroJITCompiler_x86_64::invoke_function(microjit::Box<asmjit::x8
                 break;
             }
             case Value::VAL_ARGUMENT: {
-                auto as_arg = arg.c_style_cast<ArgumentValue>();
+                auto as_arg = arg.view_as<ArgumentValue>();
                 auto idx = as_arg->argument_index;
                 const auto type = function_arguments->argument_types()[idx];
                 auto arg_size = type.size;
@@ -1164,7 +1356,7 @@ void microjit::MicroJITCompiler_x86_64::invoke_function(microjit::Box<asmjit::x8
                 break;
             }
             case Value::VAL_VARIABLE: {
-                auto as_var = arg.c_style_cast<VariableValue>();
+                auto as_var = arg.view_as<VariableValue>();
                 auto stack_offset = p_frame_report->variable_map.at(as_var->variable);
                 const auto type = as_var->variable->type;
                 AIN(assembler->sub(asmjit::x86::r10, type.size));
@@ -1179,12 +1371,29 @@ void microjit::MicroJITCompiler_x86_64::invoke_function(microjit::Box<asmjit::x8
     }
 //    AIN(assembler->sub(asmjit::x86::r10, target_return_type.size));
     // The stack setup process is finished
-    // Load trampoline to rdi
-    AIN(assembler->mov(rdi, (size_t)(target_trampoline.ptr())));
-    // Load beginning of new args space to rsi
-    AIN(assembler->mov(rsi, rsp));
-    // Call the trampoline
-    AIN(assembler->call(target_trampoline->get_caller()));
+    const asmjit::Label* direct_target = nullptr;
+    if (p_direct_calls) {
+        auto it = p_direct_calls->find(target_trampoline.ptr());
+        if (it != p_direct_calls->end()) direct_target = &it->second;
+    }
+    const auto as_jit = JitFunctionTrampoline::is_jit_trampoline(target_trampoline.ptr())
+            ? (const JitFunctionTrampoline*)target_trampoline.ptr() : nullptr;
+    if (as_jit && as_jit->get_call_budget() && (direct_target || p_tier >= TIER_OPTIMIZED)) {
+        // Batch-mates go through their slot too, so that they keep reporting heat and pick up their tier-ups
+        call_through_slot(assembler, as_jit);
+    } else if (direct_target){
+        // Callee lives in the same code buffer and has no call budget, so its batch code is called as is
+        // Load beginning of new args space to rdi
+        AIN(assembler->mov(rdi, rsp));
+        AIN(assembler->call(*direct_target));
+    } else {
+        // Load trampoline to rdi
+        AIN(assembler->mov(rdi, (size_t)(target_trampoline.ptr())));
+        // Load beginning of new args space to rsi
+        AIN(assembler->mov(rsi, rsp));
+        // Call the trampoline
+        AIN(assembler->call(target_trampoline->get_caller()));
+    }
 
     AIN(assembler->mov(asmjit::x86::r11, rsp));
     AIN(assembler->add(rsp, aligned_args_space));
@@ -1193,18 +1402,18 @@ void microjit::MicroJITCompiler_x86_64::invoke_function(microjit::Box<asmjit::x8
         Box<Type> type{};
         switch (arg->get_value_type()) {
             case Value::VAL_IMMEDIATE: {
-                auto as_imm = arg.c_style_cast<ImmediateValue>();
+                auto as_imm = arg.view_as<ImmediateValue>();
                 type = Box<Type>::make_box(as_imm->imm_type);
                 break;
             }
             case Value::VAL_ARGUMENT: {
-                auto as_arg = arg.c_style_cast<ArgumentValue>();
+                auto as_arg = arg.view_as<ArgumentValue>();
                 auto idx = as_arg->argument_index;
                 type = Box<Type>::make_box(function_arguments->argument_types()[idx]);
                 break;
             }
             case Value::VAL_VARIABLE: {
-                auto as_var = arg.c_style_cast<VariableValue>();
+                auto as_var = arg.view_as<VariableValue>();
                 type = Box<Type>::make_box(as_var->variable->type);
                 break;
             }
@@ -1222,7 +1431,7 @@ void microjit::MicroJITCompiler_x86_64::invoke_function(microjit::Box<asmjit::x8
     // If there is... you know where to look
     if (target_return_type.size > 0) {
         // Copy the return value (if needed)
-        auto return_var = p_instruction->return_variable;
+        const auto& return_var = p_instruction->return_variable;
         if (return_var.is_valid()){
             auto ret_var_offset = p_frame_report->variable_map.at(return_var);
             // Load variable address to rbx
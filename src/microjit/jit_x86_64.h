@@ -28,26 +28,43 @@
 namespace microjit {
     class MicroJITCompiler_x86_64 : public MicroJITCompiler {
     private:
-        struct BranchInfo : public ThreadUnsafeObject {
-            const asmjit::Label begin_of_scope;
-            const asmjit::Label end_of_scope;
-            const asmjit::Label loop_end_of_scope;
+        struct BranchInfo {
+            const BranchInstruction* branch;
+            asmjit::Label begin_of_scope;
+            asmjit::Label end_of_scope;
+            asmjit::Label loop_end_of_scope;
             Ref<BranchInstruction> else_branch{};
-            explicit BranchInfo(microjit::Box<asmjit::x86::Assembler> &assembler)
-                : begin_of_scope(assembler->newLabel()),
+            BranchInfo(microjit::Box<asmjit::x86::Assembler> &assembler, const BranchInstruction* p_branch)
+                : branch(p_branch),
+                  begin_of_scope(assembler->newLabel()),
                   end_of_scope(assembler->newLabel()),
                   loop_end_of_scope(assembler->newLabel()) {}
         };
-        struct BranchesReport : public ThreadUnsafeObject {
-            std::unordered_map<Ref<BranchInstruction>, Ref<BranchInfo>, InstructionHasher<BranchInstruction>> branch_map{};
+        struct BranchesReport {
+            // Sorted by branch once every branch is registered, lookups are binary searches
+            std::vector<BranchInfo> branches{};
+            // Breadth-first walk over the branches, only used while building the report
+            std::vector<const Ref<BranchInstruction>*> pending{};
+            _NO_DISCARD_ const BranchInfo* at(const BranchInstruction* p_branch) const;
         };
         struct ScopeInfo {
             Ref<RectifiedScope> scope;
             int64_t iterating;
             Ref<BranchInstruction> branch_instruction;
-            Ref<BranchInfo> branch_info;
+            const BranchInfo* branch_info;
             bool registered_begin;
         };
+        typedef std::vector<ScopeInfo> ScopeStack;
+        // Containers reused by every compilation on the same thread, so that compiling a function mostly
+        // runs on memory left over from the previous one
+        struct CompilationScratch {
+            // Handed out again once the result that held it is gone
+            Ref<Assembly> assembly{};
+            Ref<StackFrameInfo> frame_report{};
+            BranchesReport branches_report{};
+            ScopeStack scope_stack{};
+            std::vector<const BranchInfo*> loop_stack{};
+        };
         struct RelativeObject {
             enum BaseUnit : uint32_t {
                 STACK = 1,
@@ -63,20 +80,25 @@ namespace microjit {
             BaseUnit unit;
             int64_t offset;
         };
+        // Entry labels of functions emitted into the same CodeHolder, keyed by their JIT trampoline
+        typedef std::unordered_map<const BaseTrampoline*, asmjit::Label> DirectCallMap;
 //        const x86_64PrimitiveConverter converter{};
     private:
-        static Ref<BranchesReport> create_branches_report(microjit::Box<asmjit::x86::Assembler> &assembler,
-                                                          const microjit::Ref<microjit::RectifiedFunction> &p_func);
+        static CompilationScratch& get_scratch();
+        Ref<Assembly> acquire_assembly() const;
+        static void fill_branches_report(microjit::Box<asmjit::x86::Assembler> &assembler,
+                                         const microjit::Ref<microjit::RectifiedFunction> &p_func,
+                                         BranchesReport* r_report);
         template<class T>
         static void copy_immediate_primitive(microjit::Box<asmjit::x86::Assembler> &assembler,
-                                             const microjit::Ref<T> &p_instruction);
+                                             RefView<T> p_instruction);
         static void copy_immediate_primitive_internal(microjit::Box<asmjit::x86::Assembler> &assembler,
-                                             const Ref<ImmediateValue>& p_value);
+                                             RefView<ImmediateValue> p_value);
         template<class T>
         static void copy_immediate(microjit::Box<asmjit::x86::Assembler> &assembler,
-                                   const microjit::Ref<T> &p_instruction);
+                                   RefView<T> p_instruction);
         static void copy_immediate_internal(microjit::Box<asmjit::x86::Assembler> &assembler,
-                                            const Ref<ImmediateValue>& p_value, const void* p_ctor);
+                                            RefView<ImmediateValue> p_value, const void* p_ctor);
         static void copy_construct_variable_internal(microjit::Box<asmjit::x86::Assembler> &assembler,
                                                      const Type& p_type,
                                                      const void* p_copy_constructor,
@@ -84,44 +106,60 @@ namespace microjit {
                                                      RelativeObject p_copy_target);
         static void iterative_destructor_call(microjit::Box<asmjit::x86::Assembler> &assembler,
                                               const Ref<StackFrameInfo>& p_frame_info,
-                                              const std::stack<ScopeInfo>& p_scope_stack);
+                                              const ScopeStack& p_scope_stack);
         static void single_scope_destructor_call(microjit::Box<asmjit::x86::Assembler> &assembler,
                                                  const microjit::Ref<microjit::MicroJITCompiler::StackFrameInfo> &p_frame_info,
                                                  const microjit::MicroJITCompiler_x86_64::ScopeInfo &p_current_scope);
         static void copy_construct_atomic_expression(Box<asmjit::x86::Assembler> &assembler,
                                                      const Ref<StackFrameInfo>& p_frame_report,
-                                                     const Ref<CopyConstructInstruction> &p_instruction);
+                                                     RefView<CopyConstructInstruction> p_instruction);
         static void assign_atomic_expression(Box<asmjit::x86::Assembler> &assembler,
                                              const Ref<StackFrameInfo>& p_frame_report,
-                                             const Ref<AssignInstruction> &p_instruction);
+                                             RefView<AssignInstruction> p_instruction);
         static void assign_binary_atomic_expression(Box<asmjit::x86::Assembler> &assembler,
                                                     const Ref<StackFrameInfo>& p_frame_report,
                                                     const Ref<VariableInstruction> &p_target_var,
-                                                    const Ref<BinaryOperation> &p_binary);
+                                                    RefView<BinaryOperation> p_binary);
         static void assign_primitive_binary_atomic_expression(Box<asmjit::x86::Assembler> &assembler,
                                                               const Ref<StackFrameInfo>& p_frame_report,
                                                               const Ref<VariableInstruction> &p_instruction,
-                                                              const Ref<PrimitiveBinaryOperation> &p_primitive_binary);
+                                                              RefView<PrimitiveBinaryOperation> p_primitive_binary);
         static void branch_eval_binary_atomic_expression(Box<asmjit::x86::Assembler> &assembler,
                                                         const Ref<StackFrameInfo>& p_frame_report,
-                                                        const Ref<BranchesReport>& p_branches_report,
+                                                        const BranchesReport& p_branches_report,
                                                         const Ref<BranchInstruction> &p_target_var,
-                                                        const Ref<BranchInfo>& p_branch_info,
-                                                        const Ref<BinaryOperation> &p_binary);
+                                                        const BranchInfo* p_branch_info,
+                                                        RefView<BinaryOperation> p_binary);
         static void branch_eval_primitive_binary_atomic_expression(Box<asmjit::x86::Assembler> &assembler,
                                                                    const Ref<StackFrameInfo>& p_frame_report,
-                                                                   const Ref<BranchesReport>& p_branches_report,
+                                                                   const BranchesReport& p_branches_report,
                                                                    const Ref<BranchInstruction> &p_instruction,
-                                                                   const Ref<BranchInfo>& p_branch_info,
-                                                                   const Ref<PrimitiveBinaryOperation> &p_primitive_binary);
+                                                                   const BranchInfo* p_branch_info,
+                                                                   RefView<PrimitiveBinaryOperation> p_primitive_binary);
 //        static void jit_trampoline_caller(JitFunctionTrampoline* p_trampoline, VirtualStack *p_stack);
 //        static void native_trampoline_caller(BaseTrampoline* p_trampoline, VirtualStack *p_stack);
+        // Call p_callee's code straight from its slot while its call budget lasts, through its trampoline otherwise
+        static void call_through_slot(Box<asmjit::x86::Assembler> &assembler, const JitFunctionTrampoline* p_callee);
         static void invoke_function(Box<asmjit::x86::Assembler> &assembler,
                                     const Ref<StackFrameInfo>& p_frame_report,
                                     const Ref<RectifiedFunction>& p_func,
-                                    const Ref<InvocationInstruction>& p_instruction);
+                                    RefView<InvocationInstruction> p_instruction,
+                                    const DirectCallMap* p_direct_calls,
+                                    CompilationTier p_tier);
+        // Emit the result of a primitive expression whose operands are all immediates, if it can be folded
+        static bool fold_atomic_expression(Box<asmjit::x86::Assembler> &assembler,
+                                           const Ref<StackFrameInfo>& p_frame_report,
+                                           const Ref<VariableInstruction> &p_target_var,
+                                           RefView<Value> p_expression);
+        static bool fold_branch_condition(Box<asmjit::x86::Assembler> &assembler,
+                                          RefView<AbstractOperation> p_condition);
+        static void emit_function(Box<asmjit::x86::Assembler> &assembler,
+                                  const Ref<RectifiedFunction>& p_func,
+                                  const DirectCallMap* p_direct_calls,
+                                  CompilationTier p_tier);
     protected:
-        CompilationResult compile_internal(const Ref<RectifiedFunction>& p_func) const override;
+        CompilationResult compile_internal(const Ref<RectifiedFunction>& p_func, CompilationTier p_tier) const override;
+        BatchCompilationResult compile_batch_internal(const std::vector<Ref<RectifiedFunction>>& p_funcs) const override;
     public:
         explicit MicroJITCompiler_x86_64(const Ref<MicroJITRuntime>& p_runtime) : MicroJITCompiler(p_runtime) {}
     };
@@ -130,15 +168,15 @@ namespace microjit {
 
 template<class T>
 void microjit::MicroJITCompiler_x86_64::copy_immediate_primitive(microjit::Box<asmjit::x86::Assembler> &assembler,
-                                                                 const microjit::Ref<T> &p_instruction) {
-    auto imm = p_instruction->value_reference.template c_style_cast<ImmediateValue>();
+                                                                 RefView<T> p_instruction) {
+    auto imm = p_instruction->value_reference.template view_as<ImmediateValue>();
     copy_immediate_primitive_internal(assembler, imm);
 }
 
 template<class T>
 void microjit::MicroJITCompiler_x86_64::copy_immediate(microjit::Box<asmjit::x86::Assembler> &assembler,
-                                                       const microjit::Ref<T> &p_instruction) {
-    auto imm = p_instruction->value_reference.template c_style_cast<ImmediateValue>();
+                                                       RefView<T> p_instruction) {
+    auto imm = p_instruction->value_reference.template view_as<ImmediateValue>();
     copy_immediate_internal(assembler, imm, p_instruction->ctor);
 }
 
@@ -5,12 +5,17 @@
 #ifndef MICROJIT_LOCK_H
 #define MICROJIT_LOCK_H
 
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <cstdint>
 #include <shared_mutex>
 #include "def.h"
 
 namespace microjit {
     class BaseRWLock {
     public:
+        virtual ~BaseRWLock() = default;
         virtual void read_lock() = 0;
         virtual void read_unlock() = 0;
         virtual bool try_read_lock() = 0;
@@ -19,7 +24,7 @@ namespace microjit {
         virtual bool try_write_lock() = 0;
     };
 
-    class RWLock : public BaseRWLock {
+    class RWLock final : public BaseRWLock {
         std::shared_timed_mutex mutex;
     public:
         void read_lock() override { mutex.lock_shared(); }
@@ -30,7 +35,7 @@ namespace microjit {
         bool try_write_lock() override { return mutex.try_lock(); }
     };
 
-    class InertRWLock : public BaseRWLock {
+    class InertRWLock final : public BaseRWLock {
     public:
         void read_lock() override {}
         void read_unlock() override {}
@@ -40,18 +45,87 @@ namespace microjit {
         bool try_write_lock() override { return true; }
     };
 
+    // For read-mostly data: every reader only touches its own padded counter, so readers on different threads
+    // do not bounce a shared cache line. A writer raises a flag and waits for every counter to drain,
+    // which makes writes expensive, and new readers wait for pending writers
+    // A read lock must be released by the thread that took it
+    class ReaderBiasedRWLock final : public BaseRWLock {
+    public:
+        static constexpr size_t reader_slot_count = 64;
+    private:
+        struct alignas(64) ReaderSlot {
+            std::atomic<uint32_t> readers{};
+        };
+        ReaderSlot slots[reader_slot_count]{};
+        alignas(64) std::atomic<bool> writer_active{};
+        // Serializes writers
+        std::mutex writer_mutex{};
+
+        // Threads are handed slots round robin the first time they read, and keep them
+        static _ALWAYS_INLINE_ size_t get_slot_index() {
+            static std::atomic<size_t> next_index{};
+            thread_local const size_t index = next_index.fetch_add(1, std::memory_order_relaxed) % reader_slot_count;
+            return index;
+        }
+        _NO_DISCARD_ bool readers_drained() const {
+            for (const auto& slot : slots) {
+                if (slot.readers.load(std::memory_order_seq_cst)) return false;
+            }
+            return true;
+        }
+    public:
+        void read_lock() override {
+            auto& slot = slots[get_slot_index()];
+            while (true) {
+                // Pairs with write_lock: either the writer sees this reader or this reader sees the writer
+                slot.readers.fetch_add(1, std::memory_order_seq_cst);
+                if (likely(!writer_active.load(std::memory_order_seq_cst))) return;
+                slot.readers.fetch_sub(1, std::memory_order_release);
+                while (writer_active.load(std::memory_order_acquire)) std::this_thread::yield();
+            }
+        }
+        void read_unlock() override { slots[get_slot_index()].readers.fetch_sub(1, std::memory_order_release); }
+        bool try_read_lock() override {
+            auto& slot = slots[get_slot_index()];
+            slot.readers.fetch_add(1, std::memory_order_seq_cst);
+            if (likely(!writer_active.load(std::memory_order_seq_cst))) return true;
+            slot.readers.fetch_sub(1, std::memory_order_release);
+            return false;
+        }
+        void write_lock() override {
+            writer_mutex.lock();
+            writer_active.store(true, std::memory_order_seq_cst);
+            while (!readers_drained()) std::this_thread::yield();
+        }
+        void write_unlock() override {
+            writer_active.store(false, std::memory_order_release);
+            writer_mutex.unlock();
+        }
+        bool try_write_lock() override {
+            if (!writer_mutex.try_lock()) return false;
+            writer_active.store(true, std::memory_order_seq_cst);
+            if (readers_drained()) return true;
+            writer_active.store(false, std::memory_order_release);
+            writer_mutex.unlock();
+            return false;
+        }
+    };
+
+    // Guards call the lock through its own type, so the calls are not virtual when that type is final
+    template <class TLock = BaseRWLock>
     class ReadLockGuard {
     private:
-        BaseRWLock* lock;
+        TLock* lock;
     public:
-        explicit ReadLockGuard(BaseRWLock& p_lock) : lock(&p_lock) { lock->read_lock(); }
+        explicit ReadLockGuard(TLock& p_lock) : lock(&p_lock) { lock->read_lock(); }
         ~ReadLockGuard() { lock->read_unlock(); }
     };
+    template <class TLock = BaseRWLock>
     class WriteLockGuard {
     private:
-        BaseRWLock* lock;
+        TLock* lock;
     public:
-        explicit WriteLockGuard(BaseRWLock& p_lock) : lock(&p_lock) { lock->write_lock(); }
+        explicit WriteLockGuard(TLock& p_lock) : lock(&p_lock) { lock->write_lock(); }
         ~WriteLockGuard() { lock->write_unlock(); }
     };
 }
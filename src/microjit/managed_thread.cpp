@@ -3,6 +3,10 @@
 //
 
 #include "managed_thread.h"
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 ManagedThread::ID ManagedThread::main_thread_id = thread_id_hash(std::this_thread::get_id());
 static thread_local ManagedThread::ID caller_id = 0;
@@ -38,6 +42,33 @@ void ManagedThread::join() {
     }
 }
 
+static bool set_native_affinity(std::thread::native_handle_type p_handle, const microjit::CpuSet& p_cpus){
+#ifdef __linux__
+    if (p_cpus.empty()) return false;
+    cpu_set_t native{};
+    CPU_ZERO(&native);
+    for (auto cpu : p_cpus){
+        if (cpu < CPU_SETSIZE) CPU_SET(cpu, &native);
+    }
+    return pthread_setaffinity_np(p_handle, sizeof(native), &native) == 0;
+#else
+    return false;
+#endif
+}
+
+bool ManagedThread::set_affinity(const microjit::CpuSet &p_cpus) {
+    if (!thread.joinable()) return false;
+    return set_native_affinity(thread.native_handle(), p_cpus);
+}
+
+bool ManagedThread::set_current_affinity(const microjit::CpuSet &p_cpus) {
+#ifdef __linux__
+    return set_native_affinity(pthread_self(), p_cpus);
+#else
+    return false;
+#endif
+}
+
 ManagedThread::ID ManagedThread::this_thread_id() {
     if (likely(caller_id_cached)) {
         return caller_id;
@@ -10,6 +10,7 @@
 #include <future>
 #include <functional>
 #include "def.h"
+#include "cpu_topology.h"
 
 class ManagedThread {
 public:
@@ -61,8 +62,11 @@ public:
     _NO_DISCARD_ bool is_alive() const;
     _NO_DISCARD_ bool is_finished() const;
     void join();
+    // Restrict the thread to p_cpus, false if the platform refuses or has no affinity support
+    bool set_affinity(const microjit::CpuSet& p_cpus);
 
     static ID this_thread_id();
+    static bool set_current_affinity(const microjit::CpuSet& p_cpus);
     static _ALWAYS_INLINE_ void yield() { std::this_thread::yield(); }
     static _ALWAYS_INLINE_ void sleep(const size_t& p_microseconds) { std::this_thread::sleep_for(std::chrono::microseconds(p_microseconds)); }
 };
@@ -5,10 +5,15 @@
 #ifndef MICROJIT_ORCHESTRATOR_H
 #define MICROJIT_ORCHESTRATOR_H
 
+#include <optional>
+#include <memory>
 #include "instructions.h"
 #include "utils.h"
 #include "thread_pool.h"
 #include "runtime_agent.h"
+#include "interpreter.h"
+#include "parallel_executor.h"
+#include "instance_registry.h"
 
 #if defined(__x86_64__) || defined(_M_X64)
 #include "jit_x86_64.h"
@@ -23,35 +28,34 @@ namespace microjit {
         template<typename R, typename ...Args>
         struct FunctionInstance : public TRefCounter {
         private:
-            typedef OrchestratorComponent<TCompiler, TRefCounter> Host;
             class InstanceTrampoline {
             private:
-                void (**actual_trampoline)(uint8_t*);
+                const std::atomic<VirtualStackFunction>* actual_trampoline;
                 void (*recompile_cb)(const void*);
+                bool (*interpret_cb)(const void*, uint8_t*);
+                CallBudget* budget;
                 const void* host;
                 friend class FunctionInstance;
 
                 InstanceTrampoline(const void* p_host, void (*p_recompile_cb)(const void*),
-                                   void (**p_actual_trampoline)(uint8_t*))
-                        : host(p_host), recompile_cb(p_recompile_cb),
-                          actual_trampoline(p_actual_trampoline){}
+                                   bool (*p_interpret_cb)(const void*, uint8_t*),
+                                   const std::atomic<VirtualStackFunction>* p_actual_trampoline,
+                                   CallBudget* p_budget)
+                        : host(p_host), recompile_cb(p_recompile_cb), interpret_cb(p_interpret_cb),
+                          actual_trampoline(p_actual_trampoline), budget(p_budget){}
 
                 template<typename T>
                 static _ALWAYS_INLINE_ void move_argument(const T &p_arg, uint8_t **p_stack){
-                    constexpr bool trivially_copy_constructable = std::is_trivially_copy_constructible_v<T>;
                     auto new_addr = (uint8_t*)((size_t)(*p_stack) - sizeof(T));
                     *p_stack = new_addr;
-                    if constexpr (trivially_copy_constructable){
-                        *(T*)(new_addr) = p_arg;
-                    } else
-                        new (new_addr) T(p_arg);
+                    store_stack_value<T>(new_addr, p_arg);
                 }
                 template<typename T>
                 static _ALWAYS_INLINE_ void destruct_argument(uint8_t **p_stack){
                     constexpr bool trivially_destructible = std::is_trivially_destructible_v<T>;
                     auto ptr = *p_stack;
                     if constexpr (!trivially_destructible)
-                        ((T*)ptr)->~T();
+                        std::launder((T*)ptr)->~T();
                     *p_stack = (uint8_t*)((size_t)ptr + sizeof(T));
                 }
 
@@ -59,12 +63,19 @@ namespace microjit {
                 static _ALWAYS_INLINE_ void destruct_return(uint8_t **p_stack){
                     destruct_argument<T>(p_stack);
                 }
+                // Run the function over an args space that is already filled in
+                static _ALWAYS_INLINE_ void invoke(const InstanceTrampoline* p_self, uint8_t* p_space);
                 static R call_internal(const InstanceTrampoline* p_self, Args&&... args);
+                static void call_batch_internal(const InstanceTrampoline* p_self, Span<R> p_out,
+                                                const Span<const std::decay_t<Args>>&... p_args);
             public:
                 R call_final(Args&&... args) const {
                     static constexpr R* dummy = nullptr;
                     return call_internal(this, std::forward<Args>(args)...);
                 }
+                void call_batch_final(Span<R> p_out, const Span<const std::decay_t<Args>>&... p_args) const {
+                    call_batch_internal(this, p_out, p_args...);
+                }
             };
             
         private:
@@ -73,17 +84,96 @@ namespace microjit {
             Ref<RectifiedFunction> rectified_function{};
             const Ref<JitFunctionTrampoline> jit_trampoline;
             const InstanceTrampoline instance_trampoline;
-            mutable VirtualStackFunction real_compiled_function{};
+            // Swapped by tier-ups and evictions while other threads call through it
+            // JIT code and trampolines read it as a plain pointer, which is fine as long as the atomic is lock-free
+            mutable std::atomic<VirtualStackFunction> real_compiled_function{};
+            // Calls the trampolines and JIT callers make straight through real_compiled_function before the next one
+            // goes through compile_internal, unbounded once there is no heat to register and no tier-up to count
+            // An empty slot always goes through compile_internal, whatever is left
+            mutable CallBudget call_budget{};
+            // What call_budget was last refilled with, to tell how many calls skipped compile_internal since
+            mutable std::atomic<int32_t> budget_refill{};
+            mutable SafeNumeric<uint64_t> invocation_count{};
+            // Set once the tier-up has been handed to the hub, which only happens after the baseline code is published
+            // Cleared again if the hub sheds the request
+            mutable std::atomic<bool> tier_up_requested{};
+            mutable SafeNumeric<uint64_t> interpreted_count{};
+            // Set once interpreted calls asked for the background compilation, so that they only ask once
+            // Cleared once the instance has code, so that an evicted instance asks again, a failed compilation is not retried
+            mutable std::atomic<bool> compile_requested{};
+            // Built on the first interpreted call
+            mutable std::once_flag interpreter_flag{};
+            mutable Ref<MicroJITInterpreter> interpreter{};
+            // Background compilation state, guarded by async_lock
+            mutable std::mutex async_lock{};
+            mutable bool is_compiling_async{};
+            mutable std::shared_future<VirtualStackFunction> pending_compilation{};
+            mutable std::vector<std::function<void(bool)>> pending_callbacks{};
+            std::function<R(Args...)> fallback{};
+            // Handed to the handler with every compilation of this instance
+            std::atomic<uint8_t> compile_priority{ThreadPool::MEDIUM};
+            // Nanoseconds a background compilation may wait for a compiler thread, 0 for no deadline
+            std::atomic<int64_t> compile_budget{};
+            static_assert(sizeof(std::atomic<VirtualStackFunction>) == sizeof(VirtualStackFunction) &&
+                          std::atomic<VirtualStackFunction>::is_always_lock_free);
         private:
             void compile_internal() const;
+            // p_speculative queues the compilation behind every request someone is waiting on
+            std::shared_future<VirtualStackFunction> compile_async_internal(const std::function<void(bool)>& p_callback,
+                                                                            bool p_speculative) const;
+            void finish_async_compilation(VirtualStackFunction p_callback) const;
+            _ALWAYS_INLINE_ const std::atomic<VirtualStackFunction>* get_compiled_function_slot() const {
+                return &real_compiled_function;
+            }
 
-            _NO_DISCARD_ _ALWAYS_INLINE_ bool is_compiled() const { return real_compiled_function != nullptr; }
-            static void static_recompile(const FunctionInstance* p_self);
+            _NO_DISCARD_ _ALWAYS_INLINE_ bool is_compiled() const {
+                return real_compiled_function.load(std::memory_order_acquire) != nullptr;
+            }
+            // Take the erased host the trampolines hand back
+            static void static_recompile(const void* p_host);
+            static bool static_interpret(const void* p_host, uint8_t* p_stack);
+            friend class OrchestratorComponent;
         public:
             explicit FunctionInstance(const OrchestratorComponent* p_orchestrator);
 
             Ref<Function<R, Args...>> get_function() const { return function; }
+            // Cheap, does not touch the handler
+            _NO_DISCARD_ _ALWAYS_INLINE_ bool is_ready() const { return is_compiled(); }
+            // Compile in the background, the returned future holds nullptr if the compilation failed
+            // p_callback is called with whether the compilation succeeded, on the compiling thread
+            std::shared_future<VirtualStackFunction> compile_async(const std::function<void(bool)>& p_callback = {}) const {
+                return compile_async_internal(p_callback, false);
+            }
+            // Declare the function finished, it is compiled in the background at low priority ahead of its first call
+            // Calls made before that compilation finishes wait for it instead of compiling the function again
+            std::shared_future<VirtualStackFunction> seal() const { return compile_async_internal({}, true); }
+            // Called instead of the compiled function under FIRST_CALL_FALLBACK until it is ready, not thread-safe
+            void set_fallback(const std::function<R(Args...)>& p_fallback) { fallback = p_fallback; }
+            // HIGH for latency-critical instances, LOW for background ones, only MULTI_POOLED tells them apart
+            // Speculative compilations started by seal() and tier-ups always run at LOW
+            void set_compile_priority(ThreadPool::Priority p_priority) { compile_priority.store(p_priority, std::memory_order_relaxed); }
+            // Background compilations still queued p_budget after they were requested are cancelled,
+            // the instance is then compiled again on its next call. Zero removes the deadline
+            void set_compile_deadline(const std::chrono::nanoseconds& p_budget) { compile_budget.store(p_budget.count(), std::memory_order_relaxed); }
+            _NO_DISCARD_ CompileOptions get_compile_options() const {
+                CompileOptions re{};
+                re.priority = ThreadPool::Priority(compile_priority.load(std::memory_order_relaxed));
+                const auto budget = compile_budget.load(std::memory_order_relaxed);
+                if (budget > 0) re.deadline = ThreadPool::Clock::now() + std::chrono::nanoseconds(budget);
+                return re;
+            }
             R call(Args... args) const;
+            // Call the function once per row, p_out[i] receives the result of the arguments at index i
+            // Every input must hold at least p_out.size() rows, a Span<void> only carries the row count
+            // The whole batch runs under one epoch and reuses a single args space, but every row still loads the
+            // code slot and takes the call budget like call does, so tier-ups and evictions take effect mid-batch
+            // Blocks on the first row if the function is not compiled, regardless of first_call_policy
+            void call_batch(Span<const std::decay_t<Args>>... p_args, Span<R> p_out) const;
+            void call_batch(const std::tuple<Span<const std::decay_t<Args>>...>& p_args, Span<R> p_out) const {
+                std::apply([this, p_out](const auto&... p_columns) -> void {
+                    instance_trampoline.call_batch_final(p_out, p_columns...);
+                }, p_args);
+            }
             void recompile() const;
             void detach();
             _ALWAYS_INLINE_ std::function<R(Args...)> get_compiled_function_compat() const {
@@ -107,6 +197,14 @@ namespace microjit {
             void recompile() const { instance->recompile(); }
             void detach() { instance->detach(); }
             Ref<FunctionInstance<R, Args...>> unwrap() const { return instance; }
+            _NO_DISCARD_ bool is_ready() const { return instance->is_ready(); }
+            std::shared_future<VirtualStackFunction> compile_async(const std::function<void(bool)>& p_callback = {}) const {
+                return instance->compile_async(p_callback);
+            }
+            void set_fallback(const std::function<R(Args...)>& p_fallback) { instance->set_fallback(p_fallback); }
+            void set_compile_priority(ThreadPool::Priority p_priority) { instance->set_compile_priority(p_priority); }
+            void set_compile_deadline(const std::chrono::nanoseconds& p_budget) { instance->set_compile_deadline(p_budget); }
+            std::shared_future<VirtualStackFunction> seal() const { return instance->seal(); }
 
             std::function<R(Args...)> get_compiled_function() const {
                 return instance->get_compiled_function_compat();
@@ -118,28 +216,59 @@ namespace microjit {
             _ALWAYS_INLINE_ R operator()(Args... args) const {
                 return call(std::forward<Args>(args)...);
             }
+            void call_batch(Span<const std::decay_t<Args>>... p_args, Span<R> p_out) const {
+                instance->call_batch(p_args..., p_out);
+            }
+            void call_batch(const std::tuple<Span<const std::decay_t<Args>>...>& p_args, Span<R> p_out) const {
+                instance->call_batch(p_args, p_out);
+            }
         };
         struct InstanceHub {
         private:
             OrchestratorComponent* parent;
         public:
             explicit InstanceHub(OrchestratorComponent* p_orchestrator) : parent(p_orchestrator) {}
-            _NO_DISCARD_ VirtualStackFunction fetch_function(const Ref<RectifiedFunction> &p_func) const;
+            _NO_DISCARD_ VirtualStackFunction fetch_function(const Ref<RectifiedFunction> &p_func, const CompileOptions& p_options) const;
+            std::shared_future<VirtualStackFunction> fetch_function_async(const Ref<RectifiedFunction> &p_func,
+                                                                          const CompilationHandler::CompletionCallback& p_on_ready,
+                                                                          const CompileOptions& p_options) const {
+                return parent->agent.get_or_create_async(p_func, p_on_ready, p_options);
+            }
+            std::shared_future<VirtualStackFunction> precompile(const Ref<RectifiedFunction> &p_func,
+                                                                const CompilationHandler::CompletionCallback& p_on_ready,
+                                                                const CompileOptions& p_options) const {
+                return parent->agent.precompile(p_func, p_on_ready, p_options);
+            }
+            VirtualStackFunction recompile(const Ref<RectifiedFunction> &p_func, const CompileOptions& p_options) const {
+                return parent->agent.recompile(p_func, p_options);
+            }
             _NO_DISCARD_ const CompilationAgentSettings& get_settings() const;
             template<typename R, typename ...Args>
             void detach_instance(const FunctionInstance<R, Args...>* p_instance, const void* p_func) const;
-            void register_heat(const Ref<RectifiedFunction>& p_func) const;
+            void register_heat(const Ref<RectifiedFunction>& p_func, uint32_t p_calls) const;
+            _NO_DISCARD_ bool is_tracking_heat() const { return parent->is_tracking_heat(); }
+            bool tier_up(const Ref<RectifiedFunction>& p_func) const { return parent->tier_up(p_func); }
         };
     private:
         friend struct InstanceHub;
 
+        // Type-erased view of a FunctionInstance, enough to compile it without knowing its signature
+        struct InstanceRecord {
+            Ref<TRefCounter> instance;
+            Ref<RectifiedFunction> function;
+            std::atomic<VirtualStackFunction>* compiled_function;
+            void (*seal)(const TRefCounter*);
+        };
+
         const InstanceHub hub;
         CompilationAgentSettings agent_settings;
         Ref<TCompiler> compiler{};
         Ref<MicroJITRuntime> runtime{};
         RuntimeAgent<TCompiler> agent;
 
-        std::unordered_map<size_t, Ref<TRefCounter>> instance_map{};
+        InstanceRegistry<InstanceRecord> instance_registry;
+        std::once_flag executor_flag{};
+        std::unique_ptr<ParallelExecutor> executor{};
     private:
         const CompilationAgentSettings& get_settings() const { return agent_settings; }
         MicroJITCompiler::CompilationResult compile(const Ref<RectifiedFunction>& p_func) {
@@ -148,55 +277,259 @@ namespace microjit {
         bool has_function(const Ref<RectifiedFunction> &p_func) const {
             return agent.function_compiled(p_func);
         }
-        VirtualStackFunction fetch_function(const Ref<RectifiedFunction> &p_func) {
-            return agent.get_or_create(p_func);
+        VirtualStackFunction fetch_function(const Ref<RectifiedFunction> &p_func, const CompileOptions& p_options) {
+            return agent.get_or_create(p_func, p_options);
+        }
+        template<typename R, typename ...Args>
+        static std::pair<size_t, InstanceRecord> make_record(const Ref<FunctionInstance<R, Args...>>& p_instance) {
+            return { (size_t)(p_instance->rectified_function->host),
+                     InstanceRecord{ p_instance.template c_style_cast<TRefCounter>(),
+                                     p_instance->rectified_function,
+                                     &p_instance->real_compiled_function,
+                                     [](const TRefCounter* p_instance) -> void {
+                                         ((const FunctionInstance<R, Args...>*)p_instance)->seal();
+                                     } } };
         }
         template<typename R, typename ...Args>
         _ALWAYS_INLINE_ InstanceWrapper<R, Args...> create_instance_internal() {
             auto instance = Ref<FunctionInstance<R, Args...>>::make_ref(this);
-            instance_map[(size_t)(instance.ptr())] = instance.template c_style_cast<TRefCounter>();
+            auto record = make_record(instance);
+            instance_registry.insert(record.first, record.second);
             return InstanceWrapper<R, Args...>(instance);
         }
-        void rectified_detach_instance(const void* p_instance, const void* p_func){
-            instance_map.erase((size_t)p_instance);
+        template<typename R, typename ...Args>
+        static void collect_pending(const FunctionInstance<R, Args...>* p_instance,
+                                    std::vector<Ref<RectifiedFunction>>* p_funcs,
+                                    std::vector<std::atomic<VirtualStackFunction>*>* p_slots){
+            if (p_instance->is_compiled()) return;
+            p_funcs->push_back(p_instance->rectified_function);
+            p_slots->push_back(&p_instance->real_compiled_function);
+        }
+        void link_batch(const std::vector<Ref<RectifiedFunction>>& p_funcs,
+                        const std::vector<std::atomic<VirtualStackFunction>*>& p_slots){
+            if (p_funcs.empty()) return;
+            auto callbacks = agent.get_or_create_batch(p_funcs);
+            if (callbacks.size() != p_funcs.size()) MJ_RAISE("Failed to compile batch");
+            for (size_t i = 0, s = p_slots.size(); i < s; i++){
+                p_slots[i]->store(callbacks[i], std::memory_order_release);
+            }
+        }
+        void rectified_detach_instance(const void* p_func){
+            instance_registry.remove((size_t)p_func, [](InstanceRecord& p_record) -> void {
+                // Unpublish the code before the handler retires it
+                p_record.compiled_function->store(nullptr, std::memory_order_release);
+            });
             agent.remove_function(p_func);
+            agent.clear_heat(p_func);
         }
         template<typename R, typename ...Args>
         void detach_instance(const FunctionInstance<R, Args...>* p_instance, const void* p_func){
-            rectified_detach_instance(p_instance, p_func);
+            rectified_detach_instance(p_func);
+        }
+        void register_heat(const Ref<RectifiedFunction>& p_func, uint32_t p_calls){
+            agent.register_heat(p_func, p_calls);
+        }
+        // Eviction needs heat to pick its victims
+        _NO_DISCARD_ _ALWAYS_INLINE_ bool is_tracking_heat() const { return agent_settings.track_heat || agent_settings.cache_capacity; }
+        // Evicted functions are recompiled on their next call
+        void on_function_evicted(const void* p_host){
+            instance_registry.visit((size_t)p_host, [](const InstanceRecord& p_record) -> void {
+                p_record.compiled_function->store(nullptr, std::memory_order_release);
+            });
+        }
+        bool tier_up(const Ref<RectifiedFunction>& p_func){
+            return agent.tier_up(p_func);
+        }
+        void on_function_optimized(const void* p_host, VirtualStackFunction p_callback){
+            instance_registry.visit((size_t)p_host, [p_callback](const InstanceRecord& p_record) -> void {
+                p_record.compiled_function->store(p_callback, std::memory_order_release);
+            });
         }
-        void register_heat(const Ref<RectifiedFunction>& p_func){
-            agent.register_heat(p_func);
+        // Spread p_count rows over the execution pool
+        // SINGLE_UNSAFE cannot have its handler reached from several threads, everything runs on the calling thread
+        void run_parallel(size_t p_count, size_t p_grain, const ParallelExecutor::RangeBody& p_body){
+            if (agent_settings.type == SINGLE_UNSAFE) {
+                if (p_count) p_body(0, p_count, 0);
+                return;
+            }
+            get_executor().run(p_count, p_grain, p_body);
+        }
+        ParallelExecutor& get_executor(){
+            std::call_once(executor_flag, [this]() -> void {
+                executor = std::make_unique<ParallelExecutor>(agent_settings.execution_thread_count,
+                                                              agent_settings.execution_affinity);
+            });
+            return *executor;
+        }
+        _NO_DISCARD_ uint8_t get_parallel_worker_count(){
+            return agent_settings.type == SINGLE_UNSAFE ? 1 : get_executor().get_worker_count();
+        }
+        template<typename R, typename ...Args>
+        static void prepare_parallel(const InstanceWrapper<R, Args...>& p_instance,
+                                     const std::tuple<Span<const std::decay_t<Args>>...>& p_inputs, size_t p_rows){
+            std::apply([p_rows](const auto&... p_columns) -> void {
+                if (((p_columns.size() < p_rows) || ...)) MJ_RAISE("Parallel input is shorter than its output");
+            }, p_inputs);
+            // Rather than having every worker interpret or race into the handler
+            p_instance.compile_async().wait();
+        }
+        template<typename ...Ts>
+        static _ALWAYS_INLINE_ std::tuple<Span<const Ts>...> slice_inputs(const std::tuple<Span<const Ts>...>& p_inputs,
+                                                                          size_t p_begin, size_t p_end){
+            return std::apply([p_begin, p_end](const auto&... p_columns) -> std::tuple<Span<const Ts>...> {
+                return std::tuple<Span<const Ts>...>(Span<const Ts>(p_columns.data() + p_begin, p_end - p_begin)...);
+            }, p_inputs);
         }
-        static constexpr auto default_settings = CompilationAgentSettings{CompilationAgentHandlerType::SINGLE_UNSAFE,
-                                                                        6, 1024 * 4, 8};
+        static constexpr size_t default_parallel_grain = 256;
+        static inline const auto default_settings = CompilationAgentSettings{CompilationAgentHandlerType::SINGLE_UNSAFE,
+                                                                            0, 1024 * 4, 8};
     public:
         explicit OrchestratorComponent(const CompilationAgentSettings& p_settings)
-            : hub(this), agent(p_settings), agent_settings(p_settings) {
+            : hub(this), agent(p_settings), agent_settings(p_settings), instance_registry(p_settings.reader_biased_locking) {
             runtime = Ref<MicroJITRuntime>::make_ref();
             compiler = Ref<TCompiler>::make_ref(runtime);
+            agent.set_eviction_listener([this](const void* p_host) -> void { on_function_evicted(p_host); });
+            agent.set_tier_up_listener([this](const void* p_host, VirtualStackFunction p_callback) -> void {
+                on_function_optimized(p_host, p_callback);
+            });
         }
         OrchestratorComponent(): OrchestratorComponent(default_settings) {}
+        ~OrchestratorComponent() override {
+            // The collector refers to instance_registry through the eviction listener
+            agent.stop_garbage_collector();
+        }
+        // Decay heat and evict the coldest functions until the code cache fits cache_capacity
+        // The multi-threaded handlers also do this in the background
+        void collect_garbage() {
+            agent.collect_garbage();
+        }
+        // Reserved, resident and per-arena usage of the code heap, all zeros when it is disabled
+        _NO_DISCARD_ CodeHeap::Statistics get_code_heap_statistics() {
+            return agent.get_code_heap_statistics();
+        }
         template<typename R, typename ...Args>
         _ALWAYS_INLINE_ InstanceWrapper<R, Args...> create_instance() {
             return create_instance_internal<R, Args...>();
         }
+        // Same as calling create_instance p_count times, registering every instance in one pass
+        template<typename R, typename ...Args>
+        std::vector<InstanceWrapper<R, Args...>> create_instances(size_t p_count) {
+            std::vector<InstanceWrapper<R, Args...>> re{};
+            std::vector<std::pair<size_t, InstanceRecord>> records{};
+            re.reserve(p_count);
+            records.reserve(p_count);
+            for (size_t i = 0; i < p_count; i++){
+                auto instance = Ref<FunctionInstance<R, Args...>>::make_ref(this);
+                records.push_back(make_record(instance));
+                re.emplace_back(instance);
+            }
+            instance_registry.insert_bulk(records);
+            return re;
+        }
         template<typename R, typename ...Args>
         _ALWAYS_INLINE_ InstanceWrapper<R, Args...> create_instance_from_model(const std::function<R(Args...)>&) {
             return create_instance_internal<R, Args...>();
         }
+        // Compile all given instances that are not compiled yet into a single code buffer
+        // JIT calls between them load the callee's code from its slot, so tier-ups and recompilations still apply
+        template<typename ...Instances>
+        void compile_batch(const Instances&... p_instances){
+            std::vector<Ref<RectifiedFunction>> funcs{};
+            std::vector<std::atomic<VirtualStackFunction>*> slots{};
+            (collect_pending(p_instances.ptr(), &funcs, &slots), ...);
+            link_batch(funcs, slots);
+        }
+        // Compile every instance of this orchestrator that is not compiled yet as one batch
+        void compile_pending(){
+            std::vector<Ref<RectifiedFunction>> funcs{};
+            std::vector<std::atomic<VirtualStackFunction>*> slots{};
+            instance_registry.for_each([&funcs, &slots](const InstanceRecord& p_record) -> void {
+                if (p_record.compiled_function->load(std::memory_order_acquire)) return;
+                funcs.push_back(p_record.function);
+                slots.push_back(p_record.compiled_function);
+            });
+            link_batch(funcs, slots);
+        }
+        // Call p_instance once per row on the execution pool, p_outputs[i] receives the result of row i
+        // Every input must hold at least p_outputs.size() rows, rows must be independent of each other
+        // p_grain is the smallest number of rows a worker picks up at once
+        template<typename R, typename ...Args>
+        void parallel_map(const InstanceWrapper<R, Args...>& p_instance,
+                          const std::tuple<Span<const std::decay_t<Args>>...>& p_inputs, Span<R> p_outputs,
+                          size_t p_grain = default_parallel_grain){
+            prepare_parallel(p_instance, p_inputs, p_outputs.size());
+            run_parallel(p_outputs.size(), p_grain, [&](size_t p_begin, size_t p_end, uint8_t) -> void {
+                p_instance.call_batch(slice_inputs(p_inputs, p_begin, p_end),
+                                      Span<R>(p_outputs.data() + p_begin, p_end - p_begin));
+            });
+        }
+        // Call p_instance once per row on the execution pool and fold the results with p_combiner
+        // The first input gives the number of rows, which must not be zero
+        // p_combiner must be associative and commutative, workers fold their rows in the order they claimed them
+        template<typename R, typename ...Args>
+        R parallel_reduce(const InstanceWrapper<R, Args...>& p_instance, const std::function<R(const R&, const R&)>& p_combiner,
+                          const std::tuple<Span<const std::decay_t<Args>>...>& p_inputs,
+                          size_t p_grain = default_parallel_grain){
+            static_assert(!std::is_void_v<R> && sizeof...(Args), "parallel_reduce needs a result and at least one input");
+            const auto rows = std::get<0>(p_inputs).size();
+            if (!rows) MJ_RAISE("Cannot reduce an empty input");
+            prepare_parallel(p_instance, p_inputs, rows);
+            const auto workers = get_parallel_worker_count();
+            const auto grain = std::max<size_t>(p_grain, 1);
+            std::vector<std::optional<R>> partials(workers);
+            // Not a std::vector<R>, which would pack bools into bits
+            std::vector<std::unique_ptr<R[]>> scratch(workers);
+            run_parallel(rows, grain, [&](size_t p_begin, size_t p_end, uint8_t p_worker) -> void {
+                auto& partial = partials[p_worker];
+                const auto fold = [&partial, &p_combiner](R&& p_result) -> void {
+                    if (partial) partial = p_combiner(*partial, p_result);
+                    else partial.emplace(std::move(p_result));
+                };
+                if constexpr (std::is_default_constructible_v<R>) {
+                    // Batched a grain at a time, as a single range may span every row
+                    auto& results = scratch[p_worker];
+                    if (!results) results = std::make_unique<R[]>(grain);
+                    for (size_t begin = p_begin; begin < p_end; begin += grain){
+                        const auto end = std::min(begin + grain, p_end);
+                        p_instance.call_batch(slice_inputs(p_inputs, begin, end), Span<R>(results.get(), end - begin));
+                        for (size_t i = 0; i < end - begin; i++) fold(std::move(results[i]));
+                    }
+                } else {
+                    // Batches write into existing results, so these are called row by row
+                    for (size_t i = p_begin; i < p_end; i++)
+                        fold(std::apply([&p_instance, i](const auto&... p_columns) -> R {
+                            return p_instance(p_columns[i]...);
+                        }, p_inputs));
+                }
+            });
+            std::optional<R> re{};
+            for (const auto& partial : partials){
+                if (!partial) continue;
+                re = re ? p_combiner(*re, *partial) : *partial;
+            }
+            return *re;
+        }
+        // Seal every instance of this orchestrator that is not compiled yet
+        void precompile_all(){
+            std::vector<InstanceRecord> pending{};
+            instance_registry.for_each([&pending](const InstanceRecord& p_record) -> void {
+                if (p_record.compiled_function->load(std::memory_order_acquire)) return;
+                pending.push_back(p_record);
+            });
+            for (const auto& record : pending) record.seal(record.instance.ptr());
+        }
     };
 
     template<class CompilerTy, class RefCounter>
-    void OrchestratorComponent<CompilerTy, RefCounter>::InstanceHub::register_heat(const Ref<RectifiedFunction> &p_func) const {
-        parent->register_heat(p_func);
+    void OrchestratorComponent<CompilerTy, RefCounter>::InstanceHub::register_heat(const Ref<RectifiedFunction> &p_func,
+                                                                                 uint32_t p_calls) const {
+        parent->register_heat(p_func, p_calls);
     }
 
     template<class CompilerTy, class RefCounter>
     template<typename R, typename... Args>
     void OrchestratorComponent<CompilerTy, RefCounter>::FunctionInstance<R, Args...>::detach() {
-        static const auto hub_offset = ((size_t)(&(((Host*)0)->hub)));
-        const auto& instance_hub = *(InstanceHub*)(&((uint8_t *)parent)[hub_offset]);
+        const auto& instance_hub = parent->hub;
         instance_hub.detach_instance(this, function.ptr());
         parent = nullptr;
     }
@@ -213,10 +546,12 @@ namespace microjit {
     OrchestratorComponent<CompilerTy, RefCounter>::FunctionInstance<R, Args...>::FunctionInstance(
             const OrchestratorComponent *p_orchestrator)
             : parent(p_orchestrator), function{Ref<Function<R, Args...>>::make_ref()},
-              jit_trampoline(BaseTrampoline::create_jit_trampoline(this, static_recompile, &real_compiled_function)),
-              instance_trampoline(this, (void(*)(const void*))static_recompile, &real_compiled_function) {
-        rectified_function = function->rectify();
+              jit_trampoline(BaseTrampoline::create_jit_trampoline(this, static_recompile, get_compiled_function_slot(),
+                                                                   static_interpret, &call_budget)),
+              instance_trampoline(this, static_recompile, static_interpret, get_compiled_function_slot(), &call_budget) {
+        // The trampoline must be set before rectifying, as batch compilation use it to find batch-mates
         function->get_trampoline() = jit_trampoline;
+        rectified_function = function->rectify();
     }
 
     template<class CompilerTy, class RefCounter>
@@ -227,45 +562,168 @@ namespace microjit {
     template<class CompilerTy, class RefCounter>
     template<typename R, typename... Args>
     void OrchestratorComponent<CompilerTy, RefCounter>::FunctionInstance<R, Args...>::recompile() const {
-        real_compiled_function = nullptr;
-        compile_internal();
+        const auto& instance_hub = parent->hub;
+        // The old code keeps running until the new one is swapped in, it is retired rather than released
+        auto cb = instance_hub.recompile(rectified_function, get_compile_options());
+        if (cb) real_compiled_function.store(cb, std::memory_order_release);
+    }
+
+    template<class TCompiler, class TRefCounter>
+    template<typename R, typename... Args>
+    void OrchestratorComponent<TCompiler, TRefCounter>::FunctionInstance<R, Args...>::static_recompile(const void *p_host) {
+        static_cast<const FunctionInstance*>(p_host)->compile_internal();
     }
 
     template<class TCompiler, class TRefCounter>
     template<typename R, typename... Args>
-    void OrchestratorComponent<TCompiler, TRefCounter>::FunctionInstance<R, Args...>::static_recompile(
-            const OrchestratorComponent<TCompiler, TRefCounter>::FunctionInstance<R, Args...> *p_self) {
-        p_self->compile_internal();
+    bool OrchestratorComponent<TCompiler, TRefCounter>::FunctionInstance<R, Args...>::static_interpret(const void *p_host, uint8_t *p_stack) {
+        const auto p_self = static_cast<const FunctionInstance*>(p_host);
+        const auto& instance_hub = p_self->parent->hub;
+        const auto interpret_threshold = instance_hub.get_settings().interpret_threshold;
+        if (!interpret_threshold) return false;
+        const auto count = p_self->interpreted_count.increment();
+        // Interpreted calls are reported in samples as well, each one standing for the calls since the last
+        if (instance_hub.is_tracking_heat()) {
+            const auto period = std::max<uint32_t>(instance_hub.get_settings().heat_sample_period, 1);
+            if (count % period == 0) instance_hub.register_heat(p_self->rectified_function, period);
+        }
+        if (count > interpret_threshold) {
+            if (!p_self->compile_requested.load(std::memory_order_relaxed) &&
+                !p_self->compile_requested.exchange(true, std::memory_order_relaxed))
+                p_self->compile_async();
+            // The synchronous handler may have finished already
+            if (p_self->is_compiled()) return false;
+        }
+        std::call_once(p_self->interpreter_flag, [p_self]() -> void {
+            p_self->interpreter = Ref<MicroJITInterpreter>::make_ref(p_self->rectified_function);
+        });
+        p_self->interpreter->run(p_stack);
+        return true;
     }
 
     template<class CompilerTy, class RefCounter>
     template<typename R, typename... Args>
     R OrchestratorComponent<CompilerTy, RefCounter>::FunctionInstance<R, Args...>::call(Args... args) const {
         // return (get_compiled_function_compat())(std::forward<Args>(args)...);
+        if (unlikely(!is_compiled())) {
+            const auto& instance_hub = parent->hub;
+            const auto& settings = instance_hub.get_settings();
+            const auto policy = settings.first_call_policy;
+            if (!settings.interpret_threshold &&
+                (policy == FIRST_CALL_FAIL_FAST || (policy == FIRST_CALL_FALLBACK && fallback))) {
+                compile_async();
+                if (policy == FIRST_CALL_FAIL_FAST) MJ_RAISE("Function is not compiled yet");
+                return fallback(args...);
+            }
+        }
         return instance_trampoline.call_final(std::forward<Args>(args)...);
     }
 
+    template<class CompilerTy, class RefCounter>
+    template<typename R, typename... Args>
+    void OrchestratorComponent<CompilerTy, RefCounter>::FunctionInstance<R, Args...>::call_batch(
+            Span<const std::decay_t<Args>>... p_args, Span<R> p_out) const {
+        instance_trampoline.call_batch_final(p_out, p_args...);
+    }
+
+    template<class CompilerTy, class RefCounter>
+    template<typename R, typename... Args>
+    std::shared_future<typename OrchestratorComponent<CompilerTy, RefCounter>::VirtualStackFunction>
+    OrchestratorComponent<CompilerTy, RefCounter>::FunctionInstance<R, Args...>::compile_async_internal(
+            const std::function<void(bool)> &p_callback, bool p_speculative) const {
+        std::shared_ptr<std::promise<VirtualStackFunction>> promise{};
+        std::shared_future<VirtualStackFunction> re{};
+        VirtualStackFunction compiled{};
+        {
+            std::lock_guard<std::mutex> guard(async_lock);
+            compiled = real_compiled_function.load(std::memory_order_acquire);
+            if (compiled) compile_requested.store(false, std::memory_order_relaxed);
+            else {
+                if (p_callback) pending_callbacks.push_back(p_callback);
+                if (is_compiling_async) return pending_compilation;
+                is_compiling_async = true;
+                // Hand out the future before the handler sees the request, so concurrent callers share it
+                promise = std::make_shared<std::promise<VirtualStackFunction>>();
+                pending_compilation = promise->get_future().share();
+                re = pending_compilation;
+            }
+        }
+        // Outside async_lock, the callback may well call back into this instance
+        if (compiled) {
+            if (p_callback) p_callback(true);
+            return CompilationHandler::make_ready_future(compiled);
+        }
+        const auto& instance_hub = parent->hub;
+        // Keep the instance alive until the compilation finishes
+        auto self = Ref<FunctionInstance>::from_initialized_object(const_cast<FunctionInstance*>(this));
+        auto on_ready = [self, promise](VirtualStackFunction p_compiled) -> void {
+            self->finish_async_compilation(p_compiled);
+            promise->set_value(p_compiled);
+        };
+        if (p_speculative) instance_hub.precompile(rectified_function, on_ready, get_compile_options());
+        else instance_hub.fetch_function_async(rectified_function, on_ready, get_compile_options());
+        return re;
+    }
+
+    template<class CompilerTy, class RefCounter>
+    template<typename R, typename... Args>
+    void OrchestratorComponent<CompilerTy, RefCounter>::FunctionInstance<R, Args...>::finish_async_compilation(
+            VirtualStackFunction p_compiled) const {
+        std::vector<std::function<void(bool)>> callbacks{};
+        {
+            std::lock_guard<std::mutex> guard(async_lock);
+            if (p_compiled) {
+                real_compiled_function.store(p_compiled, std::memory_order_release);
+                compile_requested.store(false, std::memory_order_relaxed);
+            }
+            is_compiling_async = false;
+            callbacks.swap(pending_callbacks);
+        }
+        for (const auto& callback : callbacks) callback(p_compiled != nullptr);
+    }
+
 
     template<class CompilerTy, class RefCounter>
     typename OrchestratorComponent<CompilerTy, RefCounter>::VirtualStackFunction
-    OrchestratorComponent<CompilerTy, RefCounter>::InstanceHub::fetch_function(const Ref<RectifiedFunction> &p_func) const {
-        return parent->fetch_function(p_func);
+    OrchestratorComponent<CompilerTy, RefCounter>::InstanceHub::fetch_function(const Ref<RectifiedFunction> &p_func,
+                                                                                 const CompileOptions& p_options) const {
+        return parent->fetch_function(p_func, p_options);
+    }
+
+    template<class TCompiler, class TRefCounter>
+    template<typename R, typename... Args>
+    void OrchestratorComponent<TCompiler, TRefCounter>::FunctionInstance<R, Args...>::InstanceTrampoline::invoke(
+            const InstanceTrampoline *p_self, uint8_t *p_space) {
+        auto compiled = p_self->actual_trampoline->load(std::memory_order_acquire);
+        if (likely(compiled && p_self->budget->take())) {
+            compiled(p_space);
+        } else if (compiled || !p_self->interpret_cb(p_self->host, p_space)) {
+            p_self->recompile_cb(p_self->host);
+            auto function = p_self->actual_trampoline->load(std::memory_order_acquire);
+            // Evicted between the check and the call
+            if (unlikely(!function)) {
+                p_self->recompile_cb(p_self->host);
+                function = p_self->actual_trampoline->load(std::memory_order_acquire);
+            }
+            function(p_space);
+        }
     }
 
     template<class TCompiler, class TRefCounter>
     template<typename R, typename... Args>
     R OrchestratorComponent<TCompiler, TRefCounter>::FunctionInstance<R, Args...>::InstanceTrampoline::call_internal(
             const InstanceTrampoline *p_self, Args &&... args) {
-        p_self->recompile_cb(p_self->host);
+        // Whatever code is loaded below cannot be released before this returns
+        EpochManager::Guard epoch_guard{};
         constexpr auto args_space_size = calculate_args_space<R, Args...>();
-        uint8_t args_space[args_space_size];
+        alignas(16) uint8_t args_space[args_space_size];
         auto space_ptr = (uint8_t*)args_space;
         space_ptr = (decltype(space_ptr))((size_t)space_ptr + args_space_size);
         (move_argument<Args>(args, &space_ptr), ...);
         space_ptr = (uint8_t*)args_space;
-        (*p_self->actual_trampoline)(space_ptr);
+        invoke(p_self, space_ptr);
         if constexpr (!std::is_void_v<R>) {
-            auto re = *((R*)space_ptr);
+            auto re = load_stack_value<R>(space_ptr);
             // After copying the return value, destroy its stack entry
             destruct_return<R>(&space_ptr);
             if constexpr (sizeof...(Args)){
@@ -278,14 +736,66 @@ namespace microjit {
             }
         }
     }
+    template<class TCompiler, class TRefCounter>
+    template<typename R, typename... Args>
+    void OrchestratorComponent<TCompiler, TRefCounter>::FunctionInstance<R, Args...>::InstanceTrampoline::call_batch_internal(
+            const InstanceTrampoline *p_self, Span<R> p_out, const Span<const std::decay_t<Args>>&... p_args) {
+        const auto rows = p_out.size();
+        if (((p_args.size() < rows) || ...)) MJ_RAISE("Batch input is shorter than its output");
+        EpochManager::Guard epoch_guard{};
+        constexpr auto args_space_size = calculate_args_space<R, Args...>();
+        alignas(16) uint8_t args_space[args_space_size];
+        // Only the epoch and the args space are hoisted out of the loop, each row is a full invoke()
+        for (size_t i = 0; i < rows; i++){
+            auto space_ptr = (uint8_t*)((size_t)args_space + args_space_size);
+            (move_argument<Args>(p_args[i], &space_ptr), ...);
+            space_ptr = (uint8_t*)args_space;
+            invoke(p_self, space_ptr);
+            if constexpr (!std::is_void_v<R>) {
+                p_out[i] = load_stack_value<R>(space_ptr);
+                destruct_return<R>(&space_ptr);
+            }
+            if constexpr (sizeof...(Args)){
+                (destruct_argument<Args>(&space_ptr), ...);
+            }
+        }
+    }
+
     template<class TCompiler, class TRefCounter>
     template<typename R, typename... Args>
     void OrchestratorComponent<TCompiler, TRefCounter>::FunctionInstance<R, Args...>::compile_internal() const {
-        static const auto hub_offset = ((size_t)(&(((Host*)0)->hub)));
+        const auto& instance_hub = parent->hub;
+        const auto& settings = instance_hub.get_settings();
+        const auto tracking_heat = instance_hub.is_tracking_heat();
+        // This call, plus the ones that took the budget since it was last refilled
+        const auto remaining = call_budget.remaining.load(std::memory_order_relaxed);
+        const auto refilled = budget_refill.load(std::memory_order_relaxed);
+        const uint32_t calls = (remaining < 0 ? 0 : uint32_t(std::max<int32_t>(refilled - remaining, 0))) + 1;
+        if (tracking_heat) instance_hub.register_heat(rectified_function, calls);
+        const auto tier_up_threshold = settings.tier_up_threshold;
+        int64_t refill = CallBudget::unbounded;
+        if (tracking_heat) refill = int64_t(std::max<uint32_t>(settings.heat_sample_period, 1)) - 1;
+        if (unlikely(tier_up_threshold && !tier_up_requested.load(std::memory_order_relaxed))) {
+            const auto count = invocation_count.add(calls);
+            // Asking before the baseline is published would race its compilation, keep counting until it is
+            if (count >= tier_up_threshold && is_compiled() && !tier_up_requested.exchange(true, std::memory_order_relaxed)) {
+                // Shed, ask again after another sample of calls
+                if (!instance_hub.tier_up(rectified_function)) {
+                    tier_up_requested.store(false, std::memory_order_relaxed);
+                    refill = int64_t(std::max<uint32_t>(settings.heat_sample_period, 1)) - 1;
+                }
+            }
+            // Come back no later than the call crossing the threshold
+            else {
+                const auto left = count < tier_up_threshold ? int64_t(std::min<uint64_t>(tier_up_threshold - count - 1, INT32_MAX)) : 0;
+                refill = refill < 0 ? left : std::min(refill, left);
+            }
+        }
+        budget_refill.store(int32_t(refill), std::memory_order_relaxed);
+        call_budget.remaining.store(int32_t(refill), std::memory_order_relaxed);
         if (is_compiled()) return;
-        const auto& instance_hub = *(InstanceHub*)(&((uint8_t *)parent)[hub_offset]);
-        auto cb = instance_hub.fetch_function(rectified_function);
-        real_compiled_function = cb;
+        auto cb = instance_hub.fetch_function(rectified_function, get_compile_options());
+        real_compiled_function.store(cb, std::memory_order_release);
     }
 }
 #if defined(__x86_64__) || defined(_M_X64)
@@ -0,0 +1,71 @@
+//
+// Created by cycastic on 10/19/26.
+//
+
+#include "parallel_executor.h"
+#include <algorithm>
+
+// Set on workers while they run a body
+static thread_local bool is_inside_run = false;
+
+static uint8_t resolve_worker_count(uint8_t p_thread_count){
+    if (p_thread_count) return p_thread_count;
+    const auto hardware = std::thread::hardware_concurrency();
+    return (uint8_t)std::clamp<unsigned int>(hardware, 1, UINT8_MAX);
+}
+
+microjit::ParallelExecutor::ParallelExecutor(uint8_t p_thread_count, const AffinityPolicy& p_affinity)
+    : worker_count(resolve_worker_count(p_thread_count)),
+      pool(worker_count - 1, std::function<void()>(), std::function<void()>(), ThreadPool::SCHEDULE_SHARED_QUEUE,
+           ElasticPolicy(), p_affinity) {}
+
+bool microjit::ParallelExecutor::claim(Slice &p_slice, size_t p_grain, size_t *r_begin, size_t *r_end) {
+    auto begin = p_slice.next.load(std::memory_order_relaxed);
+    size_t end;
+    do {
+        if (begin >= p_slice.end) return false;
+        end = std::min(p_slice.end, begin + std::max(p_grain, (p_slice.end - begin) / chunk_divisor));
+    } while (!p_slice.next.compare_exchange_weak(begin, end, std::memory_order_relaxed));
+    *r_begin = begin;
+    *r_end = end;
+    return true;
+}
+
+void microjit::ParallelExecutor::run(size_t p_count, size_t p_grain, const RangeBody &p_body) {
+    if (!p_count) return;
+    p_grain = std::max<size_t>(p_grain, 1);
+    // Nested runs would wait on workers that are all busy with the outer run
+    if (is_inside_run || worker_count == 1 || p_count <= p_grain) {
+        p_body(0, p_count, 0);
+        return;
+    }
+    const auto workers = (uint8_t)std::min<size_t>(worker_count, (p_count + p_grain - 1) / p_grain);
+    std::unique_ptr<Slice[]> slices(new Slice[workers]);
+    for (uint8_t i = 0; i < workers; i++){
+        slices[i].next.store(p_count * i / workers, std::memory_order_relaxed);
+        slices[i].end = p_count * (i + 1) / workers;
+    }
+    std::mutex error_lock{};
+    std::exception_ptr error{};
+    auto work = [&](uint8_t p_worker) -> void {
+        is_inside_run = true;
+        try {
+            size_t begin, end;
+            // Own slice first, then every other slice in turn
+            for (uint8_t i = 0; i < workers; i++){
+                auto& slice = slices[(p_worker + i) % workers];
+                while (claim(slice, p_grain, &begin, &end)) p_body(begin, end, p_worker);
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> guard(error_lock);
+            if (!error) error = std::current_exception();
+        }
+        is_inside_run = false;
+    };
+    auto helpers = pool.queue_group_task(ThreadPool::HIGH, workers - 1, [&work](uint8_t p_idx, uint8_t) -> void {
+        work(p_idx + 1);
+    });
+    work(0);
+    helpers.wait();
+    if (error) std::rethrow_exception(error);
+}
@@ -0,0 +1,43 @@
+//
+// Created by cycastic on 10/19/26.
+//
+
+#ifndef MICROJIT_PARALLEL_EXECUTOR_H
+#define MICROJIT_PARALLEL_EXECUTOR_H
+
+#include <atomic>
+#include <functional>
+#include "thread_pool.h"
+
+namespace microjit {
+    // Runs a range of independent rows across a thread pool, the calling thread takes part as worker 0
+    // The range is split into one contiguous slice per worker so that each worker mostly walks its own memory
+    // Workers carve chunks off the front of their slice, chunks shrink as the slice drains (guided scheduling),
+    // then workers that ran out of rows steal chunks from the other slices
+    class ParallelExecutor {
+    public:
+        // Called with [begin, end) and the index of the worker running it
+        typedef std::function<void(size_t, size_t, uint8_t)> RangeBody;
+    private:
+        // Chunks start at a quarter of what is left in the slice
+        static constexpr size_t chunk_divisor = 4;
+        struct alignas(64) Slice {
+            std::atomic<size_t> next{};
+            size_t end{};
+        };
+        const uint8_t worker_count;
+        ThreadPool pool;
+
+        static bool claim(Slice& p_slice, size_t p_grain, size_t* r_begin, size_t* r_end);
+    public:
+        // p_thread_count of 0 uses every hardware thread, p_affinity only applies to the pool's threads
+        explicit ParallelExecutor(uint8_t p_thread_count = 0, const AffinityPolicy& p_affinity = AffinityPolicy());
+        _NO_DISCARD_ uint8_t get_worker_count() const { return worker_count; }
+        // Blocks until every row has been processed, then rethrows the first exception raised by p_body
+        // p_grain is the smallest chunk handed out, ranges that fit in one chunk run on the calling thread
+        // A run started from inside p_body also runs on the calling thread
+        void run(size_t p_count, size_t p_grain, const RangeBody& p_body);
+    };
+}
+
+#endif //MICROJIT_PARALLEL_EXECUTOR_H
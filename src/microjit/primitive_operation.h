@@ -0,0 +1,83 @@
+//
+// Created by cycastic on 10/19/26.
+//
+
+#ifndef MICROJIT_PRIMITIVE_OPERATION_H
+#define MICROJIT_PRIMITIVE_OPERATION_H
+
+#include <cstdint>
+#include <limits>
+#include <type_traits>
+#include "instructions.h"
+
+namespace microjit {
+    // Evaluates primitive binary operations the same way the emitted x86_64 code does
+    // Shared by constant folding and the interpreter so that every tier agrees on the results
+    class PrimitiveOperation {
+    public:
+        // Whether the emitted code would trap on these operands (integer division by zero or of the minimum by -1)
+        template<typename T>
+        static _ALWAYS_INLINE_ bool traps(AbstractOperation::OperationType p_op, T p_left, T p_right){
+            if constexpr (std::is_integral_v<T>) {
+                if (p_op != AbstractOperation::BINARY_DIV && p_op != AbstractOperation::BINARY_MOD) return false;
+                if (p_right == 0) return true;
+                if constexpr (std::is_signed_v<T>)
+                    return p_left == std::numeric_limits<T>::min() && p_right == T(-1);
+            }
+            return false;
+        }
+        // p_value receives arithmetic results, p_condition comparison results
+        // Integers wrap around, operands that trap must be checked with traps() first,
+        // returns false for unsupported operations
+        template<typename T>
+        static bool evaluate(AbstractOperation::OperationType p_op, T p_left, T p_right, T* p_value, bool* p_condition){
+            // At least as wide as unsigned int, narrower types would otherwise be promoted to int and could overflow it
+            typedef typename std::conditional_t<std::is_integral_v<T>, std::make_unsigned<std::common_type_t<T, unsigned>>,
+                                                std::common_type<T>>::type WrappingType;
+            switch (p_op) {
+                case AbstractOperation::BINARY_ADD: *p_value = T(WrappingType(p_left) + WrappingType(p_right)); return true;
+                case AbstractOperation::BINARY_SUB: *p_value = T(WrappingType(p_left) - WrappingType(p_right)); return true;
+                case AbstractOperation::BINARY_MUL: *p_value = T(WrappingType(p_left) * WrappingType(p_right)); return true;
+                case AbstractOperation::BINARY_DIV: *p_value = T(p_left / p_right); return true;
+                case AbstractOperation::BINARY_MOD:
+                    if constexpr (std::is_integral_v<T>) {
+                        *p_value = T(p_left % p_right);
+                        return true;
+                    } else return false;
+                case AbstractOperation::BINARY_EQUAL: *p_condition = p_left == p_right; return true;
+                case AbstractOperation::BINARY_NOT_EQUAL: *p_condition = p_left != p_right; return true;
+                case AbstractOperation::BINARY_GREATER: *p_condition = p_left > p_right; return true;
+                case AbstractOperation::BINARY_GREATER_OR_EQUAL: *p_condition = p_left >= p_right; return true;
+                // setb/setna are also set when comparing against NaN
+                case AbstractOperation::BINARY_LESSER: *p_condition = !(p_left >= p_right); return true;
+                case AbstractOperation::BINARY_LESSER_OR_EQUAL: *p_condition = !(p_left > p_right); return true;
+                default:
+                    return false;
+            }
+        }
+        // Branches only test al, so integer arithmetic conditions look at the lowest byte of the result
+        template<typename T>
+        static _ALWAYS_INLINE_ bool to_condition(T p_value){
+            if constexpr (std::is_integral_v<T>) return uint8_t(p_value) != 0;
+            else return p_value != T(0);
+        }
+        // Call p_callback with a null pointer of the type the emitted code would operate p_type as,
+        // integers are classified by size and signedness, returns false for non-primitive types
+        template<class F>
+        static bool dispatch(const Type& p_type, F&& p_callback){
+            if (p_type == Type::create<float>()) { p_callback((float*)nullptr); return true; }
+            if (p_type == Type::create<double>()) { p_callback((double*)nullptr); return true; }
+            if (!p_type.is_primitive) return false;
+            const auto is_signed = Type::is_signed_integer(p_type);
+            switch (p_type.size) {
+                case 1: is_signed ? p_callback((int8_t*)nullptr) : p_callback((uint8_t*)nullptr); return true;
+                case 2: is_signed ? p_callback((int16_t*)nullptr) : p_callback((uint16_t*)nullptr); return true;
+                case 4: is_signed ? p_callback((int32_t*)nullptr) : p_callback((uint32_t*)nullptr); return true;
+                case 8: is_signed ? p_callback((int64_t*)nullptr) : p_callback((uint64_t*)nullptr); return true;
+                default: return false;
+            }
+        }
+    };
+}
+
+#endif //MICROJIT_PRIMITIVE_OPERATION_H
@@ -5,97 +5,126 @@
 #ifndef MICROJIT_EXPERIMENT_PRIORITY_QUEUE_H
 #define MICROJIT_EXPERIMENT_PRIORITY_QUEUE_H
 
+#include <deque>
+#include <chrono>
 #include <vector>
 #include <cstdint>
+#include <utility>
 #include <stdexcept>
 #include "def.h"
 
 namespace microjit {
-    template <typename T>
-    struct HighCompare {
-        static _ALWAYS_INLINE_ bool compare(const T& p_lhs, const T& p_rhs){
-            return p_lhs > p_rhs;
-        }
-    };
-
-    template <typename T>
-    struct LowCompare {
-        static _ALWAYS_INLINE_ bool compare(const T& p_lhs, const T& p_rhs){
-            return p_lhs < p_rhs;
-        }
-    };
-
-    template <typename T, class Comparator = LowCompare<uint8_t>>
+    // One FIFO bucket per priority level, level 0 being the most urgent, so push and pop are O(levels)
+    // Waiting entries age: every aging interval spent in the queue counts as one level more urgent, down to level 1,
+    // so a steady stream of entries delays the less urgent ones but cannot starve them, and level 0 stays reserved
+    // Entries may carry a deadline, past it they are handed back as expired instead of being popped
+    template <typename T, uint8_t Levels = 4>
     class PriorityQueue {
     public:
+        typedef std::chrono::steady_clock Clock;
         struct Node {
             T data;
+            Clock::time_point queued_at;
+            Clock::time_point deadline;
             uint8_t priority;
-            Node(const Node& p_other) : data(p_other.data), priority(p_other.priority) {}
-            Node(const T& p_data, const uint8_t& p_priority) : data(p_data), priority(p_priority) {}
-            Node(T&& p_data, const uint8_t& p_priority) : data(p_data), priority(p_priority) {}
         };
+        static constexpr Clock::time_point no_deadline = Clock::time_point::max();
     private:
-        std::vector<Node> heap{};
+        std::deque<Node> buckets[Levels]{};
+        size_t count{};
+        // Entries carrying a deadline, sweeps are skipped while there are none
+        size_t deadline_count{};
+        Clock::duration aging_interval;
 
-        void heapify_up(size_t idx){
-            size_t parent = (idx - 1) / 2;
-            while (idx > 0 && Comparator::compare(heap[idx].priority, heap[parent].priority)){
-                SWAP(heap[idx], heap[parent]);
-                idx = parent;
-                parent = (idx - 1) / 2;
-            }
+        // Level the oldest entry of p_level competes at, aged entries never reach level 0
+        _NO_DISCARD_ int64_t effective_level(uint8_t p_level, const Clock::time_point& p_now) const {
+            const auto& head = buckets[p_level].front();
+            if (aging_interval <= Clock::duration::zero() || p_level <= 1) return p_level;
+            const auto promotions = (p_now - head.queued_at) / aging_interval;
+            return promotions >= p_level - 1 ? 1 : int64_t(p_level) - promotions;
         }
-        void heapify_down(size_t idx){
-            while (true) {
-                auto left = 2 * idx + 1;
-                auto right = 2 * idx + 2;
-                auto largest = idx;
-
-                if (left < size() && Comparator::compare(heap[left].priority, heap[largest].priority))
-                    largest = left;
-                if (right < size() && Comparator::compare(heap[right].priority, heap[largest].priority))
-                    largest = right;
-                if (largest == idx) break;
-                SWAP(heap[idx], heap[largest]);
-                idx = largest;
+        // Bucket whose head should run next, -1 if every bucket is empty
+        // Ties go to the older head, so fully aged entries are not starved by fresh level 1 ones either
+        _NO_DISCARD_ int select_bucket(const Clock::time_point& p_now) const {
+            int best = -1;
+            int64_t best_level = Levels;
+            for (uint8_t i = 0; i < Levels; i++){
+                if (buckets[i].empty()) continue;
+                const auto level = effective_level(i, p_now);
+                if (level > best_level) continue;
+                if (level == best_level && buckets[i].front().queued_at >= buckets[best].front().queued_at) continue;
+                best = i;
+                best_level = level;
             }
+            return best;
         }
-        void base_copy(const PriorityQueue& p_other) {
-            heap = p_other.heap;
-        }
-    protected:
-        virtual void copy_from(const PriorityQueue& p_other){
-            base_copy(p_other);
+        void take_front(uint8_t p_bucket, T& r_value){
+            if (buckets[p_bucket].front().deadline != no_deadline) deadline_count--;
+            r_value = std::move(buckets[p_bucket].front().data);
+            buckets[p_bucket].pop_front();
+            count--;
         }
     public:
-        _NO_DISCARD_ virtual size_t size() const { return heap.size(); }
-        _NO_DISCARD_ _ALWAYS_INLINE_ bool empty() const { return size() == 0; }
-        _NO_DISCARD_ _ALWAYS_INLINE_ const T& operator[](const size_t p_idx) const { return heap[p_idx]; }
+        // p_aging_interval of zero or less disables aging
+        explicit PriorityQueue(Clock::duration p_aging_interval = std::chrono::milliseconds(100))
+            : aging_interval(p_aging_interval) {}
+
+        _NO_DISCARD_ _ALWAYS_INLINE_ size_t size() const { return count; }
+        _NO_DISCARD_ _ALWAYS_INLINE_ bool empty() const { return count == 0; }
+        _NO_DISCARD_ _ALWAYS_INLINE_ size_t size(uint8_t p_priority) const { return buckets[p_priority].size(); }
+        void set_aging_interval(Clock::duration p_interval) { aging_interval = p_interval; }
+        _NO_DISCARD_ Clock::duration get_aging_interval() const { return aging_interval; }
 
-        virtual void push(const T& p_value, const uint8_t& p_priority){
-            heap.push_back(Node(p_value, p_priority));
-            heapify_up(size() - 1);
+        // Priorities past the last level are clamped to it
+        void push(T&& p_value, uint8_t p_priority, const Clock::time_point& p_deadline = no_deadline){
+            if (p_priority >= Levels) p_priority = Levels - 1;
+            buckets[p_priority].push_back(Node{ std::move(p_value), Clock::now(), p_deadline, p_priority });
+            count++;
+            if (p_deadline != no_deadline) deadline_count++;
         }
-        virtual T pop(){
-            if (empty()) throw std::out_of_range("PriorityQueue is empty");
-            auto re = heap[0].data;
-            SWAP(heap[0], heap[size() - 1]);
-            heap.pop_back();
-            heapify_down(0);
-            return re;
+        void push(const T& p_value, uint8_t p_priority, const Clock::time_point& p_deadline = no_deadline){
+            push(T(p_value), p_priority, p_deadline);
+        }
+        // Expired entries met on the way are moved into r_expired when given, dropped otherwise
+        bool try_pop(T& r_value, std::vector<T>* r_expired = nullptr){
+            const auto now = Clock::now();
+            while (true){
+                const auto bucket = select_bucket(now);
+                if (bucket < 0) return false;
+                if (buckets[bucket].front().deadline >= now) {
+                    take_front(bucket, r_value);
+                    return true;
+                }
+                T expired{};
+                take_front(bucket, expired);
+                if (r_expired) r_expired->push_back(std::move(expired));
+            }
         }
-        virtual bool try_pop(T& p_result) {
-            if (PriorityQueue<T, Comparator>::size() == 0) return false;
-            p_result = PriorityQueue<T, Comparator>::pop();
-            return true;
+        T pop(){
+            T re{};
+            if (!try_pop(re)) throw std::out_of_range("PriorityQueue is empty");
+            return re;
         }
-
-        PriorityQueue() = default;
-        PriorityQueue(const PriorityQueue& p_other) : PriorityQueue() { base_copy(p_other); }
-        _ALWAYS_INLINE_ PriorityQueue& operator=(const PriorityQueue& p_other){
-            copy_from(p_other);
-            return *this;
+        // Sweep every bucket for expired entries, not only their heads, returns how many were removed
+        size_t remove_expired(std::vector<T>* r_expired = nullptr){
+            if (!deadline_count) return 0;
+            const auto now = Clock::now();
+            size_t removed = 0;
+            for (auto& bucket : buckets){
+                std::deque<Node> remaining{};
+                for (auto& node : bucket){
+                    if (node.deadline >= now) {
+                        remaining.push_back(std::move(node));
+                        continue;
+                    }
+                    if (r_expired) r_expired->push_back(std::move(node.data));
+                    removed++;
+                }
+                bucket.swap(remaining);
+            }
+            count -= removed;
+            deadline_count -= removed;
+            return removed;
         }
     };
 }
@@ -11,8 +11,205 @@ _NO_DISCARD_ static _ALWAYS_INLINE_ size_t get_time_us(){
 }
 
 void
-microjit::CompilationHandler::compile(Ref<RectifiedFunction> p_func, microjit::MicroJITCompiler::CompilationResult* p_ret) {
-    *p_ret = compiler->compile(p_func);
+microjit::CompilationHandler::compile(const Ref<RectifiedFunction> &p_func, microjit::MicroJITCompiler::CompilationResult* p_ret,
+                                      MicroJITCompiler::CompilationTier p_tier) {
+    *p_ret = compiler->compile(p_func, p_tier);
+}
+
+std::vector<microjit::CompilationHandler::VirtualStackFunction>
+microjit::CompilationHandler::batch_into_map(std::unordered_map<size_t, VirtualStackFunction>& p_map,
+                                             const std::vector<Ref<RectifiedFunction>>& p_funcs){
+    std::vector<Ref<RectifiedFunction>> pending{};
+    for (const auto& func : p_funcs){
+        if (p_map.find((size_t)func->host) == p_map.end()) pending.push_back(func);
+    }
+    if (!pending.empty()){
+        auto result = compiler->compile_batch(pending);
+        if (result.error) return {};
+        for (size_t i = 0, s = pending.size(); i < s; i++){
+            auto callback = (VirtualStackFunction)result.callbacks[i];
+            p_map[(size_t)pending[i]->host] = callback;
+            // Members of a batch are weighed by the range they span in its buffer
+            track_function(pending[i]->host, callback, result.code_sizes[i]);
+        }
+    }
+    std::vector<VirtualStackFunction> re{};
+    re.reserve(p_funcs.size());
+    for (const auto& func : p_funcs){
+        re.push_back(p_map.at((size_t)func->host));
+    }
+    return re;
+}
+
+std::vector<microjit::CompilationHandler::VirtualStackFunction>
+microjit::CompilationHandler::batch_into_map(ConcurrentFunctionTable& p_table,
+                                             const std::vector<Ref<RectifiedFunction>>& p_funcs){
+    std::vector<Ref<RectifiedFunction>> pending{};
+    for (const auto& func : p_funcs){
+        if (!p_table.get((size_t)func->host)) pending.push_back(func);
+    }
+    if (!pending.empty()){
+        auto result = compiler->compile_batch(pending);
+        if (result.error) return {};
+        EpochManager::Guard epoch_guard{};
+        for (size_t i = 0, s = pending.size(); i < s; i++){
+            auto callback = (VirtualStackFunction)result.callbacks[i];
+            // Members of a batch are weighed by the range they span in its buffer
+            track_function(pending[i]->host, callback, result.code_sizes[i]);
+            p_table.acquire((size_t)pending[i]->host)->publish(callback);
+        }
+    }
+    std::vector<VirtualStackFunction> re{};
+    re.reserve(p_funcs.size());
+    for (const auto& func : p_funcs){
+        re.push_back(p_table.get((size_t)func->host));
+    }
+    return re;
+}
+
+void microjit::CompilationHandler::track_function(const void *p_host, VirtualStackFunction p_callback, size_t p_code_size) {
+    function_cache.push((size_t)p_host, p_callback, p_code_size, settings.decay_per_invocation);
+}
+
+void microjit::CompilationHandler::untrack_function(const void *p_host) {
+    function_cache.erase((size_t)p_host);
+}
+
+void microjit::CompilationHandler::add_heat(const void *p_host, uint32_t p_calls) {
+    auto entry = function_cache.at((size_t)p_host);
+    if (entry) entry->add_heat(settings.decay_per_invocation * p_calls);
+}
+
+microjit::MicroJITCompiler::CompilationTier microjit::CompilationHandler::get_tier(const void *p_host) const {
+    return optimized_hosts.find((size_t)p_host) == optimized_hosts.end() ? MicroJITCompiler::TIER_BASELINE
+                                                                         : MicroJITCompiler::TIER_OPTIMIZED;
+}
+
+void microjit::CompilationHandler::install_optimized(const void* p_host, const MicroJITCompiler::CompilationResult& p_result) {
+    track_function(p_host, (VirtualStackFunction)p_result.assembly->callback, p_result.assembly->code.codeSize());
+    optimized_hosts.insert((size_t)p_host);
+}
+
+microjit::CompilationHandler::VirtualStackFunction
+microjit::CompilationHandler::install_optimized(std::unordered_map<size_t, VirtualStackFunction>& p_map,
+                                                const void* p_host,
+                                                const MicroJITCompiler::CompilationResult& p_result) {
+    auto it = p_map.find((size_t)p_host);
+    auto previous = it == p_map.end() ? nullptr : it->second;
+    p_map[(size_t)p_host] = (VirtualStackFunction)p_result.assembly->callback;
+    install_optimized(p_host, p_result);
+    return previous;
+}
+
+bool microjit::CompilationHandler::install_optimized(ConcurrentFunctionTable::Entry* p_entry, const void* p_host,
+                                                     const MicroJITCompiler::CompilationResult& p_result,
+                                                     VirtualStackFunction* r_previous) {
+    const auto optimized = (VirtualStackFunction)p_result.assembly->callback;
+    if (p_entry->get()) *r_previous = p_entry->exchange(optimized);
+    else if (p_entry->try_claim()) *r_previous = p_entry->publish(optimized);
+    else return false;
+    install_optimized(p_host, p_result);
+    return true;
+}
+
+microjit::CompilationHandler::EvictedFunctions
+microjit::CompilationHandler::collect_garbage_internal(const std::function<void(size_t)>& p_erase,
+                                                       bool p_decay, bool p_cleanup) {
+    EvictedFunctions re{};
+    if (p_decay) function_cache.decay();
+    if (!p_cleanup) return re;
+    // Release whatever the readers have moved past since the last cleanup
+    EpochManager::get_singleton().reclaim();
+
+    std::vector<std::pair<size_t, VirtualStackFunction>> evicted{};
+    function_cache.cleanup(&evicted);
+    re.reserve(evicted.size());
+    for (const auto& entry : evicted){
+        p_erase(entry.first);
+        re.emplace_back((const void*)entry.first, entry.second);
+    }
+    return re;
+}
+
+microjit::CompilationHandler::EvictedFunctions
+microjit::CompilationHandler::collect_garbage_internal(std::unordered_map<size_t, VirtualStackFunction>& p_map,
+                                                       bool p_decay, bool p_cleanup) {
+    return collect_garbage_internal([&p_map](size_t p_host) -> void { p_map.erase(p_host); }, p_decay, p_cleanup);
+}
+
+microjit::CompilationHandler::EvictedFunctions
+microjit::CompilationHandler::collect_garbage_internal(ConcurrentFunctionTable& p_table, bool p_decay, bool p_cleanup) {
+    return collect_garbage_internal([&p_table](size_t p_host) -> void {
+        // Evicted hosts are still alive and may be compiled again, so their entries are kept
+        EpochManager::Guard epoch_guard{};
+        auto entry = p_table.find(p_host);
+        if (entry) entry->reset();
+    }, p_decay, p_cleanup);
+}
+
+std::shared_future<microjit::CompilationHandler::VirtualStackFunction>
+microjit::CompilationHandler::make_ready_future(VirtualStackFunction p_callback) {
+    std::promise<VirtualStackFunction> promise{};
+    promise.set_value(p_callback);
+    return promise.get_future().share();
+}
+
+void microjit::CompilationHandler::notify_evicted(const EvictedFunctions& p_evicted) {
+    // The listener unpublishes the code from the instances, only then can it be retired
+    for (const auto& entry : p_evicted){
+        if (eviction_listener) eviction_listener(entry.first);
+        retire_function(entry.second);
+    }
+}
+
+void microjit::CompilationHandler::retire_function(VirtualStackFunction p_callback) {
+    if (!p_callback) return;
+    auto& epochs = EpochManager::get_singleton();
+    // Keep the runtime alive for as long as the code is pending, the handler may be gone by then
+    // The copy is dropped on whichever thread reclaims it, MicroJITRuntime counts references atomically
+    auto owner = runtime;
+    epochs.retire([owner, p_callback]() mutable -> void {
+        owner->release((void*)p_callback);
+    });
+    epochs.reclaim();
+}
+
+void microjit::CompilationHandler::notify_replaced(const void *p_host, VirtualStackFunction p_callback,
+                                                  VirtualStackFunction p_previous) {
+    if (tier_up_listener) tier_up_listener(p_host, p_callback);
+    // Instances may still be running the previous code
+    retire_function(p_previous);
+}
+
+void microjit::CompilationHandler::start_garbage_collector(const std::function<void(bool, bool)>& p_tick) {
+    if (!settings.cache_capacity) return;
+    const auto decay_us = size_t((1.0 / settings.decay_frequency) * 1'000'000.0);
+    const auto cleanup_us = size_t((1.0 / settings.cleanup_frequency) * 1'000'000.0);
+    garbage_collector.start([this, p_tick, decay_us, cleanup_us]() -> void {
+        static constexpr size_t step_us = 1000;
+        auto now = get_time_us();
+        auto last_decay = now;
+        auto last_cleanup = now;
+        while (!is_terminated){
+            // Sleep in small steps so that low frequencies do not block the application exit
+            ManagedThread::sleep(step_us);
+            now = get_time_us();
+            const bool decay = now - last_decay >= decay_us;
+            const bool cleanup = now - last_cleanup >= cleanup_us;
+            if (decay) last_decay = now;
+            if (cleanup) last_cleanup = now;
+            if (decay || cleanup) p_tick(decay, cleanup);
+        }
+    });
+}
+
+void microjit::CompilationHandler::stop_garbage_collector() {
+    is_terminated = true;
+    garbage_collector.join();
+}
+
+microjit::CompilationHandler::~CompilationHandler() {
+    EpochManager::get_singleton().reclaim();
 }
 
 
@@ -21,21 +218,31 @@ bool microjit::SingleUnsafeCompilationHandler::function_compiled(const microjit:
 }
 
 microjit::CompilationHandler::VirtualStackFunction
-microjit::SingleUnsafeCompilationHandler::get_or_create(const microjit::Ref<microjit::RectifiedFunction> &p_func) {
+microjit::SingleUnsafeCompilationHandler::get_or_create(const microjit::Ref<microjit::RectifiedFunction> &p_func,
+                                                        const CompileOptions &p_options) {
     auto host_addr = (size_t)p_func->host;
-    if (function_map.find(host_addr) == function_map.end())  return recompile(p_func);
+    if (function_map.find(host_addr) == function_map.end())  return recompile(p_func, p_options);
     return function_map.at(host_addr);
 }
 
+std::vector<microjit::CompilationHandler::VirtualStackFunction>
+microjit::SingleUnsafeCompilationHandler::get_or_create_batch(const std::vector<Ref<RectifiedFunction>> &p_funcs) {
+    return batch_into_map(function_map, p_funcs);
+}
+
 microjit::CompilationHandler::VirtualStackFunction
-microjit::SingleUnsafeCompilationHandler::recompile(const microjit::Ref<microjit::RectifiedFunction> &p_func) {
-    auto func_ptr = (size_t)p_func.ptr();
+microjit::SingleUnsafeCompilationHandler::recompile(const microjit::Ref<microjit::RectifiedFunction> &p_func,
+                                                    const CompileOptions &) {
     MicroJITCompiler::CompilationResult result{};
     auto result_ptr = &result;
-    compile(p_func, result_ptr);
+    compile(p_func, result_ptr, get_tier(p_func->host));
     if (result.error) return nullptr;
     auto ret = (VirtualStackFunction)result.assembly->callback;
-    function_map[(size_t)p_func->host] = ret;
+    auto& slot = function_map[(size_t)p_func->host];
+    auto previous = slot;
+    slot = ret;
+    track_function(p_func->host, ret, result.assembly->code.codeSize());
+    if (previous) notify_replaced(p_func->host, ret, previous);
     return ret;
 }
 
@@ -45,6 +252,8 @@ microjit::SingleUnsafeCompilationHandler::remove_function(const microjit::Ref<mi
     if (!function_compiled(p_func)) return false;
 #endif
     function_map.erase((size_t)p_func->host);
+    untrack_function(p_func->host);
+    optimized_hosts.erase((size_t)p_func->host);
     return true;
 }
 
@@ -52,65 +261,133 @@ bool
 microjit::SingleUnsafeCompilationHandler::remove_function(const void* p_host) {
     if (function_map.find((size_t)(p_host)) == function_map.end()) return false;
     auto cb = function_map.at((size_t)p_host);
-    runtime->get_asmjit_runtime().release(cb);
     function_map.erase((size_t)p_host);
+    untrack_function(p_host);
+    optimized_hosts.erase((size_t)p_host);
+    retire_function(cb);
+    return true;
+}
+
+std::shared_future<microjit::CompilationHandler::VirtualStackFunction>
+microjit::SingleUnsafeCompilationHandler::get_or_create_async(const Ref<RectifiedFunction> &p_func,
+                                                              const CompletionCallback &p_on_ready,
+                                                              const CompileOptions &p_options) {
+    // Nothing to run it on, compile in place
+    auto callback = get_or_create(p_func, p_options);
+    if (p_on_ready) p_on_ready(callback);
+    return make_ready_future(callback);
+}
+
+void microjit::SingleUnsafeCompilationHandler::register_heat(const void *p_host, uint32_t p_calls) {
+    add_heat(p_host, p_calls);
+    runtime->register_heat(p_host, p_calls);
+}
+
+void microjit::SingleUnsafeCompilationHandler::collect_garbage() {
+    notify_evicted(collect_garbage_internal(function_map, true, true));
+}
+
+bool microjit::SingleUnsafeCompilationHandler::tier_up(const Ref<RectifiedFunction> &p_func) {
+    // No background thread to offload to, compile in place
+    MicroJITCompiler::CompilationResult result{};
+    compile(p_func, &result, MicroJITCompiler::TIER_OPTIMIZED);
+    if (result.error) return true;
+    auto previous = install_optimized(function_map, p_func->host, result);
+    notify_replaced(p_func->host, (VirtualStackFunction)result.assembly->callback, previous);
     return true;
 }
 
 bool
 microjit::CommandQueueCompilationHandler::function_compiled(const microjit::Ref<microjit::RectifiedFunction> &p_func) const {
-    return queue.sync_method(this, &CommandQueueCompilationHandler::function_compiled_internal, p_func);
+    return function_compiled_internal(p_func);
 }
 
 microjit::CompilationHandler::VirtualStackFunction
-microjit::CommandQueueCompilationHandler::get_or_create(const microjit::Ref<microjit::RectifiedFunction> &p_func) {
+microjit::CommandQueueCompilationHandler::get_or_create(const microjit::Ref<microjit::RectifiedFunction> &p_func,
+                                                        const CompileOptions &) {
+    // Only misses go through the queue
+    auto re = function_table.get((size_t)p_func->host);
+    if (re) return re;
     return queue.sync_method(this, &CommandQueueCompilationHandler::get_or_create_internal, p_func);
 }
 
+std::vector<microjit::CompilationHandler::VirtualStackFunction>
+microjit::CommandQueueCompilationHandler::get_or_create_batch(const std::vector<Ref<RectifiedFunction>> &p_funcs) {
+    std::vector<VirtualStackFunction> re{};
+    re.reserve(p_funcs.size());
+    for (const auto& func : p_funcs){
+        auto callback = function_table.get((size_t)func->host);
+        if (!callback) return queue.sync_method(this, &CommandQueueCompilationHandler::get_or_create_batch_internal, p_funcs);
+        re.push_back(callback);
+    }
+    return re;
+}
+
+std::shared_future<microjit::CompilationHandler::VirtualStackFunction>
+microjit::CommandQueueCompilationHandler::get_or_create_async(const Ref<RectifiedFunction> &p_func,
+                                                              const CompletionCallback &p_on_ready,
+                                                              const CompileOptions &) {
+    auto compiled = function_table.get((size_t)p_func->host);
+    if (compiled) {
+        if (p_on_ready) p_on_ready(compiled);
+        return make_ready_future(compiled);
+    }
+    return queue.dispatch([this, p_func, p_on_ready]() -> VirtualStackFunction {
+        auto callback = get_or_create_internal(p_func);
+        if (p_on_ready) p_on_ready(callback);
+        return callback;
+    }).share();
+}
+
 microjit::CompilationHandler::VirtualStackFunction
-microjit::CommandQueueCompilationHandler::recompile(const microjit::Ref<microjit::RectifiedFunction> &p_func) {
+microjit::CommandQueueCompilationHandler::recompile(const microjit::Ref<microjit::RectifiedFunction> &p_func,
+                                                    const CompileOptions &) {
     return queue.sync_method(this, &CommandQueueCompilationHandler::recompile_internal, p_func);
 }
 
 bool microjit::CommandQueueCompilationHandler::function_compiled_internal(
         const microjit::Ref<microjit::RectifiedFunction> &p_func) const {
-    return (function_map.find((size_t)(p_func->host)) != function_map.end());
+    return function_table.get((size_t)(p_func->host)) != nullptr;
 }
 
 microjit::CompilationHandler::VirtualStackFunction microjit::CommandQueueCompilationHandler::get_or_create_internal(
         const microjit::Ref<microjit::RectifiedFunction> &p_func) {
-    auto host_addr = (size_t)p_func->host;
-    if (function_map.find(host_addr) == function_map.end())  return recompile(p_func);
-    return function_map.at(host_addr);
+    // May have been compiled while this request was waiting in the queue
+    auto re = function_table.get((size_t)p_func->host);
+    // Already on the queue, recompile() would try to sync with itself
+    if (!re) return recompile_internal(p_func);
+    return re;
+}
+
+std::vector<microjit::CompilationHandler::VirtualStackFunction>
+microjit::CommandQueueCompilationHandler::get_or_create_batch_internal(const std::vector<Ref<RectifiedFunction>> &p_funcs) {
+    return batch_into_map(function_table, p_funcs);
 }
 
 microjit::CompilationHandler::VirtualStackFunction
 microjit::CommandQueueCompilationHandler::recompile_internal(const microjit::Ref<microjit::RectifiedFunction> &p_func) {
+    // Hosts are only detached from this queue, so the entry cannot be erased while compiling into it
+    EpochManager::Guard epoch_guard{};
+    auto entry = function_table.acquire((size_t)p_func->host);
     MicroJITCompiler::CompilationResult result{};
     auto result_ptr = &result;
-    compile(p_func, result_ptr);
+    compile(p_func, result_ptr, get_tier(p_func->host));
     if (result.error) return nullptr;
     auto ret = (VirtualStackFunction)result.assembly->callback;
-    function_map[(size_t) p_func->host] = ret;
+    track_function(p_func->host, ret, result.assembly->code.codeSize());
+    auto previous = entry->publish(ret);
+    if (previous) notify_replaced(p_func->host, ret, previous);
     return ret;
 }
 
-microjit::CompilationHandler::VirtualStackFunction microjit::CommandQueueCompilationHandler::compile_from_scratch(
-        const microjit::Ref<microjit::RectifiedFunction> &p_func) {
-    auto host_loc = (size_t)p_func->host;
-    auto stub = Box<HandlerStub>::make_box([this, host_loc]() -> void {
-        // Will be called inside garbage collector, so no need for locks
-        function_map.erase(host_loc);
-    });
-//    function_cache.push(host_loc, stub);
-    return recompile_internal(p_func);
-}
-
 bool microjit::CommandQueueCompilationHandler::remove_function_internal(const void* p_host) {
-    if (function_map.find((size_t)(p_host)) == function_map.end()) return false;
-    auto cb = function_map.at((size_t)p_host);
-    runtime->get_asmjit_runtime().release(cb);
-    function_map.erase((size_t)p_host);
+    // Detached hosts never come back, a new instance at the same address gets a new entry
+    VirtualStackFunction cb{};
+    if (!function_table.erase((size_t)p_host, &cb)) return false;
+    // Evicted or still compiling hosts have no code to retire, but their bookkeeping must go all the same
+    untrack_function(p_host);
+    optimized_hosts.erase((size_t)p_host);
+    retire_function(cb);
     return true;
 }
 
@@ -126,177 +403,435 @@ microjit::CommandQueueCompilationHandler::remove_function(const microjit::Ref<mi
 microjit::CommandQueueCompilationHandler::CommandQueueCompilationHandler(const microjit::CompilationAgentSettings &p_settings,
                                                                          const microjit::Ref<microjit::MicroJITCompiler> &p_compiler,
                                                                          const microjit::Ref<microjit::MicroJITRuntime> &p_runtime)
-        : /*function_cache(settings.cache_capacity, settings.decay_rate),*/
-          CompilationHandler(p_settings, p_compiler, p_runtime) {
-
+        : CompilationHandler(p_settings, p_compiler, p_runtime) {
+    start_garbage_collector([this](bool p_decay, bool p_cleanup) -> void {
+        // Eviction runs on the queue, the listener is notified from the collector thread
+        notify_evicted(queue.sync_method(this, &CommandQueueCompilationHandler::collect_garbage_queued, p_decay, p_cleanup));
+    });
 }
 
 microjit::CommandQueueCompilationHandler::~CommandQueueCompilationHandler() {
-//    is_terminated = true;
-//    garbage_collector.join();
+    stop_garbage_collector();
+}
+
+void microjit::CommandQueueCompilationHandler::register_heat_internal(const void *p_host, uint32_t p_calls) {
+    add_heat(p_host, p_calls);
+    runtime->register_heat(p_host, p_calls);
 }
 
-void microjit::CommandQueueCompilationHandler::register_heat_internal(const void *p_host) {
-//    function_cache.at((size_t)p_host)->heat += settings.decay_per_invocation;
+microjit::CompilationHandler::EvictedFunctions microjit::CommandQueueCompilationHandler::collect_garbage_queued(bool p_decay, bool p_cleanup) {
+    return collect_garbage_internal(function_table, p_decay, p_cleanup);
 }
 
-void microjit::CommandQueueCompilationHandler::register_heat(const void *p_host) {
-    queue.dispatch_method(this, &CommandQueueCompilationHandler::register_heat_internal, p_host);
+void microjit::CommandQueueCompilationHandler::collect_garbage() {
+    notify_evicted(queue.sync_method(this, &CommandQueueCompilationHandler::collect_garbage_queued, true, true));
 }
 
-bool microjit::ThreadPoolCompilationHandler::function_compiled(
+void microjit::CommandQueueCompilationHandler::tier_up_internal(const Ref<RectifiedFunction> &p_func) {
+    EpochManager::Guard epoch_guard{};
+    // Detached while waiting in the queue. An evicted entry stays in the table and still gets the optimized code
+    auto entry = function_table.find((size_t)p_func->host);
+    if (!entry) return;
+    MicroJITCompiler::CompilationResult result{};
+    compile(p_func, &result, MicroJITCompiler::TIER_OPTIMIZED);
+    if (result.error) return;
+    // Every compilation runs on this queue, so the entry cannot be claimed by anyone else
+    VirtualStackFunction previous{};
+    install_optimized(entry, p_func->host, result, &previous);
+    notify_replaced(p_func->host, (VirtualStackFunction)result.assembly->callback, previous);
+}
+
+bool microjit::CommandQueueCompilationHandler::tier_up(const Ref<RectifiedFunction> &p_func) {
+    queue.post([this, p_func]() -> void { tier_up_internal(p_func); });
+    return true;
+}
+
+void microjit::CommandQueueCompilationHandler::register_heat(const void *p_host, uint32_t p_calls) {
+    queue.post([this, p_host, p_calls]() -> void { register_heat_internal(p_host, p_calls); });
+}
+
+template <class TLock>
+bool microjit::ThreadPoolCompilationHandler<TLock>::function_compiled(
         const microjit::Ref<microjit::RectifiedFunction> &p_func) const {
     return function_compiled_internal(p_func);
 }
 
+template <class TLock>
 microjit::CompilationHandler::VirtualStackFunction
-microjit::ThreadPoolCompilationHandler::get_or_create(const microjit::Ref<microjit::RectifiedFunction> &p_func) {
-    auto promise = pool.queue_task_method(ThreadPool::MEDIUM, this, &ThreadPoolCompilationHandler::get_or_create_internal, p_func);
+microjit::ThreadPoolCompilationHandler<TLock>::get_or_create(const microjit::Ref<microjit::RectifiedFunction> &p_func,
+                                                      const CompileOptions &p_options) {
+    // Only misses go through the pool
+    auto re = function_table.get((size_t)p_func->host);
+    if (re) return re;
+    auto promise = get_local_pool().queue_task_method(p_options.priority, this, &ThreadPoolCompilationHandler::get_or_create_internal, p_func);
+    promise.wait();
+    return promise.get();
+}
+
+template <class TLock>
+std::vector<microjit::CompilationHandler::VirtualStackFunction>
+microjit::ThreadPoolCompilationHandler<TLock>::get_or_create_batch(const std::vector<Ref<RectifiedFunction>> &p_funcs) {
+    std::vector<VirtualStackFunction> re{};
+    re.reserve(p_funcs.size());
+    for (const auto& func : p_funcs){
+        auto callback = function_table.get((size_t)func->host);
+        if (!callback) break;
+        re.push_back(callback);
+    }
+    if (re.size() == p_funcs.size()) return re;
+    auto promise = get_local_pool().queue_task_method(ThreadPool::MEDIUM, this, &ThreadPoolCompilationHandler::get_or_create_batch_internal, p_funcs);
     promise.wait();
     return promise.get();
 }
 
+template <class TLock>
+bool microjit::ThreadPoolCompilationHandler<TLock>::over_queue_bound(ThreadPool &p_pool) const {
+    return settings.compile_queue_bound && p_pool.get_queued_count() >= settings.compile_queue_bound;
+}
+
+template <class TLock>
+microjit::ThreadPoolCompilationHandler<TLock>::QueuedCompilation::QueuedCompilation(
+        ThreadPoolCompilationHandler* p_handler, const Ref<RectifiedFunction>& p_func, const CompletionCallback& p_on_ready)
+        : handler(p_handler), function(p_func), on_ready(p_on_ready) {}
+
+template <class TLock>
+microjit::ThreadPoolCompilationHandler<TLock>::QueuedCompilation::QueuedCompilation(QueuedCompilation&& p_other) noexcept
+        : handler(p_other.handler), function(std::move(p_other.function)), on_ready(std::move(p_other.on_ready)),
+          promise(std::move(p_other.promise)), pending(p_other.pending) {
+    p_other.pending = false;
+}
+
+template <class TLock>
+microjit::ThreadPoolCompilationHandler<TLock>::QueuedCompilation::~QueuedCompilation() {
+    // Expired or discarded along with the pool
+    if (pending) complete(nullptr);
+}
+
+template <class TLock>
+void microjit::ThreadPoolCompilationHandler<TLock>::QueuedCompilation::operator()() {
+    complete(handler->get_or_create_internal(function));
+}
+
+template <class TLock>
+void microjit::ThreadPoolCompilationHandler<TLock>::QueuedCompilation::complete(VirtualStackFunction p_callback) {
+    pending = false;
+    if (on_ready) on_ready(p_callback);
+    promise.set_value(p_callback);
+}
+
+template <class TLock>
+std::shared_future<microjit::CompilationHandler::VirtualStackFunction>
+microjit::ThreadPoolCompilationHandler<TLock>::queue_compilation(ThreadPool &p_pool, const Ref<RectifiedFunction> &p_func,
+                                                          const CompletionCallback &p_on_ready, const CompileOptions &p_options) {
+    QueuedCompilation task(this, p_func, p_on_ready);
+    auto re = task.promise.get_future().share();
+    // Expired compilations leave the queue instead of waiting for a worker, so they stop counting towards the bound
+    p_pool.post_until(p_options.priority, p_options.deadline, std::move(task));
+    return re;
+}
+
+template <class TLock>
+std::shared_future<microjit::CompilationHandler::VirtualStackFunction>
+microjit::ThreadPoolCompilationHandler<TLock>::get_or_create_async(const Ref<RectifiedFunction> &p_func,
+                                                            const CompletionCallback &p_on_ready,
+                                                            const CompileOptions &p_options) {
+    auto& pool = get_local_pool();
+    if (p_options.priority == ThreadPool::LOW && over_queue_bound(pool)) {
+        if (p_on_ready) p_on_ready(nullptr);
+        return make_ready_future(nullptr);
+    }
+    return queue_compilation(pool, p_func, p_on_ready, p_options);
+}
+
+template <class TLock>
+std::shared_future<microjit::CompilationHandler::VirtualStackFunction>
+microjit::ThreadPoolCompilationHandler<TLock>::precompile(const Ref<RectifiedFunction> &p_func,
+                                                   const CompletionCallback &p_on_ready,
+                                                   const CompileOptions &p_options) {
+    // Speculative, never more urgent than LOW whatever the instance asked for
+    auto options = p_options;
+    options.priority = ThreadPool::LOW;
+    // A caller arriving mid-compilation waits on the function's entry instead of compiling it again
+    return get_or_create_async(p_func, p_on_ready, options);
+}
+
+template <class TLock>
 microjit::CompilationHandler::VirtualStackFunction
-microjit::ThreadPoolCompilationHandler::recompile(const microjit::Ref<microjit::RectifiedFunction> &p_func) {
-    auto promise = pool.queue_task_method(ThreadPool::MEDIUM, this, &ThreadPoolCompilationHandler::recompile_internal, p_func);
+microjit::ThreadPoolCompilationHandler<TLock>::recompile(const microjit::Ref<microjit::RectifiedFunction> &p_func,
+                                                  const CompileOptions &p_options) {
+    auto promise = get_local_pool().queue_task_method(p_options.priority, this, &ThreadPoolCompilationHandler::recompile_internal, p_func);
     promise.wait();
     return promise.get();
 }
 
-bool microjit::ThreadPoolCompilationHandler::remove_function(const void* p_host) {
+template <class TLock>
+bool microjit::ThreadPoolCompilationHandler<TLock>::remove_function(const void* p_host) {
     return remove_function_internal(p_host);
 }
 
-bool microjit::ThreadPoolCompilationHandler::remove_function(const microjit::Ref<microjit::RectifiedFunction> &p_func) {
+template <class TLock>
+bool microjit::ThreadPoolCompilationHandler<TLock>::remove_function(const microjit::Ref<microjit::RectifiedFunction> &p_func) {
     return remove_function(p_func->host);
 }
 
-bool microjit::ThreadPoolCompilationHandler::function_compiled_internal(
+template <class TLock>
+bool microjit::ThreadPoolCompilationHandler<TLock>::function_compiled_internal(
         const microjit::Ref<microjit::RectifiedFunction> &p_func) const {
-    ReadLockGuard guard(lock);
-    return (function_map.find((size_t)(p_func->host)) != function_map.end());
+    return function_table.get((size_t)(p_func->host)) != nullptr;
 }
 
-microjit::CompilationHandler::VirtualStackFunction microjit::ThreadPoolCompilationHandler::get_or_create_internal(
+template <class TLock>
+microjit::CompilationHandler::VirtualStackFunction microjit::ThreadPoolCompilationHandler<TLock>::get_or_create_internal(
         const microjit::Ref<microjit::RectifiedFunction> &p_func) {
-    // First try to get the function
-    // If available and valid, release lock and return
-    // If available but is null, another thread is compiling this function, wait for it
-    // If not available, create a placeholder entry and wait for the function to be compiled
-    // Inside the try block, the lock must be write-locked
-    auto host_addr = (size_t)p_func->host;
-    VirtualStackFunction re;
+    // Compiled functions are returned without touching any lock
+    // Otherwise, whoever claims the entry compiles it while everyone else sleeps on the entry
+    EpochManager::Guard epoch_guard{};
+    auto entry = function_table.acquire((size_t)p_func->host);
     while (true) {
-        lock.write_lock();
-        if (function_map.find(host_addr) == function_map.end()) break;
-        re = function_map.at(host_addr);
-        lock.write_unlock();
+        auto re = entry->get();
         if (re) return re;
-        std::this_thread::yield();
+        if (entry->try_claim()) return compile_into(p_func, entry, true);
+        re = entry->wait();
+        if (re) return re;
+        // Detached meanwhile, there is nothing left to compile it for
+        if (function_table.find((size_t)p_func->host) != entry) return nullptr;
+        // The compilation failed or the function got evicted, try to claim it ourselves
     }
-    function_map[(size_t) p_func->host] = nullptr;
-    lock.write_unlock();
-    return compile_from_scratch(p_func);
 }
 
 static thread_local microjit::Ref<microjit::MicroJITCompiler> thread_specific_compiler = microjit::Ref<microjit::MicroJITCompiler>::null();
 
+template <class TLock>
+std::vector<microjit::CompilationHandler::VirtualStackFunction>
+microjit::ThreadPoolCompilationHandler<TLock>::get_or_create_batch_internal(const std::vector<Ref<RectifiedFunction>> &p_funcs) {
+    // Claim every function nobody else is compiling,
+    // the rest are either ready or will be waited for after the batch is linked
+    EpochManager::Guard epoch_guard{};
+    std::vector<Ref<RectifiedFunction>> claimed{};
+    std::vector<ConcurrentFunctionTable::Entry*> claimed_entries{};
+    for (const auto& func : p_funcs){
+        auto entry = function_table.acquire((size_t)func->host);
+        if (entry->get() || !entry->try_claim()) continue;
+        claimed.push_back(func);
+        claimed_entries.push_back(entry);
+    }
+    if (!claimed.empty()){
+        auto result = thread_specific_compiler->compile_batch(claimed);
+        if (result.error) {
+            // Wake up the waiting threads, they will try on their own
+            for (auto entry : claimed_entries) entry->publish(nullptr);
+            return {};
+        }
+        std::vector<VirtualStackFunction> detached{};
+        {
+            WriteLockGuard guard(lock);
+            for (size_t i = 0, s = claimed.size(); i < s; i++){
+                const auto callback = (VirtualStackFunction)result.callbacks[i];
+                // Same as compile_into, a member detached meanwhile gives its share of the block back
+                if (function_table.find((size_t)claimed[i]->host) != claimed_entries[i]) {
+                    claimed_entries[i]->publish(nullptr);
+                    detached.push_back(callback);
+                    continue;
+                }
+                // Weighed by the range it spans in the batch's buffer
+                track_function(claimed[i]->host, callback, result.code_sizes[i]);
+                claimed_entries[i]->publish(callback);
+            }
+        }
+        for (auto callback : detached) runtime->release((void*)callback);
+    }
+    std::vector<VirtualStackFunction> re{};
+    re.reserve(p_funcs.size());
+    for (const auto& func : p_funcs){
+        re.push_back(get_or_create_internal(func));
+    }
+    return re;
+}
+
+template <class TLock>
 microjit::CompilationHandler::VirtualStackFunction
-microjit::ThreadPoolCompilationHandler::recompile_internal(const microjit::Ref<microjit::RectifiedFunction> &p_func) {
-    auto result = thread_specific_compiler->compile(p_func);
-    if (result.error) return nullptr;
+microjit::ThreadPoolCompilationHandler<TLock>::recompile_internal(const microjit::Ref<microjit::RectifiedFunction> &p_func) {
+    EpochManager::Guard epoch_guard{};
+    return compile_into(p_func, function_table.acquire((size_t)p_func->host), false);
+}
+
+template <class TLock>
+microjit::CompilationHandler::VirtualStackFunction
+microjit::ThreadPoolCompilationHandler<TLock>::compile_into(const microjit::Ref<microjit::RectifiedFunction> &p_func,
+                                                            ConcurrentFunctionTable::Entry* p_entry, bool p_claimed) {
+    MicroJITCompiler::CompilationTier tier;
+    {
+        ReadLockGuard guard(lock);
+        tier = get_tier(p_func->host);
+    }
+    auto result = thread_specific_compiler->compile(p_func, tier);
+    if (result.error) {
+        // Give up the claim so that the waiting threads do not sleep forever
+        if (p_claimed) p_entry->publish(nullptr);
+        return nullptr;
+    }
     auto ret = (VirtualStackFunction)result.assembly->callback;
+    VirtualStackFunction previous{};
+    bool detached;
     {
+        // remove_function_internal erases under this lock, so the entry cannot be erased between the check and publishing
         WriteLockGuard guard(lock);
-        function_map[(size_t) p_func->host] = ret;
+        detached = function_table.find((size_t)p_func->host) != p_entry;
+        if (detached) {
+            untrack_function(p_func->host);
+            // The erased entry kept the claim, wake up whoever still waits on it
+            if (p_claimed) p_entry->publish(nullptr);
+        } else {
+            track_function(p_func->host, ret, result.assembly->code.codeSize());
+            previous = p_entry->publish(ret);
+        }
+    }
+    // Never published, so nobody can be running it
+    if (detached) {
+        runtime->release((void*)ret);
+        return nullptr;
     }
+    if (previous) notify_replaced(p_func->host, ret, previous);
     return ret;
 }
 
-microjit::CompilationHandler::VirtualStackFunction
-microjit::ThreadPoolCompilationHandler::compile_from_scratch(const microjit::Ref<microjit::RectifiedFunction> &p_func) {
-//    auto host_loc = (size_t)p_func->host;
-//    auto stub = Box<HandlerStub>::make_box([this, host_loc]() -> void {
-//        // Will be called inside garbage collector, so no need for locks
-//        function_map.erase(host_loc);
-//    });
-//    {
-//        WriteLockGuard guard(lock);
-//        function_cache.push(host_loc, stub);
-//    }
-    return recompile_internal(p_func);
-}
-
-bool microjit::ThreadPoolCompilationHandler::remove_function_internal(const void* p_host) {
-    WriteLockGuard guard(lock);
-    if (function_map.find((size_t)(p_host)) == function_map.end()) return false;
-    auto cb = function_map.at((size_t)p_host);
+template <class TLock>
+bool microjit::ThreadPoolCompilationHandler<TLock>::remove_function_internal(const void* p_host) {
+    // Detached hosts never come back, a new instance at the same address gets a new entry
+    VirtualStackFunction cb{};
     {
-        // Guarding the runtime since the compilation process is not dependent on the master lock
-        auto& asmjit_runtime = runtime->get_asmjit_runtime();
-        std::lock_guard<std::mutex> runtime_guard(runtime->get_mutex());
-        asmjit_runtime.release(cb);
+        // Erased under the lock so that compile_into never publishes into an entry erased after its check
+        WriteLockGuard guard(lock);
+        if (!function_table.erase((size_t)p_host, &cb)) return false;
+        // Evicted or still compiling hosts have no code to retire, but their bookkeeping must go all the same
+        untrack_function(p_host);
+        optimized_hosts.erase((size_t)p_host);
     }
-    function_map.erase((size_t)p_host);
+    // The runtime guards itself since the compilation process is not dependent on the master lock
+    retire_function(cb);
     return true;
 }
 
-microjit::ThreadPoolCompilationHandler::~ThreadPoolCompilationHandler() {
-//    is_terminated = true;
-//    garbage_collector.join();
+template <class TLock>
+microjit::ThreadPool &microjit::ThreadPoolCompilationHandler<TLock>::get_local_pool() const {
+    if (pools.size() == 1) return *pools[0];
+    return *pools[CpuTopology::get_singleton().get_current_node() % pools.size()];
+}
+
+template <class TLock>
+microjit::ThreadPoolCompilationHandler<TLock>::~ThreadPoolCompilationHandler() {
+    stop_garbage_collector();
 }
 
 // No more checking for compiler every time!
-static std::function<void()> construct_compiler(microjit::ThreadPoolCompilationHandler::compiler_spawner p_spawner,
+// Workers also take a shard each in the order they start, so that a pool's workers commit into distinct shards
+static std::function<void()> construct_compiler(microjit::ThreadPoolCompilationHandler<>::compiler_spawner p_spawner,
                                                 const microjit::Ref<microjit::MicroJITRuntime> &p_runtime){
     auto runtime = p_runtime;
-    auto packed = [p_spawner, runtime]() -> void {
+    auto next_worker = std::make_shared<std::atomic<size_t>>();
+    auto packed = [p_spawner, runtime, next_worker]() -> void {
+        microjit::MicroJITRuntime::set_thread_shard(next_worker->fetch_add(1, std::memory_order_relaxed));
         thread_specific_compiler = p_spawner(runtime);
     };
     return packed;
 }
 
-microjit::ThreadPoolCompilationHandler::ThreadPoolCompilationHandler(const CompilationAgentSettings& p_settings,
-        microjit::ThreadPoolCompilationHandler::compiler_spawner p_spawner,
+template <class TLock>
+microjit::ThreadPoolCompilationHandler<TLock>::ThreadPoolCompilationHandler(const CompilationAgentSettings& p_settings,
+        microjit::ThreadPoolCompilationHandler<>::compiler_spawner p_spawner,
         const microjit::Ref<microjit::MicroJITRuntime> &p_runtime)
         : CompilationHandler(p_settings, Ref<MicroJITCompiler>::null(), p_runtime),
-          spawner(p_spawner), /*function_cache(settings.cache_capacity, settings.decay_rate),*/
-          pool(settings.initial_compiler_thread_count, construct_compiler(p_spawner, p_runtime)) {
-    runtime = Ref<MicroJITRuntime>::make_ref();
-    // This feature is not well thought our right now...
-//    garbage_collector.start([this]() -> void {
-//        static constexpr auto step = std::chrono::microseconds(100);
-//        const auto decay_us = size_t((1.0 / settings.decay_frequency) * 1'000'000.0);
-//        const auto cleanup_us = size_t((1.0 / settings.cleanup_frequency) * 1'000'000.0);
-//        auto now = get_time_us();
-//        auto last_decay = now;
-//        auto last_cleanup = now;
-//        while (!is_terminated){
-//            // This is to prevent either frequency is set too low and block the application exit
-//            std::this_thread::sleep_for(std::chrono::microseconds(step));
-//            now = get_time_us();
-//            {
-//                WriteLockGuard guard(lock);
-//                if (now - last_decay > decay_us) {
-//                    last_decay = now;
-//                    function_cache.decay(cleanup_us);
-//                }
-//                if (now - last_cleanup > cleanup_us) {
-//                    last_cleanup = now;
-//                    function_cache.cleanup();
-//                }
-//            }
-//        }
-//    });
-}
-
-void microjit::ThreadPoolCompilationHandler::register_heat_internal(const void *p_host) {
-//    ReadLockGuard guard(lock);
-//    auto entry = function_cache.at((size_t)p_host);
-//    std::lock_guard<std::mutex> inner_guard(entry->lock);
-//    entry->heat += settings.decay_per_invocation;
-}
-
-void microjit::ThreadPoolCompilationHandler::register_heat(const void *p_host) {
-    pool.queue_task_method(ThreadPool::LOW, this, &ThreadPoolCompilationHandler::register_heat_internal, p_host);
+          spawner(p_spawner) /*function_cache(settings.cache_capacity, settings.decay_rate),*/ {
+    const auto& topology = CpuTopology::get_singleton();
+    const size_t node_count = settings.numa_local_compilation ? topology.get_node_count() : 1;
+    // Node p_node's share of p_total, shares differ by at most one and add up to p_total
+    auto share = [node_count](size_t p_total, size_t p_node) -> uint8_t {
+        return uint8_t((p_total + node_count - 1 - p_node) / node_count);
+    };
+    for (size_t node = 0; node < node_count; node++){
+        auto threads = settings.initial_compiler_thread_count;
+        auto scaling = settings.compiler_scaling;
+        auto affinity = settings.compiler_affinity;
+        if (node_count > 1) {
+            threads = std::max<uint8_t>(share(threads, node), 1);
+            scaling.min_threads = share(scaling.min_threads, node);
+            if (scaling.max_threads) scaling.max_threads = std::max<uint8_t>(share(scaling.max_threads, node), 1);
+            affinity.placement = AffinityPolicy::PLACEMENT_NODE;
+            affinity.node = node;
+        }
+        pools.emplace_back(new ThreadPool(threads, construct_compiler(p_spawner, p_runtime), std::function<void()>(),
+                                          settings.compiler_scheduling, scaling, affinity,
+                                          settings.compiler_aging_interval));
+    }
+    start_garbage_collector([this](bool p_decay, bool p_cleanup) -> void {
+        collect_garbage_pooled(p_decay, p_cleanup);
+    });
 }
+
+template <class TLock>
+void microjit::ThreadPoolCompilationHandler<TLock>::register_heat_internal(const void *p_host, uint32_t p_calls) {
+    {
+        // Entries carry their own lock, so readers can heat them concurrently
+        ReadLockGuard guard(lock);
+        add_heat(p_host, p_calls);
+    }
+    runtime->register_heat(p_host, p_calls);
+}
+
+template <class TLock>
+void microjit::ThreadPoolCompilationHandler<TLock>::collect_garbage_pooled(bool p_decay, bool p_cleanup) {
+    EvictedFunctions evicted{};
+    {
+        WriteLockGuard guard(lock);
+        evicted = collect_garbage_internal(function_table, p_decay, p_cleanup);
+    }
+    notify_evicted(evicted);
+}
+
+template <class TLock>
+void microjit::ThreadPoolCompilationHandler<TLock>::collect_garbage() {
+    collect_garbage_pooled(true, true);
+}
+
+template <class TLock>
+void microjit::ThreadPoolCompilationHandler<TLock>::tier_up_internal(const Ref<RectifiedFunction> &p_func) {
+    auto result = thread_specific_compiler->compile(p_func, MicroJITCompiler::TIER_OPTIMIZED);
+    if (result.error) return;
+    const auto optimized = (VirtualStackFunction)result.assembly->callback;
+    const auto host = (size_t)p_func->host;
+    VirtualStackFunction previous{};
+    EpochManager::Guard epoch_guard{};
+    while (true) {
+        // Only detaching erases the entry, an eviction merely empties it
+        auto entry = function_table.find(host);
+        if (!entry) {
+            // The code was never published so nobody can be running it
+            runtime->release((void*)optimized);
+            return;
+        }
+        // Evicted and being recompiled, let the baseline land first then replace it
+        if (entry->get_state() == ConcurrentFunctionTable::Entry::STATE_COMPILING) {
+            entry->wait();
+            continue;
+        }
+        WriteLockGuard guard(lock);
+        if (function_table.find(host) == entry && install_optimized(entry, p_func->host, result, &previous)) break;
+    }
+    notify_replaced(p_func->host, optimized, previous);
+}
+
+template <class TLock>
+bool microjit::ThreadPoolCompilationHandler<TLock>::tier_up(const Ref<RectifiedFunction> &p_func) {
+    auto& pool = get_local_pool();
+    // Shed, the baseline code keeps running until the instance asks again
+    if (over_queue_bound(pool)) return false;
+    pool.post(ThreadPool::LOW, [this, p_func]() -> void { tier_up_internal(p_func); });
+    return true;
+}
+
+template <class TLock>
+void microjit::ThreadPoolCompilationHandler<TLock>::register_heat(const void *p_host, uint32_t p_calls) {
+    get_local_pool().post(ThreadPool::LOW, [this, p_host, p_calls]() -> void { register_heat_internal(p_host, p_calls); });
+}
+
+template class microjit::ThreadPoolCompilationHandler<microjit::RWLock>;
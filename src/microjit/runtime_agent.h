@@ -5,19 +5,28 @@
 #ifndef MICROJIT_EXPERIMENT_RUNTIME_AGENT_H
 #define MICROJIT_EXPERIMENT_RUNTIME_AGENT_H
 
+#include <algorithm>
+#include <unordered_set>
 #include "instructions.h"
 #include "utils.h"
 #include "thread_pool.h"
 #include "command_queue.h"
 #include "lock.h"
 #include "jit.h"
+#include "decaying_weighted_cache.h"
+#include "concurrent_function_table.h"
+#include "epoch.h"
 
 namespace microjit
 {
-    struct HandlerStub {
-        const std::function<void()> eviction_handler;
-        explicit HandlerStub(const std::function<void()>& p_handler) : eviction_handler(p_handler){}
-        ~HandlerStub() { eviction_handler(); }
+    // What FunctionInstance::call does when the function has not been compiled yet
+    enum FirstCallPolicy {
+        // Compile on the calling thread (or wait for the handler to do so)
+        FIRST_CALL_BLOCK,
+        // Start compiling in the background and call the instance's fallback meanwhile, block if there's none
+        FIRST_CALL_FALLBACK,
+        // Start compiling in the background and raise
+        FIRST_CALL_FAIL_FAST,
     };
     enum CompilationAgentHandlerType {
         SINGLE_UNSAFE,
@@ -26,29 +35,166 @@ namespace microjit
     };
     struct CompilationAgentSettings {
         CompilationAgentHandlerType type;
+        // Maximum amount of executable code kept alive, in bytes, 0 for unbounded
         size_t cache_capacity;
         size_t virtual_stack_size;
         uint8_t initial_compiler_thread_count;
+        // Report invocations to the handler through register_heat
+        bool track_heat{};
+        // Calls an instance makes straight into its code between two reports, while it tracks heat or counts
+        // towards its tier-up. 1 reports every call
+        uint32_t heat_sample_period{64};
+        CodeHeapSettings code_heap{};
+        // Fraction of heat lost on every decay tick
+        double decay_rate{0.1};
+        // Heat gained on every invocation
+        double decay_per_invocation{1.0};
+        // Decay and eviction ticks per second
+        double decay_frequency{1.0};
+        double cleanup_frequency{0.2};
+        // Invocations after which an instance is recompiled at TIER_OPTIMIZED in the background, 0 to disable
+        uint64_t tier_up_threshold{};
+        FirstCallPolicy first_call_policy{FIRST_CALL_BLOCK};
+        // Number of independent executable memory shards, 0 for one per compiler thread
+        size_t runtime_shard_count{};
+        // Calls run by the interpreter before an instance is compiled, 0 to compile on the first call
+        // Takes precedence over first_call_policy, past the threshold the instance is compiled in the background
+        // and interpreted until the compilation finishes
+        uint64_t interpret_threshold{};
+        // Workers of the orchestrator's execution pool, used by parallel_map and parallel_reduce
+        // 0 for one per hardware thread, the pool is only started on the first parallel call
+        uint8_t execution_thread_count{};
+        // How the MULTI_POOLED handler's compiler threads pick up work
+        ThreadPool::SchedulingMode compiler_scheduling{ThreadPool::SCHEDULE_SHARED_QUEUE};
+        // Time a compilation waits in the shared queue before it competes one priority higher, zero disables aging
+        std::chrono::milliseconds compiler_aging_interval{100};
+        // Bounds and triggers for growing and shrinking the MULTI_POOLED handler's compiler threads,
+        // the default max_threads of 0 keeps initial_compiler_thread_count threads for the handler's lifetime
+        ElasticPolicy compiler_scaling{};
+        // Where the MULTI_POOLED handler's compiler threads run
+        AffinityPolicy compiler_affinity{};
+        // Where the orchestrator's execution pool runs
+        AffinityPolicy execution_affinity{};
+        // Give every NUMA node its own compiler threads and code shards, compilations then run on the node of the
+        // thread that asked for them. Compiler threads and scaling bounds are split between nodes,
+        // compiler_affinity is ignored
+        bool numa_local_compilation{};
+        // Background compilations the MULTI_POOLED handler keeps queued before it sheds ThreadPool::LOW work
+        // (precompilation and tier-up), 0 for unbounded
+        size_t compile_queue_bound{};
+        // Guard the orchestrator's instance registry shards with ReaderBiasedRWLocks instead of RWLocks
+        // Eviction and tier-up listeners stop contending on one cache line per shard, at the cost of slower
+        // instance creation and detaching
+        bool reader_biased_locking{};
+    };
+    // How urgently a single compilation is wanted, see FunctionInstance::set_compile_priority
+    struct CompileOptions {
+        ThreadPool::Priority priority{ThreadPool::MEDIUM};
+        // Background compilations still queued past it are cancelled, their callback receives nullptr
+        // Blocking compilations ignore it, the caller cannot proceed without the code
+        ThreadPool::Clock::time_point deadline{ThreadPool::no_deadline};
     };
     class CompilationHandler {
+    public:
+        typedef void(*VirtualStackFunction)(uint8_t *);
+        // Called with the host of every evicted function, outside of any handler lock
+        typedef std::function<void(const void*)> EvictionListener;
+        // Called with the host and its new code once a tier-up or a recompile replaced it, outside of any handler lock
+        // The listener must republish the new code wherever callers load it from, the old code is retired right after
+        typedef std::function<void(const void*, VirtualStackFunction)> TierUpListener;
+        // Called on the compiling thread with the compiled function, nullptr on failure
+        typedef std::function<void(VirtualStackFunction)> CompletionCallback;
+        typedef std::vector<std::pair<const void*, VirtualStackFunction>> EvictedFunctions;
     protected:
         Ref<MicroJITCompiler> compiler;
         Ref<MicroJITRuntime> runtime;
         CompilationAgentSettings settings;
+        DecayingWeightedCache<size_t, VirtualStackFunction> function_cache;
+        EvictionListener eviction_listener{};
+        TierUpListener tier_up_listener{};
+        // Hosts that have been tiered up, they are recompiled at TIER_OPTIMIZED after an eviction
+        std::unordered_set<size_t> optimized_hosts{};
+        ManagedThread garbage_collector{};
+        std::atomic<bool> is_terminated{false};
+
         explicit CompilationHandler(const CompilationAgentSettings& p_settings, const Ref<MicroJITCompiler>& p_compiler, const Ref<MicroJITRuntime>& p_runtime)
-            : settings(p_settings), compiler(p_compiler), runtime(p_runtime) {}
+            : settings(p_settings), compiler(p_compiler), runtime(p_runtime),
+              function_cache(p_settings.cache_capacity, p_settings.decay_rate) {}
+
+        // The following are not thread-safe, callers must hold whatever guards p_map
+        void track_function(const void* p_host, VirtualStackFunction p_callback, size_t p_code_size);
+        void untrack_function(const void* p_host);
+        void add_heat(const void* p_host, uint32_t p_calls);
+        _NO_DISCARD_ MicroJITCompiler::CompilationTier get_tier(const void* p_host) const;
+        // Replace the baseline code of p_host, returns the previous code
+        // The caller retires it once the tier-up listener had a chance to unpublish it
+        VirtualStackFunction install_optimized(std::unordered_map<size_t, VirtualStackFunction>& p_map, const void* p_host,
+                                               const MicroJITCompiler::CompilationResult& p_result);
+        // An entry emptied by an eviction takes the optimized code as if it were the baseline
+        // Returns false if the entry is being compiled again and could not take it, r_previous is left untouched then
+        bool install_optimized(ConcurrentFunctionTable::Entry* p_entry, const void* p_host,
+                               const MicroJITCompiler::CompilationResult& p_result, VirtualStackFunction* r_previous);
+        void install_optimized(const void* p_host, const MicroJITCompiler::CompilationResult& p_result);
+        // Decay heat and/or evict the coldest functions from p_map, returns the evicted functions
+        EvictedFunctions collect_garbage_internal(std::unordered_map<size_t, VirtualStackFunction>& p_map,
+                                                  bool p_decay, bool p_cleanup);
+        EvictedFunctions collect_garbage_internal(ConcurrentFunctionTable& p_table, bool p_decay, bool p_cleanup);
+        EvictedFunctions collect_garbage_internal(const std::function<void(size_t)>& p_erase,
+                                                  bool p_decay, bool p_cleanup);
+        // Notify the eviction listener, then retire the evicted code
+        void notify_evicted(const EvictedFunctions& p_evicted);
+        // Release p_callback once no thread can still be running it, see EpochManager
+        // p_callback must have been unpublished from everywhere callers load it from
+        void retire_function(VirtualStackFunction p_callback);
+        // Hand p_callback to the tier-up listener, then retire p_previous
+        void notify_replaced(const void* p_host, VirtualStackFunction p_callback, VirtualStackFunction p_previous);
+        // Batch-compile every function of p_funcs missing from p_map, then collect all callbacks in order
+        // p_map must not be accessed by anyone else during the call
+        std::vector<VirtualStackFunction> batch_into_map(std::unordered_map<size_t, VirtualStackFunction>& p_map,
+                                                         const std::vector<Ref<RectifiedFunction>>& p_funcs);
+        // Same as above, p_table must have no other writer during the call
+        std::vector<VirtualStackFunction> batch_into_map(ConcurrentFunctionTable& p_table,
+                                                         const std::vector<Ref<RectifiedFunction>>& p_funcs);
+        // Spawn a thread that calls p_tick at decay_frequency and cleanup_frequency, only when the cache is bounded
+        void start_garbage_collector(const std::function<void(bool, bool)>& p_tick);
     public:
-        void compile(Ref<RectifiedFunction> p_func, microjit::MicroJITCompiler::CompilationResult* p_ret);
+        static std::shared_future<VirtualStackFunction> make_ready_future(VirtualStackFunction p_callback);
+        // Must be called before whatever the eviction listener refers to is destroyed
+        void stop_garbage_collector();
+        void compile(const Ref<RectifiedFunction> &p_func, microjit::MicroJITCompiler::CompilationResult* p_ret,
+                     MicroJITCompiler::CompilationTier p_tier = MicroJITCompiler::TIER_BASELINE);
 
-        typedef void(*VirtualStackFunction)(uint8_t *);
-        virtual ~CompilationHandler() = default;
+        virtual ~CompilationHandler();
         virtual bool function_compiled(const Ref<RectifiedFunction> &p_func) const = 0;
-        virtual VirtualStackFunction get_or_create(const Ref<RectifiedFunction> &p_func) = 0;
-        virtual VirtualStackFunction recompile(const Ref<RectifiedFunction> &p_func) = 0;
+        // Handlers without priorities ignore p_options
+        virtual VirtualStackFunction get_or_create(const Ref<RectifiedFunction> &p_func, const CompileOptions& p_options) = 0;
+        // Same as get_or_create, without waiting for the compilation to finish
+        virtual std::shared_future<VirtualStackFunction> get_or_create_async(const Ref<RectifiedFunction> &p_func,
+                                                                             const CompletionCallback& p_on_ready,
+                                                                             const CompileOptions& p_options) = 0;
+        // Speculative compilation ahead of the first call, runs after every request someone is waiting on
+        // Handlers without priorities treat it as get_or_create_async
+        virtual std::shared_future<VirtualStackFunction> precompile(const Ref<RectifiedFunction> &p_func,
+                                                                    const CompletionCallback& p_on_ready,
+                                                                    const CompileOptions& p_options) {
+            return get_or_create_async(p_func, p_on_ready, p_options);
+        }
+        // Compile every function that has not been compiled yet into a single code buffer
+        // Returns the callbacks in the same order as p_funcs, or an empty vector on failure
+        virtual std::vector<VirtualStackFunction> get_or_create_batch(const std::vector<Ref<RectifiedFunction>> &p_funcs) = 0;
+        virtual VirtualStackFunction recompile(const Ref<RectifiedFunction> &p_func, const CompileOptions& p_options) = 0;
         virtual bool remove_function(const Ref<RectifiedFunction>& p_func) = 0;
         virtual bool remove_function(const void* p_host) = 0;
         virtual void change_settings(const CompilationAgentSettings& p_new_settings) { settings = p_new_settings; }
-        virtual void register_heat(const void* p_host) = 0;
+        // p_calls invocations of p_host since its last report
+        virtual void register_heat(const void* p_host, uint32_t p_calls) = 0;
+        // Decay and evict synchronously, the only way to evict with SINGLE_UNSAFE
+        virtual void collect_garbage() = 0;
+        // Recompile p_func at TIER_OPTIMIZED, then hand the result to the tier-up listener
+        // Returns false if the request was shed and never will be carried out
+        virtual bool tier_up(const Ref<RectifiedFunction>& p_func) = 0;
+        void set_eviction_listener(const EvictionListener& p_listener) { eviction_listener = p_listener; }
+        void set_tier_up_listener(const TierUpListener& p_listener) { tier_up_listener = p_listener; }
     };
     class SingleUnsafeCompilationHandler : public CompilationHandler {
         std::unordered_map<size_t, CompilationHandler::VirtualStackFunction> function_map{};
@@ -57,79 +203,143 @@ namespace microjit
             : CompilationHandler(p_settings, p_compiler, p_runtime) {}
 
         bool function_compiled(const Ref<RectifiedFunction> &p_func) const override;
-        VirtualStackFunction get_or_create(const Ref<RectifiedFunction> &p_func) override;
-        VirtualStackFunction recompile(const Ref<RectifiedFunction> &p_func) override;
+        VirtualStackFunction get_or_create(const Ref<RectifiedFunction> &p_func, const CompileOptions& p_options) override;
+        std::shared_future<VirtualStackFunction> get_or_create_async(const Ref<RectifiedFunction> &p_func,
+                                                                     const CompletionCallback& p_on_ready,
+                                                                     const CompileOptions& p_options) override;
+        std::vector<VirtualStackFunction> get_or_create_batch(const std::vector<Ref<RectifiedFunction>> &p_funcs) override;
+        VirtualStackFunction recompile(const Ref<RectifiedFunction> &p_func, const CompileOptions& p_options) override;
         bool remove_function(const Ref<RectifiedFunction>& p_func) override;
         bool remove_function(const void* p_host) override;
-        void register_heat(const void* p_host) override {  }
+        void register_heat(const void* p_host, uint32_t p_calls) override;
+        void collect_garbage() override;
+        bool tier_up(const Ref<RectifiedFunction>& p_func) override;
     };
     class CommandQueueCompilationHandler : public CompilationHandler {
-        std::unordered_map<size_t, CompilationHandler::VirtualStackFunction> function_map{};
-//        DecayingWeightedCache<size_t, Box<HandlerStub>> function_cache;
-        ManagedThread garbage_collector{};
-        bool is_terminated = false;
+        // Only written from the queue, compiled functions are read from any thread without going through it
+        ConcurrentFunctionTable function_table{};
         mutable CommandQueue queue{};
     private:
         bool function_compiled_internal(const Ref<RectifiedFunction> &p_func) const;
         VirtualStackFunction get_or_create_internal(const Ref<RectifiedFunction> &p_func);
+        std::vector<VirtualStackFunction> get_or_create_batch_internal(const std::vector<Ref<RectifiedFunction>> &p_funcs);
         VirtualStackFunction recompile_internal(const Ref<RectifiedFunction> &p_func);
-        VirtualStackFunction compile_from_scratch(const Ref<RectifiedFunction> &p_func);
         bool remove_function_internal(const void* p_host);
-        void register_heat_internal(const void* p_host);
+        void register_heat_internal(const void* p_host, uint32_t p_calls);
+        EvictedFunctions collect_garbage_queued(bool p_decay, bool p_cleanup);
+        void tier_up_internal(const Ref<RectifiedFunction>& p_func);
     public:
         CommandQueueCompilationHandler(const CompilationAgentSettings& p_settings, const Ref<MicroJITCompiler>& p_compiler, const Ref<MicroJITRuntime>& p_runtime);
         ~CommandQueueCompilationHandler() override;
 
         bool function_compiled(const Ref<RectifiedFunction> &p_func) const override;
-        VirtualStackFunction get_or_create(const Ref<RectifiedFunction> &p_func) override;
-        VirtualStackFunction recompile(const Ref<RectifiedFunction> &p_func) override;
+        VirtualStackFunction get_or_create(const Ref<RectifiedFunction> &p_func, const CompileOptions& p_options) override;
+        std::shared_future<VirtualStackFunction> get_or_create_async(const Ref<RectifiedFunction> &p_func,
+                                                                     const CompletionCallback& p_on_ready,
+                                                                     const CompileOptions& p_options) override;
+        std::vector<VirtualStackFunction> get_or_create_batch(const std::vector<Ref<RectifiedFunction>> &p_funcs) override;
+        VirtualStackFunction recompile(const Ref<RectifiedFunction> &p_func, const CompileOptions& p_options) override;
         bool remove_function(const Ref<RectifiedFunction>& p_func) override;
         bool remove_function(const void* p_host) override;
-        void register_heat(const void* p_host) override;
+        void register_heat(const void* p_host, uint32_t p_calls) override;
+        void collect_garbage() override;
+        bool tier_up(const Ref<RectifiedFunction>& p_func) override;
     };
+    // TLock only guards the heat cache and optimized_hosts, which heat registration reads on the compiler threads
+    template <class TLock = RWLock>
     class ThreadPoolCompilationHandler : public CompilationHandler {
     public:
         typedef Ref<MicroJITCompiler> (*compiler_spawner)(const Ref<MicroJITRuntime>&);
     private:
-        Ref<MicroJITRuntime> runtime;
-        std::unordered_map<size_t, CompilationHandler::VirtualStackFunction> function_map{};
-//        DecayingWeightedCache<size_t, Box<HandlerStub>> function_cache;
-        ManagedThread garbage_collector{};
-        bool is_terminated = false;
+        // Compiled functions are looked up without locking
+        ConcurrentFunctionTable function_table{};
         const compiler_spawner spawner;
-        mutable ThreadPool pool;
-        mutable RWLock lock{};
+        // One pool, or one per NUMA node with numa_local_compilation
+        std::vector<std::unique_ptr<ThreadPool>> pools{};
+        mutable TLock lock{};
+        // A background compilation waiting in the pool. The pool drops it by destroying it once its deadline passed,
+        // it then completes with nullptr so that neither the future nor the completion callback is left hanging
+        struct QueuedCompilation {
+            ThreadPoolCompilationHandler* handler;
+            Ref<RectifiedFunction> function;
+            CompletionCallback on_ready;
+            std::promise<VirtualStackFunction> promise{};
+            bool pending{true};
+
+            QueuedCompilation(ThreadPoolCompilationHandler* p_handler, const Ref<RectifiedFunction>& p_func,
+                              const CompletionCallback& p_on_ready);
+            QueuedCompilation(QueuedCompilation&& p_other) noexcept;
+            QueuedCompilation(const QueuedCompilation&) = delete;
+            ~QueuedCompilation();
+            void operator()();
+            void complete(VirtualStackFunction p_callback);
+        };
     private:
         bool function_compiled_internal(const Ref<RectifiedFunction> &p_func) const;
         VirtualStackFunction get_or_create_internal(const Ref<RectifiedFunction> &p_func);
+        std::vector<VirtualStackFunction> get_or_create_batch_internal(const std::vector<Ref<RectifiedFunction>> &p_funcs);
         VirtualStackFunction recompile_internal(const Ref<RectifiedFunction> &p_func);
-        VirtualStackFunction compile_from_scratch(const Ref<RectifiedFunction> &p_func);
+        // Compile p_func and publish it into p_entry, p_claimed tells whether the caller holds the entry's claim
+        // The claim is given up on failure, and the code is thrown away if the host got detached meanwhile
+        VirtualStackFunction compile_into(const Ref<RectifiedFunction> &p_func, ConcurrentFunctionTable::Entry* p_entry,
+                                          bool p_claimed);
         bool remove_function_internal(const void* p_host);
-        void register_heat_internal(const void* p_host);
+        void register_heat_internal(const void* p_host, uint32_t p_calls);
+        void collect_garbage_pooled(bool p_decay, bool p_cleanup);
+        void tier_up_internal(const Ref<RectifiedFunction>& p_func);
+        // The pool of the caller's node
+        _NO_DISCARD_ ThreadPool& get_local_pool() const;
+        // Over compile_queue_bound, whether ThreadPool::LOW work should be shed instead of queued
+        _NO_DISCARD_ bool over_queue_bound(ThreadPool& p_pool) const;
+        // Compile p_func on p_pool, dropped from the queue if it is still there past p_options.deadline
+        std::shared_future<VirtualStackFunction> queue_compilation(ThreadPool& p_pool, const Ref<RectifiedFunction> &p_func,
+                                                                   const CompletionCallback& p_on_ready, const CompileOptions& p_options);
     public:
         ThreadPoolCompilationHandler() = delete;
         explicit ThreadPoolCompilationHandler(const CompilationAgentSettings& p_settings, compiler_spawner p_spawner, const Ref<MicroJITRuntime>& p_runtime);
         ~ThreadPoolCompilationHandler() override;
 
         bool function_compiled(const Ref<RectifiedFunction> &p_func) const override;
-        VirtualStackFunction get_or_create(const Ref<RectifiedFunction> &p_func) override;
-        VirtualStackFunction recompile(const Ref<RectifiedFunction> &p_func) override;
+        VirtualStackFunction get_or_create(const Ref<RectifiedFunction> &p_func, const CompileOptions& p_options) override;
+        std::shared_future<VirtualStackFunction> get_or_create_async(const Ref<RectifiedFunction> &p_func,
+                                                                     const CompletionCallback& p_on_ready,
+                                                                     const CompileOptions& p_options) override;
+        std::shared_future<VirtualStackFunction> precompile(const Ref<RectifiedFunction> &p_func,
+                                                            const CompletionCallback& p_on_ready,
+                                                            const CompileOptions& p_options) override;
+        std::vector<VirtualStackFunction> get_or_create_batch(const std::vector<Ref<RectifiedFunction>> &p_funcs) override;
+        VirtualStackFunction recompile(const Ref<RectifiedFunction> &p_func, const CompileOptions& p_options) override;
         bool remove_function(const Ref<RectifiedFunction>& p_func) override;
         bool remove_function(const void* p_host) override;
-        void register_heat(const void* p_host) override;
+        void register_heat(const void* p_host, uint32_t p_calls) override;
+        void collect_garbage() override;
+        bool tier_up(const Ref<RectifiedFunction>& p_func) override;
     };
+    // Defined in runtime_agent.cpp
+    extern template class ThreadPoolCompilationHandler<RWLock>;
     template <class TCompiler>
     class RuntimeAgent {
     public:
     private:
         
+        static size_t get_shard_count(const CompilationAgentSettings& p_settings) {
+            if (p_settings.runtime_shard_count) return p_settings.runtime_shard_count;
+            // Only the pool compiles from several threads at once
+            if (p_settings.type != MULTI_POOLED) return 1;
+            return std::max<size_t>(p_settings.initial_compiler_thread_count, p_settings.compiler_scaling.max_threads);
+        }
+        static size_t get_node_count(const CompilationAgentSettings& p_settings) {
+            if (p_settings.type != MULTI_POOLED || !p_settings.numa_local_compilation) return 1;
+            return CpuTopology::get_singleton().get_node_count();
+        }
         static Ref<MicroJITCompiler> create_compiler(const Ref<MicroJITRuntime>& p_runtime) {
             return Ref<TCompiler>::make_ref(p_runtime).template c_style_cast<MicroJITCompiler>();
         }
         CompilationHandler* handler{};
-        Ref<MicroJITRuntime> runtime{Ref<MicroJITRuntime>::make_ref()};
+        Ref<MicroJITRuntime> runtime{};
     public:
-        explicit RuntimeAgent(const CompilationAgentSettings& p_settings){
+        explicit RuntimeAgent(const CompilationAgentSettings& p_settings)
+            : runtime(Ref<MicroJITRuntime>::make_ref(p_settings.code_heap, get_shard_count(p_settings), get_node_count(p_settings))) {
             switch (p_settings.type) {
                 case SINGLE_UNSAFE:
                     handler = new SingleUnsafeCompilationHandler(p_settings, create_compiler(runtime), runtime);
@@ -138,7 +348,7 @@ namespace microjit
                     handler = new CommandQueueCompilationHandler(p_settings, create_compiler(runtime), runtime);
                     break;
                 case MULTI_POOLED:
-                    handler = new ThreadPoolCompilationHandler(p_settings, create_compiler, runtime);
+                    handler = new ThreadPoolCompilationHandler<RWLock>(p_settings, create_compiler, runtime);
                     break;
             }
         }
@@ -148,11 +358,26 @@ namespace microjit
         bool function_compiled(const Ref<RectifiedFunction> &p_func) const {
             return handler->function_compiled(p_func);
         }
-        CommandQueueCompilationHandler::VirtualStackFunction get_or_create(const Ref<RectifiedFunction> &p_func) {
-            return handler->get_or_create(p_func);
+        CommandQueueCompilationHandler::VirtualStackFunction get_or_create(const Ref<RectifiedFunction> &p_func,
+                                                                           const CompileOptions& p_options = CompileOptions()) {
+            return handler->get_or_create(p_func, p_options);
+        }
+        std::shared_future<CompilationHandler::VirtualStackFunction> get_or_create_async(const Ref<RectifiedFunction> &p_func,
+                                                                                         const CompilationHandler::CompletionCallback& p_on_ready,
+                                                                                         const CompileOptions& p_options = CompileOptions()) {
+            return handler->get_or_create_async(p_func, p_on_ready, p_options);
+        }
+        std::shared_future<CompilationHandler::VirtualStackFunction> precompile(const Ref<RectifiedFunction> &p_func,
+                                                                                const CompilationHandler::CompletionCallback& p_on_ready,
+                                                                                const CompileOptions& p_options = CompileOptions()) {
+            return handler->precompile(p_func, p_on_ready, p_options);
         }
-        CommandQueueCompilationHandler::VirtualStackFunction recompile(const Ref<RectifiedFunction> &p_func) {
-            return handler->recompile(p_func);
+        std::vector<CompilationHandler::VirtualStackFunction> get_or_create_batch(const std::vector<Ref<RectifiedFunction>> &p_funcs) {
+            return handler->get_or_create_batch(p_funcs);
+        }
+        CommandQueueCompilationHandler::VirtualStackFunction recompile(const Ref<RectifiedFunction> &p_func,
+                                                                       const CompileOptions& p_options = CompileOptions()) {
+            return handler->recompile(p_func, p_options);
         }
         bool remove_function(const Ref<RectifiedFunction>& p_func) {
             return handler->remove_function(p_func);
@@ -160,6 +385,31 @@ namespace microjit
         bool remove_function(const void* p_host) {
             return handler->remove_function(p_host);
         }
+        void register_heat(const Ref<RectifiedFunction>& p_func, uint32_t p_calls) {
+            handler->register_heat(p_func->host, p_calls);
+        }
+        void set_eviction_listener(const CompilationHandler::EvictionListener& p_listener) {
+            handler->set_eviction_listener(p_listener);
+        }
+        void collect_garbage() {
+            handler->collect_garbage();
+        }
+        void set_tier_up_listener(const CompilationHandler::TierUpListener& p_listener) {
+            handler->set_tier_up_listener(p_listener);
+        }
+        bool tier_up(const Ref<RectifiedFunction>& p_func) {
+            return handler->tier_up(p_func);
+        }
+        void stop_garbage_collector() {
+            handler->stop_garbage_collector();
+        }
+        // Heat survives remove_function so that a recompiled function keeps its placement, forget it explicitly
+        void clear_heat(const void* p_host) {
+            runtime->clear_heat(p_host);
+        }
+        _NO_DISCARD_ CodeHeap::Statistics get_code_heap_statistics() {
+            return runtime->get_code_heap_statistics();
+        }
     };
 }
 
@@ -149,6 +149,14 @@ public:
 class SafeRefCount {
     SafeNumeric<uint32_t> count;
 
+#ifdef MICROJIT_COUNT_REFCOUNT_OPS
+    // Atomic read-modify-writes done by every SafeRefCount, to measure what reference counting costs
+    static inline std::atomic<uint64_t> op_count{};
+    static _ALWAYS_INLINE_ void count_op() { op_count.fetch_add(1, std::memory_order_relaxed); }
+#else
+    static _ALWAYS_INLINE_ void count_op() {}
+#endif
+
 #ifdef DEV_ENABLED
     _ALWAYS_INLINE_ void _check_unref_sanity() {
 		// This won't catch every misuse, but it's better than nothing.
@@ -161,10 +169,12 @@ class SafeRefCount {
 
 public:
     _ALWAYS_INLINE_ bool ref() { // true on success
+        count_op();
         return count.conditional_increment() != 0;
     }
 
     _ALWAYS_INLINE_ uint32_t refval() { // none-zero on success
+        count_op();
         return count.conditional_increment();
     }
 
@@ -172,6 +182,7 @@ public:
 #ifdef DEV_ENABLED
         _check_unref_sanity();
 #endif
+        count_op();
         return count.decrement() == 0;
     }
 
@@ -179,6 +190,7 @@ public:
 #ifdef DEV_ENABLED
         _check_unref_sanity();
 #endif
+        count_op();
         return count.decrement();
     }
 
@@ -189,6 +201,13 @@ public:
     _ALWAYS_INLINE_ void init(uint32_t p_value = 1) {
         count.set(p_value);
     }
+
+#ifdef MICROJIT_COUNT_REFCOUNT_OPS
+    // Across every thread since the program started, 0 unless MICROJIT_COUNT_REFCOUNT_OPS is defined
+    _NO_DISCARD_ static uint64_t get_op_count() { return op_count.load(std::memory_order_relaxed); }
+#else
+    _NO_DISCARD_ static uint64_t get_op_count() { return 0; }
+#endif
 };
 
 #endif // SAFE_REFCOUNT_H
@@ -9,11 +9,18 @@
 #include <future>
 #include <mutex>
 #include <queue>
+#include <deque>
 #include <vector>
+#include <memory>
 #include <thread>
+#include <chrono>
+#include <iostream>
 
 #include "managed_thread.h"
+#include "inplace_task.h"
+#include "bounded_queue.h"
 #include "priority_queue.h"
+#include "work_stealing_deque.h"
 
 namespace microjit {
     template <class T>
@@ -41,15 +48,80 @@ namespace microjit {
         }
     };
 
+    // Lets a ThreadPool grow under load and shrink back once idle
+    struct ElasticPolicy {
+        // Bounds on the worker count, a max_threads of 0 keeps the pool at the size it was created with
+        uint8_t min_threads{};
+        uint8_t max_threads{};
+        // Grow when more injected tasks than this are waiting per worker
+        uint32_t queue_depth_per_worker{4};
+        // Grow when no worker picked up a task for this long while no worker is parked
+        std::chrono::milliseconds max_wait{50};
+        // Workers parked for this long leave, down to min_threads
+        std::chrono::milliseconds idle_timeout{5000};
+    };
+
+    // Where a ThreadPool's workers are allowed to run
+    struct AffinityPolicy {
+        enum Placement : unsigned char {
+            // Let the scheduler decide
+            PLACEMENT_NONE,
+            // Every worker may run on any CPU of cpus
+            PLACEMENT_CPU_SET,
+            // Every worker may run on any CPU of one NUMA node
+            PLACEMENT_NODE,
+            // Workers are dealt round robin to the NUMA nodes, each restricted to its node
+            PLACEMENT_SPREAD_NODES,
+        };
+        Placement placement{PLACEMENT_NONE};
+        CpuSet cpus{};
+        size_t node{};
+    };
+
     class ThreadPool {
     public:
+        typedef std::chrono::steady_clock Clock;
+        static constexpr Clock::time_point no_deadline = Clock::time_point::max();
         enum Priority : unsigned char {
             SYSTEM = 0,
             HIGH = 1,
             MEDIUM = 2,
             LOW = 3,
         };
+        enum SchedulingMode : unsigned char {
+            // Every worker pops from one shared priority queue
+            SCHEDULE_SHARED_QUEUE,
+            // Tasks queued from outside the pool go to one injection queue per priority, tasks queued by a worker
+            // go to its own deque. Idle workers steal from random victims and only park once there is no work left
+            // Tasks queued from inside the pool run ahead of injected ones, whatever their priority
+            SCHEDULE_WORK_STEALING,
+        };
     private:
+        typedef InplaceTask Task;
+        static constexpr size_t max_workers = 256;
+        // Finding no work this many times in a row parks the worker
+        static constexpr size_t idle_spin_count = 64;
+        static constexpr uint32_t starvation_guard_period = 8;
+        // How often a worker sweeps the whole shared queue for expired tasks, popping only drops the expired heads
+        static constexpr auto expiry_sweep_period = std::chrono::milliseconds(1);
+        struct WorkerSlot {
+            std::atomic<bool> in_use{};
+            WorkStealingDeque<Task> deque{};
+        };
+        // Deque entries are boxed, boxes are recycled per thread so that steady state queueing does not allocate
+        struct TaskNodeCache {
+            static constexpr size_t capacity = 256;
+            std::vector<Task*> nodes{};
+            ~TaskNodeCache() {
+                for (auto node : nodes) delete node;
+            }
+        };
+        struct LocalWorker {
+            const ThreadPool* pool;
+            WorkerSlot* slot;
+            uint64_t seed;
+            uint32_t injection_pops;
+        };
         struct ManagerThread {
         private:
             bool is_terminated{false};
@@ -92,39 +164,313 @@ namespace microjit {
         const std::function<void()> prologue;
         const std::function<void()> epilogue;
         const uint8_t initial_capacity;
+        const SchedulingMode mode;
+        const ElasticPolicy elastic;
+        const AffinityPolicy affinity;
+        // Workers placed so far, used to deal PLACEMENT_SPREAD_NODES workers
+        size_t placement_cursor{};
         bool is_cleaning_up{false};
         ManagerThread manager_thread{};
         uint8_t termination_flag{};
         mutable std::mutex pool_conditional_mutex{};
         std::condition_variable pool_conditional_lock{};
         std::unordered_map<ManagedThread::ID, ManagedThread*> threads_map{};
-        PriorityQueue<std::function<void()>> task_queue{};
+        // Shared queue state, one FIFO per priority
+        PriorityQueue<Task, LOW + 1> task_queue;
+        // Guarded by pool_conditional_mutex
+        Clock::time_point next_expiry_sweep{};
+        // Work-stealing state, slots are only handed out under pool_conditional_mutex and never freed before the pool
+        // One per priority, only allocated with SCHEDULE_WORK_STEALING
+        std::unique_ptr<SpillingQueue<Task>[]> injection_queues{};
+        std::atomic<size_t> injected_count{};
+        std::atomic<WorkerSlot*> worker_slots[max_workers]{};
+        std::atomic<size_t> worker_slot_count{};
+        std::atomic<uint32_t> parked_count{};
+        // Mirrors threads_map.size() for the checks made without the lock
+        std::atomic<size_t> worker_count{};
+        // Steady clock nanoseconds, only kept while elastic
+        std::atomic<int64_t> last_dequeue_tick{};
+
+        static LocalWorker& get_local_worker() {
+            static thread_local LocalWorker local{};
+            return local;
+        }
+        static TaskNodeCache& get_node_cache() {
+            static thread_local TaskNodeCache cache{};
+            return cache;
+        }
+        static Task* acquire_node(Task&& p_task) {
+            auto& cache = get_node_cache();
+            if (cache.nodes.empty()) return new Task(std::move(p_task));
+            auto node = cache.nodes.back();
+            cache.nodes.pop_back();
+            *node = std::move(p_task);
+            return node;
+        }
+        static void release_node(Task* p_node) {
+            auto& cache = get_node_cache();
+            *p_node = Task();
+            if (cache.nodes.size() >= TaskNodeCache::capacity) {
+                delete p_node;
+                return;
+            }
+            cache.nodes.push_back(p_node);
+        }
+        static void run_task(Task& p_task) {
+            // Tasks with a future report through it, only posted tasks can get here
+            try {
+                p_task();
+            } catch (const std::exception& e){
+                std::cerr << "Exception thrown in thread pool "
+                          << std::this_thread::get_id() << ": " << e.what() << "\n";
+            } catch (...){
+                std::cerr << "Unknown exception thrown in thread pool " << std::this_thread::get_id() << "\n";
+            }
+            p_task = Task();
+        }
+        static _ALWAYS_INLINE_ int64_t get_tick() {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+        _NO_DISCARD_ _ALWAYS_INLINE_ bool is_elastic() const { return elastic.max_threads > 0; }
+        _ALWAYS_INLINE_ void mark_dequeued() {
+            if (is_elastic()) last_dequeue_tick.store(get_tick(), std::memory_order_relaxed);
+        }
+        _NO_DISCARD_ bool should_grow(size_t p_pending, int64_t p_now) const {
+            if (parked_count.load(std::memory_order_relaxed)) return false;
+            const auto live = worker_count.load(std::memory_order_relaxed);
+            if (live >= elastic.max_threads) return false;
+            if (p_pending > elastic.queue_depth_per_worker * live) return true;
+            return p_pending && p_now - last_dequeue_tick.load(std::memory_order_relaxed) >
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(elastic.max_wait).count();
+        }
+        // Caller holds pool_conditional_mutex
+        void grow_if_needed_internal(size_t p_pending){
+            const auto now = get_tick();
+            if (!should_grow(p_pending, now)) return;
+            // The new worker counts as progress so that one stall spawns one worker
+            last_dequeue_tick.store(now, std::memory_order_relaxed);
+            allocate_worker_internal();
+        }
+        // Caller does not hold pool_conditional_mutex, which is only taken once growing looks needed
+        void grow_if_needed(size_t p_pending){
+            if (!should_grow(p_pending, get_tick())) return;
+            std::lock_guard<decltype(pool_conditional_mutex)> lock(pool_conditional_mutex);
+            grow_if_needed_internal(p_pending);
+        }
+        // Caller holds pool_conditional_mutex, returns once p_ready holds
+        // Elastic pools retire workers that stayed parked for idle_timeout through the termination flag
+        template<class P>
+        void park_internal(std::unique_lock<std::mutex>& p_lock, P p_ready){
+            parked_count.fetch_add(1, std::memory_order_seq_cst);
+            while (!p_ready()){
+                if (!is_elastic()) {
+                    pool_conditional_lock.wait(p_lock);
+                    continue;
+                }
+                if (pool_conditional_lock.wait_for(p_lock, elastic.idle_timeout) == std::cv_status::timeout && !p_ready() &&
+                    threads_map.size() - termination_flag > elastic.min_threads)
+                    terminate_worker_internal();
+            }
+            parked_count.fetch_sub(1, std::memory_order_relaxed);
+        }
+        static _ALWAYS_INLINE_ uint64_t next_random(uint64_t& p_seed) {
+            // xorshift64
+            p_seed ^= p_seed << 13;
+            p_seed ^= p_seed >> 7;
+            p_seed ^= p_seed << 17;
+            return p_seed;
+        }
+        WorkerSlot* acquire_slot_internal(){
+            const auto count = worker_slot_count.load(std::memory_order_relaxed);
+            for (size_t i = 0; i < count; i++){
+                auto slot = worker_slots[i].load(std::memory_order_relaxed);
+                if (slot->in_use.load(std::memory_order_relaxed)) continue;
+                slot->in_use.store(true, std::memory_order_relaxed);
+                return slot;
+            }
+            auto slot = new WorkerSlot();
+            slot->in_use.store(true, std::memory_order_relaxed);
+            worker_slots[count].store(slot, std::memory_order_release);
+            worker_slot_count.store(count + 1, std::memory_order_release);
+            return slot;
+        }
+        static _ALWAYS_INLINE_ void unbox(Task* p_node, Task& r_task){
+            r_task = std::move(*p_node);
+            release_node(p_node);
+        }
+        bool find_task(LocalWorker& p_local, Task& r_task){
+            auto p_slot = p_local.slot;
+            auto node = p_slot->deque.take();
+            if (node) {
+                unbox(node, r_task);
+                return true;
+            }
+            if (injected_count.load(std::memory_order_acquire)) {
+                // Injection queues have no timestamps to age by, so every few pops start from the least urgent one
+                const bool reversed = ++p_local.injection_pops % starvation_guard_period == 0;
+                for (uint8_t i = 0; i <= LOW; i++){
+                    if (!injection_queues[reversed ? LOW - i : i].try_pop(r_task)) continue;
+                    injected_count.fetch_sub(1, std::memory_order_relaxed);
+                    return true;
+                }
+            }
+            const auto count = worker_slot_count.load(std::memory_order_acquire);
+            const auto start = next_random(p_local.seed) % count;
+            for (size_t i = 0; i < count; i++){
+                auto victim = worker_slots[(start + i) % count].load(std::memory_order_acquire);
+                if (victim == p_slot) continue;
+                node = victim->deque.steal();
+                if (node) {
+                    unbox(node, r_task);
+                    return true;
+                }
+            }
+            return false;
+        }
+        _NO_DISCARD_ bool has_pending_work() const {
+            if (injected_count.load(std::memory_order_seq_cst)) return true;
+            for (size_t i = 0, s = worker_slot_count.load(std::memory_order_acquire); i < s; i++){
+                if (!worker_slots[i].load(std::memory_order_acquire)->deque.empty()) return true;
+            }
+            return false;
+        }
+        void submit(Task&& p_task, Priority p_priority){
+            auto& local = get_local_worker();
+            if (local.pool == this) local.slot->deque.push(acquire_node(std::move(p_task)));
+            else {
+                // Counted first so that the count never runs behind what workers can pop
+                injected_count.fetch_add(1, std::memory_order_relaxed);
+                injection_queues[p_priority].push(std::move(p_task));
+            }
+            // Pairs with parking workers, who announce themselves before checking for work one last time
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (parked_count.load(std::memory_order_seq_cst) == 0) {
+                if (is_elastic()) grow_if_needed(injected_count.load(std::memory_order_relaxed));
+                return;
+            }
+            std::lock_guard<decltype(pool_conditional_mutex)> lock(pool_conditional_mutex);
+            pool_conditional_lock.notify_one();
+        }
+        void enqueue(Task&& p_task, Priority p_priority, const Clock::time_point& p_deadline = no_deadline){
+            if (mode == SCHEDULE_WORK_STEALING) {
+                if (p_deadline == no_deadline) submit(std::move(p_task), p_priority);
+                // Work-stealing queues cannot drop entries, late tasks are dropped when a worker gets to them instead
+                else submit([task = std::move(p_task), p_deadline]() mutable -> void {
+                    if (Clock::now() <= p_deadline) task();
+                }, p_priority);
+                return;
+            }
+            {
+                std::unique_lock<decltype(pool_conditional_mutex)> lock(pool_conditional_mutex);
+                task_queue.push(std::move(p_task), p_priority, p_deadline);
+                if (is_elastic()) grow_if_needed_internal(task_queue.size());
+            }
+            pool_conditional_lock.notify_one();
+        }
+        // Caller holds pool_conditional_mutex, empty when workers are not restricted
+        CpuSet next_placement_internal(){
+            const auto& topology = CpuTopology::get_singleton();
+            switch (affinity.placement) {
+                case AffinityPolicy::PLACEMENT_CPU_SET:
+                    return affinity.cpus;
+                case AffinityPolicy::PLACEMENT_NODE:
+                    return topology.get_node_cpus(affinity.node);
+                case AffinityPolicy::PLACEMENT_SPREAD_NODES:
+                    return topology.get_node_cpus(placement_cursor++);
+                default:
+                    return CpuSet();
+            }
+        }
+        void run_stealing_worker(ManagedThread* p_worker, WorkerSlot* p_slot, const CpuSet& p_cpus){
+            auto& local = get_local_worker();
+            local = LocalWorker{ this, p_slot, (uint64_t)p_slot | 1, 0 };
+            // Pinned before the prologue so that whatever it allocates is first touched on the right node
+            if (!p_cpus.empty()) ManagedThread::set_current_affinity(p_cpus);
+            if (prologue) prologue();
+            size_t idle = 0;
+            Task task{};
+            while (true){
+                if (find_task(local, task)) {
+                    idle = 0;
+                    mark_dequeued();
+                    // Still more injected than the live workers keep up with
+                    if (is_elastic()) grow_if_needed(injected_count.load(std::memory_order_relaxed));
+                    run_task(task);
+                    continue;
+                }
+                if (++idle < idle_spin_count) {
+                    ManagedThread::yield();
+                    continue;
+                }
+                idle = 0;
+                std::unique_lock<decltype(pool_conditional_mutex)> lock(pool_conditional_mutex);
+                park_internal(lock, [this]() -> bool { return termination_flag > 0 || has_pending_work(); });
+                // Only idle workers leave, so their deque is empty and nothing is lost
+                if (termination_flag > 0) {
+                    termination_flag--;
+                    threads_map.erase(p_worker->get_id());
+                    worker_count.store(threads_map.size(), std::memory_order_relaxed);
+                    manager_thread.queue_for_disposal(p_worker);
+                    p_slot->in_use.store(false, std::memory_order_relaxed);
+                    local = LocalWorker{};
+                    if (epilogue) epilogue();
+                    return;
+                }
+            }
+        }
 
         ManagedThread::ID allocate_worker_internal(){
             if (is_cleaning_up) return 0;
+            // Every slot is taken
+            if (mode == SCHEDULE_WORK_STEALING && threads_map.size() >= max_workers) return 0;
             auto worker = new ManagedThread();
-            worker->start([this, worker]() -> void {
+            auto cpus = next_placement_internal();
+            if (mode == SCHEDULE_WORK_STEALING) {
+                auto slot = acquire_slot_internal();
+                worker->start([this, worker, slot, cpus]() -> void { run_stealing_worker(worker, slot, cpus); });
+                auto id = worker->get_id();
+                threads_map[id] = worker;
+                worker_count.store(threads_map.size(), std::memory_order_relaxed);
+                return id;
+            }
+            worker->start([this, worker, cpus]() -> void {
+                if (!cpus.empty()) ManagedThread::set_current_affinity(cpus);
                 if (prologue) prologue();
+                Task task{};
+                // Destroyed outside of the lock, which breaks their promises
+                std::vector<Task> expired{};
                 while (true){
-                    std::function<void()> func;
                     bool dequeued;
                     {
                         std::unique_lock<decltype(pool_conditional_mutex)> lock(pool_conditional_mutex);
-                        pool_conditional_lock.wait(lock, [this] { return !task_queue.empty() || termination_flag > 0; });
+                        park_internal(lock, [this]() -> bool { return !task_queue.empty() || termination_flag > 0; });
                         if (termination_flag > 0) {
                             termination_flag--;
                             threads_map.erase(worker->get_id());
+                            worker_count.store(threads_map.size(), std::memory_order_relaxed);
                             manager_thread.queue_for_disposal(worker);
                             if (epilogue) epilogue();
                             return;
                         }
-                        dequeued = task_queue.try_pop(func);
+                        const auto now = Clock::now();
+                        if (now >= next_expiry_sweep) {
+                            task_queue.remove_expired(&expired);
+                            next_expiry_sweep = now + expiry_sweep_period;
+                        }
+                        dequeued = task_queue.try_pop(task, &expired);
+                        // Still more queued than the live workers keep up with
+                        if (dequeued && is_elastic() && !task_queue.empty()) grow_if_needed_internal(task_queue.size());
                     }
-                    if (dequeued) func();
+                    expired.clear();
+                    if (!dequeued) continue;
+                    mark_dequeued();
+                    run_task(task);
                 }
             });
             auto id = worker->get_id();
             threads_map[id] = worker;
+            worker_count.store(threads_map.size(), std::memory_order_relaxed);
             return id;
         }
         void terminate_worker_internal(){
@@ -133,39 +479,33 @@ namespace microjit {
             pool_conditional_lock.notify_one();
         }
         void init() {
-            for (int i = 0; i < initial_capacity; ++i) {
+            if (mode == SCHEDULE_WORK_STEALING) injection_queues = std::make_unique<SpillingQueue<Task>[]>(LOW + 1);
+            last_dequeue_tick.store(get_tick(), std::memory_order_relaxed);
+            auto initial = initial_capacity;
+            // Elastic pools start within their bounds
+            if (is_elastic()) initial = std::min(std::max(initial, elastic.min_threads), elastic.max_threads);
+            for (int i = 0; i < initial; ++i) {
                 allocate_worker_internal();
             }
         }
         template<typename T>
-        _ALWAYS_INLINE_ auto queue_task_internal(Priority p_priority, const std::function<T>& p_func){
-            auto task_ptr = std::make_shared<std::packaged_task<T>>(p_func);
-
-            {
-                std::unique_lock<decltype(pool_conditional_mutex)> lock(pool_conditional_mutex);
-                task_queue.push([task_ptr]() {
-                    (*task_ptr)();
-                }, p_priority);
-            }
-            pool_conditional_lock.notify_one();
-
-            // Return future from promise
-            return task_ptr->get_future();
+        _ALWAYS_INLINE_ std::future<T> queue_task_internal(Priority p_priority, std::packaged_task<T()>&& p_task,
+                                                           const Clock::time_point& p_deadline = no_deadline){
+            // Take the future before the task can run
+            auto re = p_task.get_future();
+            enqueue(Task(std::move(p_task)), p_priority, p_deadline);
+            return re;
         }
         template<typename T>
         _ALWAYS_INLINE_ auto queue_group_task_internal(Priority p_priority, const uint8_t& p_thread_count, const std::function<T(uint8_t, uint8_t)>& p_func){
             uint8_t allocation_thread_count = p_thread_count;
             auto promises = (std::future<T>*)malloc(sizeof(std::future<void>) * allocation_thread_count);
-            {
-                std::unique_lock<decltype(pool_conditional_mutex)> lock(pool_conditional_mutex);
-                for (uint8_t i = 0; i < allocation_thread_count; i++) {
-                    auto task_ptr = std::make_shared<std::packaged_task<T(uint8_t, uint8_t)>>(p_func);
-                    task_queue.push([task_ptr, i, allocation_thread_count]() -> void {
-                        (*task_ptr)(i, allocation_thread_count);
-                    }, p_priority);
-                    new (&promises[i]) std::future<T>(task_ptr->get_future());
-                    pool_conditional_lock.notify_one();
-                }
+            for (uint8_t i = 0; i < allocation_thread_count; i++) {
+                std::packaged_task<T(uint8_t, uint8_t)> task(p_func);
+                new (&promises[i]) std::future<T>(task.get_future());
+                enqueue([task = std::move(task), i, allocation_thread_count]() mutable -> void {
+                    task(i, allocation_thread_count);
+                }, p_priority);
             }
             return GroupTaskPromise(allocation_thread_count, promises);
         }
@@ -192,6 +532,17 @@ namespace microjit {
             std::unique_lock<decltype(pool_conditional_mutex)> lock(pool_conditional_mutex);
             return threads_map.size();
         }
+        // Tasks waiting for a worker, a hint. With SCHEDULE_WORK_STEALING only the injection queues are counted,
+        // not what already sits in a worker's own deque, and tasks past their deadline still count until a worker
+        // gets to them. The shared queue drops those first
+        _NO_DISCARD_ size_t get_queued_count() {
+            if (mode == SCHEDULE_WORK_STEALING) return injected_count.load(std::memory_order_relaxed);
+            // Destroyed outside of the lock, which breaks their promises
+            std::vector<Task> expired{};
+            std::unique_lock<decltype(pool_conditional_mutex)> lock(pool_conditional_mutex);
+            task_queue.remove_expired(&expired);
+            return task_queue.size();
+        }
         _ALWAYS_INLINE_ void terminate_all_workers() {
             {
                 std::unique_lock<decltype(pool_conditional_mutex)> lock(pool_conditional_mutex);
@@ -235,25 +586,53 @@ namespace microjit {
 
         template<typename F, typename...Args>
         auto queue_task(Priority p_priority, F&& f, Args&&... args) -> std::future<decltype(f(args...))> {
-            std::function<decltype(f(args...))()> func = std::bind(std::forward<F>(f), std::forward<Args>(args)...);
-            return queue_task_internal(p_priority, func);
+            std::packaged_task<decltype(f(args...))()> task(std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+            return queue_task_internal(p_priority, std::move(task));
         }
 
         template<typename T, typename F, typename...Args>
         auto queue_task_method(Priority p_priority, T* p_instance, F&& f, Args&& ...args) -> std::future<decltype((p_instance->*f)(args...))> {
-            std::function<decltype((p_instance->*f)(args...))()> func = std::bind(std::forward<F>(f), p_instance, std::forward<Args>(args)...);
-            return queue_task_internal(p_priority, func);
+            std::packaged_task<decltype((p_instance->*f)(args...))()> task(std::bind(std::forward<F>(f), p_instance, std::forward<Args>(args)...));
+            return queue_task_internal(p_priority, std::move(task));
         }
 
         template<typename T, typename F, typename...Args>
         auto queue_task_method(Priority p_priority, const T* p_instance, F&& f, Args&& ...args) -> std::future<decltype((p_instance->*f)(args...))> {
-            std::function<decltype((p_instance->*f)(args...))()> func = std::bind(std::forward<F>(f), p_instance, std::forward<Args>(args)...);
-            return queue_task_internal(p_priority, func);
+            std::packaged_task<decltype((p_instance->*f)(args...))()> task(std::bind(std::forward<F>(f), p_instance, std::forward<Args>(args)...));
+            return queue_task_internal(p_priority, std::move(task));
+        }
+
+        // Dropped instead of run if no worker picked it up by p_deadline, its future then throws std::future_error
+        template<typename F, typename...Args>
+        auto queue_task_until(Priority p_priority, const Clock::time_point& p_deadline, F&& f, Args&&... args) -> std::future<decltype(f(args...))> {
+            std::packaged_task<decltype(f(args...))()> task(std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+            return queue_task_internal(p_priority, std::move(task), p_deadline);
+        }
+
+        // Fire and forget, nothing is allocated as long as p_func fits inside an InplaceTask
+        // Exceptions thrown by p_func are reported by the worker and swallowed
+        template<typename F>
+        _ALWAYS_INLINE_ void post(Priority p_priority, F&& p_func){
+            enqueue(Task(std::forward<F>(p_func)), p_priority);
+        }
+        template<typename F>
+        _ALWAYS_INLINE_ void post_until(Priority p_priority, const Clock::time_point& p_deadline, F&& p_func){
+            enqueue(Task(std::forward<F>(p_func)), p_priority, p_deadline);
+        }
+        // Time a queued task waits before it competes one priority higher, only used by SCHEDULE_SHARED_QUEUE
+        void set_aging_interval(const Clock::duration& p_interval){
+            std::unique_lock<decltype(pool_conditional_mutex)> lock(pool_conditional_mutex);
+            task_queue.set_aging_interval(p_interval);
         }
 
+        // p_aging_interval is the initial set_aging_interval, zero or less disables aging
         explicit ThreadPool(const uint8_t& p_threads = 3, const std::function<void()>& p_prologue = std::function<void()>(),
-                            const std::function<void()>& p_epilogue = std::function<void()>())
-                : initial_capacity(p_threads), prologue(p_prologue), epilogue(p_epilogue) {
+                            const std::function<void()>& p_epilogue = std::function<void()>(),
+                            SchedulingMode p_mode = SCHEDULE_SHARED_QUEUE, const ElasticPolicy& p_elastic = ElasticPolicy(),
+                            const AffinityPolicy& p_affinity = AffinityPolicy(),
+                            const Clock::duration& p_aging_interval = std::chrono::milliseconds(100))
+                : initial_capacity(p_threads), prologue(p_prologue), epilogue(p_epilogue), mode(p_mode), elastic(p_elastic),
+                  affinity(p_affinity), task_queue(p_aging_interval) {
             init();
         }
 
@@ -262,6 +641,12 @@ namespace microjit {
         ~ThreadPool() {
             terminate_all_workers();
             manager_thread.join();
+            // Tasks queued after every worker left are destroyed along with their queues
+            for (size_t i = 0, s = worker_slot_count.load(std::memory_order_acquire); i < s; i++){
+                auto slot = worker_slots[i].load(std::memory_order_relaxed);
+                while (auto task = slot->deque.take()) delete task;
+                delete slot;
+            }
         }
 
         ThreadPool & operator=(const ThreadPool &) = delete;
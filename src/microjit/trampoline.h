@@ -6,6 +6,8 @@
 #define MICROJIT_EXPERIMENT_TRAMPOLINE_H
 
 #include <functional>
+#include <atomic>
+#include <tuple>
 #include "helper.h"
 #include "type.h"
 
@@ -61,6 +63,24 @@ namespace microjit {
             (*functor)(std::forward<Args>(args)...);
         }
     };
+    // Calls a function instance may still make straight into its compiled code before one has to go through
+    // recompile_cb, which reports their heat, counts them towards the tier-up and refills the budget
+    // Negative once there is nothing left to report. Concurrent callers may lose decrements, reports then come later
+    struct CallBudget {
+        static constexpr int32_t unbounded = -1;
+        // JIT code reads and writes it as a plain int32_t
+        std::atomic<int32_t> remaining{};
+        // Whether this call may skip recompile_cb
+        _ALWAYS_INLINE_ bool take() {
+            const auto budget = remaining.load(std::memory_order_relaxed);
+            if (budget < 0) return true;
+            if (budget == 0) return false;
+            remaining.store(budget - 1, std::memory_order_relaxed);
+            return true;
+        }
+    };
+    static_assert(sizeof(std::atomic<int32_t>) == sizeof(int32_t) && std::atomic<int32_t>::is_always_lock_free);
+
     template <typename R, typename...Args> class NativeFunctionTrampoline;
     class JitFunctionTrampoline;
 
@@ -79,9 +99,11 @@ namespace microjit {
 
         template <typename R, typename...Args>
         static Ref<NativeFunctionTrampoline<R, Args...>> create_native_trampoline(R (*f)(Args...));
-        template<class T>
-        static Ref<JitFunctionTrampoline> create_jit_trampoline(const T* p_host, void (*p_recompile_cb)(const T*),
-                                                 void (**p_actual_trampoline)(uint8_t *));
+        // Callbacks receive p_host back untouched, calling them through a pointer of another type would be UB
+        static Ref<JitFunctionTrampoline> create_jit_trampoline(const void* p_host, void (*p_recompile_cb)(const void*),
+                                                 const std::atomic<void (*)(uint8_t*)>* p_actual_trampoline,
+                                                 bool (*p_interpret_cb)(const void*, uint8_t*) = nullptr,
+                                                 CallBudget* p_budget = nullptr);
     };
 
     template <typename R, typename...Args>
@@ -92,7 +114,7 @@ namespace microjit {
         FunctorType functor;
         friend class BaseTrampoline;
     public:
-        static constexpr auto args_combined_size = (sizeof(Args) + ...);
+        static constexpr auto args_combined_size = (sizeof(Args) + ... + 0);
         const Type return_type;
         const std::vector<Type> argument_types;
     private:
@@ -100,133 +122,90 @@ namespace microjit {
         static void create_args(std::vector<Type>* p_vec){
             p_vec->push_back(Type::create<T>());
         }
-// Passed from left to right
-#if defined(__clang__)
-        template<typename T>
-        T pass_arg(uint8_t **vrsp_ptr, int *argc,
-                   uint8_t *old_rsp) const {
-            auto new_offset = (size_t)*vrsp_ptr - sizeof(T);
-            *vrsp_ptr = (uint8_t*)(new_offset);
-            auto arg_ptr = (T*)(new_offset);
-            if (*argc == argument_types.size() - 1){
-                *vrsp_ptr = old_rsp;
-            } else {
-                *argc += 1;
-            }
-            return *arg_ptr;
-        }
-        template<typename ...Args2>
-        void call_internal(void (*f)(Args2...), uint8_t* p_stack) const {
-            constexpr auto args_space_size = calculate_args_space<R, Args...>();
-            auto floor = p_stack;
-            auto ceil = (uint8_t*)((size_t)p_stack + args_space_size);
-
-            if constexpr (sizeof...(Args2) == 0) {
-                f();
+        // Arguments are laid out from the top of the args space down, the first one sits highest
+        template<size_t I>
+        static constexpr size_t arg_offset(){
+            constexpr size_t sizes[] = { sizeof(Args)... };
+            size_t consumed = 0;
+            for (size_t i = 0; i <= I; i++) consumed += sizes[i];
+            return calculate_args_space<R, Args...>() - consumed;
+        }
+        template<size_t I>
+        static _ALWAYS_INLINE_ std::tuple_element_t<I, std::tuple<Args...>> pass_arg(const uint8_t* p_stack){
+            return load_stack_value<std::tuple_element_t<I, std::tuple<Args...>>>(p_stack + arg_offset<I>());
+        }
+        template<size_t... I>
+        void call_internal(uint8_t* p_stack, std::index_sequence<I...>) const {
+            // Each argument is read from its own fixed offset, so evaluation order does not matter
+            if constexpr (std::is_void_v<R>) {
+                functor(pass_arg<I>(p_stack)...);
             } else {
-                int i = 0;
-                f(pass_arg<Args2>(&ceil, &i, floor)...);
+                // The return value lives at the bottom of the args space
+                store_stack_value<R>(p_stack, functor(pass_arg<I>(p_stack)...));
             }
         }
-
-        template<typename R2, typename ...Args2>
-        void call_internal(R2 (*f)(Args2...), uint8_t* p_stack) const {
-            constexpr auto args_space_size = calculate_args_space<R, Args...>();
-            auto floor = p_stack;
-            auto ceil = (uint8_t*)((size_t)p_stack + args_space_size);
-
-            if constexpr (sizeof...(Args2) == 0) {
-                f();
-            } else {
-                int i = 0;
-                R2 re = f(pass_arg<Args2>(&ceil, &i, floor)...);
-                if constexpr (std::is_fundamental_v<R2>) {
-                    *(R2*)floor = re;
-                } else {
-                    auto cc = (void(*)(void*, const void*))return_type.copy_constructor;
-                    cc(floor, &re);
-                }
-            }
-        }
-// Passed from right to left
-#else
-        template<typename T>
-        T pass_arg(uint8_t **vrsp_ptr, int *argc,
-                   uint8_t *old_rsp) const {
-            auto arg_ptr = (T*)(*vrsp_ptr);
-            if (*argc == argument_types.size() - 1){
-                *vrsp_ptr = old_rsp;
-            } else {
-                *vrsp_ptr = (uint8_t*)((size_t)*vrsp_ptr + sizeof(T));
-                *argc += 1;
-            }
-            return *arg_ptr;
-        }
-        template<typename ...Args2>
-        void call_internal(void (*f)(Args2...), uint8_t* p_stack) const {
-            constexpr auto args_space_size = calculate_args_space<R, Args...>();
-            auto floor = p_stack;
-            auto ceil = (uint8_t*)((size_t)floor + (args_space_size - args_combined_size));
-
-            if constexpr (sizeof...(Args2) == 0) {
-                f();
-            } else {
-                int i = 0;
-                f(pass_arg<Args2>(&ceil, &i, floor)...);
-            }
-        }
-
-        template<typename R2, typename ...Args2>
-        void call_internal(R2 (*f)(Args2...), uint8_t* p_stack) const {
-            constexpr auto args_space_size = calculate_args_space<R, Args...>();
-            auto floor = p_stack;
-            auto ceil = (uint8_t*)((size_t)floor + (args_space_size - args_combined_size));
-
-            if constexpr (!sizeof...(Args2)) {
-                f(pass_arg<Args>(p_stack, nullptr, 0, nullptr)...);
-            } else {
-                int i = 0;
-                R2 re = f(pass_arg<Args2>(&ceil, &i, floor)...);
-                if constexpr (std::is_fundamental_v<R2>) {
-                    *(R2*)floor = re;
-                } else {
-                    auto cc = (void(*)(void*, const void*))return_type.copy_constructor;
-                    cc(floor, &re);
-                }
-            }
-        }
-#endif
     public:
         _NO_DISCARD_ _ALWAYS_INLINE_ FunctorType get_functor() const {
             return functor;
         }
-        static void call_final(const NativeFunctionTrampoline* p_self, uint8_t* p_stack) {
-            p_self->call_internal(p_self->functor, p_stack);
+        static void call_final(const BaseTrampoline* p_self, uint8_t* p_stack) {
+            static_cast<const NativeFunctionTrampoline*>(p_self)->call_internal(p_stack, std::index_sequence_for<Args...>{});
         }
     private:
         NativeFunctionTrampoline(FunctorType f, Type p_ret_type, std::vector<Type>& p_arg_types)
                 : functor(f), return_type(p_ret_type), argument_types(std::move(p_arg_types)) {
-            caller = (decltype(caller))(call_final);
+            caller = call_final;
         }
     };
 
     class JitFunctionTrampoline : public BaseTrampoline {
+    public:
+        typedef void (*CompiledFunction)(uint8_t*);
     private:
-        void (**actual_trampoline)(uint8_t *);
+        // Written by the host while calls are running, JIT code reads it as a plain pointer
+        const std::atomic<CompiledFunction>* actual_trampoline;
         void (*recompile_cb)(const void*);
         const void* host;
+        // Runs the function without compiling it, returns false if it should be compiled instead
+        bool (*interpret_cb)(const void*, uint8_t*);
+        // Without one, every call goes through recompile_cb
+        CallBudget* budget;
         friend class BaseTrampoline;
+        static_assert(sizeof(std::atomic<CompiledFunction>) == sizeof(CompiledFunction) &&
+                      std::atomic<CompiledFunction>::is_always_lock_free);
     public:
-        static void call_final(const JitFunctionTrampoline* p_self, uint8_t* p_stack) {
+        // Slot holding the compiled code, null until the function is compiled
+        _NO_DISCARD_ _ALWAYS_INLINE_ const std::atomic<CompiledFunction>* get_actual_trampoline() const { return actual_trampoline; }
+        // JIT callers take from it before calling the slot directly, null if they must go through the trampoline
+        _NO_DISCARD_ _ALWAYS_INLINE_ CallBudget* get_call_budget() const { return budget; }
+        static _ALWAYS_INLINE_ bool is_jit_trampoline(const BaseTrampoline* p_trampoline) {
+            return p_trampoline && p_trampoline->get_caller() == call_final;
+        }
+        static void call_final(const BaseTrampoline* p_trampoline, uint8_t* p_stack) {
+            const auto p_self = static_cast<const JitFunctionTrampoline*>(p_trampoline);
+            auto compiled = p_self->actual_trampoline->load(std::memory_order_acquire);
+            if (likely(compiled && p_self->budget && p_self->budget->take())) {
+                compiled(p_stack);
+                return;
+            }
+            if (p_self->interpret_cb && !compiled && p_self->interpret_cb(p_self->host, p_stack))
+                return;
             p_self->recompile_cb(p_self->host);
-            (*(p_self->actual_trampoline))(p_stack);
+            auto function = p_self->actual_trampoline->load(std::memory_order_acquire);
+            // Evicted between the check and the call
+            if (unlikely(!function)) {
+                p_self->recompile_cb(p_self->host);
+                function = p_self->actual_trampoline->load(std::memory_order_acquire);
+            }
+            function(p_stack);
         }
     private:
         JitFunctionTrampoline(const void* p_host, void (*p_recompile_cb)(const void*),
-                              void (**p_actual_trampoline)(uint8_t*))
+                              const std::atomic<CompiledFunction>* p_actual_trampoline,
+                              bool (*p_interpret_cb)(const void*, uint8_t*), CallBudget* p_budget)
                 : host(p_host), recompile_cb(p_recompile_cb),
-                  actual_trampoline(p_actual_trampoline){
-            caller = (decltype(caller))(call_final);
+                  actual_trampoline(p_actual_trampoline), interpret_cb(p_interpret_cb), budget(p_budget){
+            caller = call_final;
         }
     };
     template<typename R, typename... Args>
@@ -239,12 +218,11 @@ namespace microjit {
         return Ref<NativeFunctionTrampoline<R, Args...>>::from_uninitialized_object(wrapped);
     }
 
-    template<class T>
-    Ref<JitFunctionTrampoline> BaseTrampoline::create_jit_trampoline(const T *p_host, void (*p_recompile_cb)(const T *),
-                                                                     void (**p_actual_trampoline)(uint8_t *)) {
-        auto trampoline = new JitFunctionTrampoline((const void*)p_host,
-                                                    (void (*)(const void*))p_recompile_cb,
-                                                    p_actual_trampoline);
+    inline Ref<JitFunctionTrampoline> BaseTrampoline::create_jit_trampoline(const void *p_host, void (*p_recompile_cb)(const void *),
+                                                                            const std::atomic<void (*)(uint8_t*)>* p_actual_trampoline,
+                                                                            bool (*p_interpret_cb)(const void*, uint8_t*),
+                                                                            CallBudget* p_budget) {
+        auto trampoline = new JitFunctionTrampoline(p_host, p_recompile_cb, p_actual_trampoline, p_interpret_cb, p_budget);
         return Ref<JitFunctionTrampoline>::from_uninitialized_object(trampoline);
     }
 }
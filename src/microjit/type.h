@@ -18,7 +18,11 @@ namespace microjit {
         template<class T>
         static void ctor(T* p_obj) { new (p_obj) T(); }
         template<class T>
-        static void copy_ctor(T* p_obj, const T* p_copy_target) { new (p_obj) T(*p_copy_target); }
+        static void copy_ctor(T* p_obj, const T* p_copy_target) {
+            // Frame slots are packed, trivially copyable values may sit at addresses they are not aligned for
+            if constexpr (std::is_trivially_copyable_v<T>) std::memcpy((void*)p_obj, (const void*)p_copy_target, sizeof(T));
+            else new (p_obj) T(*p_copy_target);
+        }
         template<class T>
         static void dtor(T* p_obj) { p_obj->~T(); }
         template<class T>
@@ -66,6 +70,8 @@ namespace microjit {
 
         template<typename T>
         static TYPE_CONSTEXPR Type create_internal(T (*)()){
+            // Variables and arguments are laid out without padding, see store_stack_value
+            static_assert(is_stack_storable_v<T>, "Non-trivially copyable types on the virtual stack must have an alignment of 1");
             TYPE_CONSTEXPR auto is_trivially_destructible  = std::is_trivially_destructible_v<T>;
 
             TYPE_CONSTEXPR auto copy_ctor = (const void*)ObjectTools::copy_ctor<T>;
@@ -0,0 +1,103 @@
+//
+// Created by cycastic on 10/19/26.
+//
+
+#ifndef MICROJIT_WORK_STEALING_DEQUE_H
+#define MICROJIT_WORK_STEALING_DEQUE_H
+
+#include <atomic>
+#include <vector>
+#include <cstdint>
+#include "def.h"
+
+namespace microjit {
+    // Chase-Lev deque of pointers (Lê et al., "Correct and Efficient Work-Stealing for Weak Memory Models")
+    // The owner pushes and takes at the bottom without locking, any other thread steals from the top
+    template <class T>
+    class WorkStealingDeque {
+    private:
+        static constexpr size_t initial_capacity = 64;
+        struct Array {
+            const int64_t capacity;
+            std::atomic<T*>* const elements;
+            explicit Array(int64_t p_capacity) : capacity(p_capacity), elements(new std::atomic<T*>[p_capacity]) {}
+            ~Array() { delete[] elements; }
+            _NO_DISCARD_ _ALWAYS_INLINE_ T* get(int64_t p_idx) const {
+                return elements[p_idx & (capacity - 1)].load(std::memory_order_relaxed);
+            }
+            _ALWAYS_INLINE_ void put(int64_t p_idx, T* p_value) {
+                elements[p_idx & (capacity - 1)].store(p_value, std::memory_order_relaxed);
+            }
+        };
+        alignas(64) std::atomic<int64_t> top{};
+        alignas(64) std::atomic<int64_t> bottom{};
+        std::atomic<Array*> array;
+        // Thieves may still be reading an outgrown array, they are only freed alongside the deque
+        std::vector<Array*> arrays{};
+
+        Array* grow(Array* p_array, int64_t p_bottom, int64_t p_top) {
+            auto bigger = new Array(p_array->capacity * 2);
+            for (auto i = p_top; i < p_bottom; i++) bigger->put(i, p_array->get(i));
+            arrays.push_back(bigger);
+            array.store(bigger, std::memory_order_release);
+            return bigger;
+        }
+    public:
+        WorkStealingDeque() : array(new Array(initial_capacity)) {
+            arrays.push_back(array.load(std::memory_order_relaxed));
+        }
+        WorkStealingDeque(const WorkStealingDeque&) = delete;
+        ~WorkStealingDeque() {
+            for (auto a : arrays) delete a;
+        }
+
+        // Owner only
+        void push(T* p_value) {
+            const auto b = bottom.load(std::memory_order_relaxed);
+            const auto t = top.load(std::memory_order_acquire);
+            auto a = array.load(std::memory_order_relaxed);
+            if (b - t > a->capacity - 1) a = grow(a, b, t);
+            a->put(b, p_value);
+            bottom.store(b + 1, std::memory_order_release);
+        }
+        // Owner only, newest first, nullptr if empty
+        T* take() {
+            const auto b = bottom.load(std::memory_order_relaxed) - 1;
+            auto a = array.load(std::memory_order_relaxed);
+            bottom.store(b, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            auto t = top.load(std::memory_order_relaxed);
+            if (t > b) {
+                bottom.store(b + 1, std::memory_order_relaxed);
+                return nullptr;
+            }
+            auto re = a->get(b);
+            if (t == b) {
+                // Last element, race the thieves for it
+                if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                    re = nullptr;
+                bottom.store(b + 1, std::memory_order_relaxed);
+            }
+            return re;
+        }
+        // Any thread, oldest first, nullptr if empty or if another thread won the race
+        T* steal() {
+            auto t = top.load(std::memory_order_acquire);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            const auto b = bottom.load(std::memory_order_acquire);
+            if (t >= b) return nullptr;
+            auto re = array.load(std::memory_order_acquire)->get(t);
+            if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                return nullptr;
+            return re;
+        }
+        // A hint, may be stale by the time it returns
+        _NO_DISCARD_ bool empty() const {
+            return bottom.load(std::memory_order_relaxed) <= top.load(std::memory_order_relaxed);
+        }
+
+        WorkStealingDeque& operator=(const WorkStealingDeque&) = delete;
+    };
+}
+
+#endif //MICROJIT_WORK_STEALING_DEQUE_H
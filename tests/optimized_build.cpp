@@ -0,0 +1,125 @@
+//
+// Created by cycastic on 10/19/26.
+//
+
+// Passes values of mixed sizes, some of them not trivially copyable, through the instance and native trampolines,
+// so that an optimized build that lays the args space out differently from the JIT fails here
+// Built and registered with ctest when MICROJIT_OPTIMIZED_BUILD is on
+
+#include <cstdio>
+#include <cstring>
+#include <microjit/orchestrator.h>
+
+// 3 bytes, so that whatever is packed after it is misaligned
+struct Odd { uint8_t bytes[3]; };
+// Wider than a register and 8-aligned, lands at offsets it is not aligned for
+struct Wide { double value; int32_t tag; };
+// Not trivially copyable, every copy and destruction checks that its source is still alive
+struct Tracked {
+    static constexpr char alive = 'A';
+    static int errors;
+    char marker;
+    char payload[6];
+    explicit Tracked(const char* p_payload) : marker(alive) { std::memcpy(payload, p_payload, sizeof(payload)); }
+    Tracked(const Tracked& p_other) : marker(alive) {
+        if (p_other.marker != alive) errors++;
+        std::memcpy(payload, p_other.payload, sizeof(payload));
+    }
+    Tracked& operator=(const Tracked& p_other) {
+        if (p_other.marker != alive || marker != alive) errors++;
+        std::memcpy(payload, p_other.payload, sizeof(payload));
+        return *this;
+    }
+    ~Tracked() {
+        if (marker != alive) errors++;
+        marker = 0;
+    }
+};
+int Tracked::errors = 0;
+
+static int failures = 0;
+
+static void expect(bool p_condition, const char* p_what){
+    if (p_condition) return;
+    std::fprintf(stderr, "FAILED: %s\n", p_what);
+    failures++;
+}
+
+static Wide combine(int8_t p_small, Odd p_odd, Wide p_wide, Tracked p_tracked){
+    return Wide{ p_wide.value * p_small, p_wide.tag + p_odd.bytes[0] + p_odd.bytes[1] + p_odd.bytes[2] + p_tracked.payload[0] };
+}
+
+static Tracked relabel(Odd p_odd, Tracked p_tracked){
+    Tracked re = p_tracked;
+    re.payload[0] = char(p_odd.bytes[2]);
+    return re;
+}
+
+int main(){
+    {
+        auto orchestrator = microjit::orchestrator();
+
+        // C++ -> JIT -> native, every argument copied into a variable first
+        auto mixed = orchestrator->create_instance<Wide, int8_t, Odd, Wide, Tracked>();
+        {
+            auto scope = mixed->get_function()->get_main_scope();
+            auto small = scope->create_variable<int8_t>();
+            auto odd = scope->create_variable<Odd>();
+            auto wide = scope->create_variable<Wide>();
+            auto tracked = scope->create_variable<Tracked>();
+            auto result = scope->create_variable<Wide>();
+            scope->construct_from_argument(small, 0);
+            scope->construct_from_argument(odd, 1);
+            scope->construct_from_argument(wide, 2);
+            scope->construct_from_argument(tracked, 3);
+            scope->invoke_native(combine, microjit::ArgumentsVector::create(small->value_reference(), odd->value_reference(),
+                                                                            wide->value_reference(), tracked->value_reference()),
+                                 result);
+            scope->function_return(result);
+        }
+
+        // Non-trivially copyable return values, through a native call and through another instance
+        auto inner = orchestrator->create_instance<Tracked, Odd, Tracked>();
+        {
+            auto scope = inner->get_function()->get_main_scope();
+            auto odd = scope->create_variable<Odd>();
+            auto tracked = scope->create_variable<Tracked>();
+            auto result = scope->create_variable<Tracked>();
+            scope->construct_from_argument(odd, 0);
+            scope->construct_from_argument(tracked, 1);
+            scope->invoke_native(relabel, microjit::ArgumentsVector::create(odd->value_reference(), tracked->value_reference()),
+                                 result);
+            scope->function_return(result);
+        }
+        auto outer = orchestrator->create_instance<Tracked, Odd, Tracked>();
+        {
+            auto scope = outer->get_function()->get_main_scope();
+            auto odd = scope->create_variable<Odd>();
+            auto tracked = scope->create_variable<Tracked>();
+            auto result = scope->create_variable<Tracked>();
+            scope->construct_from_argument(odd, 0);
+            scope->construct_from_argument(tracked, 1);
+            scope->invoke_jit(inner->get_function(), microjit::ArgumentsVector::create(odd->value_reference(),
+                                                                                       tracked->value_reference()),
+                              result);
+            scope->function_return(result);
+        }
+
+        // The first call compiles, the later ones run the compiled code
+        for (int round = 0; round < 3; round++){
+            const auto wide = mixed(int8_t(-3), Odd{ { 1, 2, 250 } }, Wide{ 1.5, 1000 }, Tracked("xyzuvw"));
+            expect(wide.value == -4.5, "double member of a Wide returned through a native call");
+            expect(wide.tag == 1000 + 1 + 2 + 250 + 'x', "int member of a Wide returned through a native call");
+
+            const auto relabeled = inner(Odd{ { 0, 0, 'Q' } }, Tracked("abcdef"));
+            expect(std::memcmp(relabeled.payload, "Qbcdef", 6) == 0, "Tracked returned through a native call");
+
+            const auto nested = outer(Odd{ { 0, 0, 'R' } }, Tracked("ghijkl"));
+            expect(std::memcmp(nested.payload, "Rhijkl", 6) == 0, "Tracked returned through another instance");
+        }
+    }
+    expect(Tracked::errors == 0, "every Tracked was copied from and destroyed while alive");
+    if (failures) return 1;
+    std::printf("OK\n");
+    return 0;
+}